@@ -0,0 +1,161 @@
+/* Benchmarks the accpanel functions on every panel, and compares
+ * accpanel_decode with the sscanf parser it replaced, on payloads recorded
+ * from acc-machvis and from the automation platform.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include "accpanel.h"
+#include "harness.h"
+
+#define BENCH_ITERATIONS    (1000000)
+
+/* What acc-machvis sends. The trailing NUL is part of the datagram. */
+static const char * machvis_payloads[] = {
+    "{\"fan\": 3, \"mode\": 1, \"delay\": 0, \"msdigit\": 7, \"lsdigit\": 7, \"filterbad\": 0}",
+    "{\"fan\": 4, \"mode\": 2, \"delay\": 0, \"msdigit\": 7, \"lsdigit\": 9, \"filterbad\": 0}",
+    "{\"fan\": 0, \"mode\": 0, \"delay\": 0, \"msdigit\": -1, \"lsdigit\": -1, \"filterbad\": 0}",
+    "{\"fan\": 1, \"mode\": 3, \"delay\": 2, \"msdigit\": 6, \"lsdigit\": 4, \"filterbad\": 1}",
+};
+
+/* What the automation platform sends: any key order, any whitespace. */
+static const char * command_payloads[] = {
+    "{\"mode\":1,\"fan\":2,\"delay\":0,\"lsdigit\":2,\"msdigit\":7,\"filterbad\":0}",
+    "{\n  \"filterbad\": 0,\n  \"delay\": 0,\n  \"msdigit\": 6,\n  \"lsdigit\": 8,\n  \"mode\": 3,\n  \"fan\": 1\n}",
+    "{ \"temperature\" : 75 , \"mode\" : 1 , \"fan\" : 3 , \"source\" : \"slider\" }",
+    "{\"fan\": 3, \"mode\": 1, \"delay\": 0, \"msdigit\": 7, \"lsdigit\": 7, \"filterbad\": 0}",
+};
+
+#define NPAYLOADS (sizeof(machvis_payloads)/sizeof(machvis_payloads[0]))
+
+struct payloads_st {
+    const char ** payloads;
+    size_t lens[NPAYLOADS];
+    size_t bytes;           /* average length */
+    int (*parse)(struct panel_st *, const char *, size_t);
+};
+
+/* The parser accpanel_parse used to be. Kept here as the baseline. */
+static int sscanf_parse(struct panel_st * panel, const char * json, size_t len)
+{
+    int r;
+    struct panel_st * p = panel;
+    int msdigit, lsdigit, fb;
+    (void)len;
+    r = sscanf(json,
+        "{\"fan\": %i, \"mode\": %i, \"delay\": %i, \"msdigit\": %i, \"lsdigit\": %i, \"filterbad\": %i}",
+        (int*)&p->fan, (int*)&p->mode, (int*)&p->delay, &msdigit, &lsdigit, &fb);
+    if(r != 6) {
+        return -EINVAL;
+    }
+    p->temperature = (msdigit<0 || lsdigit<0)? (-1) : (10*msdigit + lsdigit);
+    p->filterbad = (bool)fb;
+    return 0;
+}
+
+static int decode_parse(struct panel_st * panel, const char * json, size_t len)
+{
+    unsigned int present;
+    return accpanel_decode(panel, json, len, &present);
+}
+
+static void payloads_init(
+    struct payloads_st * p,
+    const char ** payloads,
+    int (*parse)(struct panel_st *, const char *, size_t))
+{
+    p->payloads = payloads;
+    p->parse = parse;
+    p->bytes = 0;
+    for(size_t i=0; i<NPAYLOADS; i++) {
+        p->lens[i] = strlen(payloads[i]) + 1;
+        p->bytes += p->lens[i];
+    }
+    p->bytes /= NPAYLOADS;
+}
+
+static void bench_parse(void * arg, unsigned long iterations)
+{
+    struct payloads_st * p = arg;
+    struct panel_st panel = PANEL_INITIALIZER;
+    unsigned long ok = 0;
+    for(unsigned long i=0; i<iterations; i++) {
+        size_t k = i % NPAYLOADS;
+        if(p->parse(&panel, p->payloads[k], p->lens[k]) == 0) ok++;
+    }
+    bench_sink = ok;
+}
+
+static void bench_cpy(void * arg, unsigned long iterations)
+{
+    struct panel_st a = PANEL_TESTPANEL, b = PANEL_INITIALIZER;
+    (void)arg;
+    for(unsigned long i=0; i<iterations; i++) {
+        a.temperature = i & 0xF;
+        accpanel_cpy(&b, &a);
+    }
+    bench_sink = b.temperature;
+}
+
+static void bench_atomic_store(void * arg, unsigned long iterations)
+{
+    struct panel_atomic_st * shared = arg;
+    struct panel_st a = PANEL_TESTPANEL;
+    for(unsigned long i=0; i<iterations; i++) {
+        a.temperature = i & 0xF;
+        accpanel_atomic_store(shared, &a);
+    }
+    bench_sink = accpanel_atomic_load(shared, NULL);
+}
+
+static void bench_atomic_load(void * arg, unsigned long iterations)
+{
+    struct panel_atomic_st * shared = arg;
+    struct panel_st b = PANEL_INITIALIZER;
+    unsigned long sum = 0;
+    for(unsigned long i=0; i<iterations; i++) {
+        sum += accpanel_atomic_load(shared, &b);
+    }
+    bench_sink = sum + b.temperature;
+}
+
+static void bench_sub(void * arg, unsigned long iterations)
+{
+    struct panel_st a = PANEL_TESTPANEL, b = PANEL_INITIALIZER;
+    (void)arg;
+    for(unsigned long i=0; i<iterations; i++) {
+        b.temperature = i & 0xF;
+        struct panel_st * d = accpanel_sub(&a, &b);
+        bench_sink = d->temperature;
+        free(d);
+    }
+}
+
+int main(void)
+{
+    struct payloads_st p;
+    struct panel_atomic_st shared;
+
+    payloads_init(&p, machvis_payloads, accpanel_parse);
+    bench_run("accpanel_parse/machvis", bench_parse, &p,
+        BENCH_ITERATIONS, p.bytes);
+    payloads_init(&p, machvis_payloads, sscanf_parse);
+    bench_run("sscanf/machvis", bench_parse, &p, BENCH_ITERATIONS, p.bytes);
+    payloads_init(&p, command_payloads, decode_parse);
+    bench_run("accpanel_decode/commands", bench_parse, &p,
+        BENCH_ITERATIONS, p.bytes);
+    payloads_init(&p, command_payloads, sscanf_parse);
+    bench_run("sscanf/commands", bench_parse, &p, BENCH_ITERATIONS, p.bytes);
+
+    bench_run("accpanel_cpy", bench_cpy, NULL, BENCH_ITERATIONS, 0);
+    accpanel_atomic_init(&shared, &(struct panel_st)PANEL_TESTPANEL);
+    bench_run("accpanel_atomic_store", bench_atomic_store, &shared,
+        BENCH_ITERATIONS, 0);
+    bench_run("accpanel_atomic_load", bench_atomic_load, &shared,
+        BENCH_ITERATIONS, 0);
+    bench_run("accpanel_sub", bench_sub, NULL, BENCH_ITERATIONS, 0);
+    return 0;
+}
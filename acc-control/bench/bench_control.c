@@ -0,0 +1,49 @@
+/* Benchmarks control_getclicks on the kinds of plans the control loop makes:
+ * nothing to do, a temperature change, a mode and fan change and power-on.
+ */
+
+#include <stdio.h>
+#include "accpanel.h"
+#include "control.h"
+#include "harness.h"
+
+#define BENCH_ITERATIONS    (1000000)
+
+struct plan_st {
+    struct panel_st desired;
+    struct panel_st actual;
+};
+
+static void bench_getclicks(void * arg, unsigned long iterations)
+{
+    struct plan_st * plan = arg;
+    struct buttonclick_st clicks;
+    int sum = 0;
+    for(unsigned long i=0; i<iterations; i++) {
+        control_getclicks(&clicks, &plan->desired, &plan->actual);
+        sum += clicks.plus + clicks.minus + clicks.mode + clicks.power;
+    }
+    bench_sink = sum;
+}
+
+int main(void)
+{
+    struct plan_st plan = { PANEL_TESTPANEL, PANEL_TESTPANEL };
+    bench_run("control_getclicks/same", bench_getclicks, &plan,
+        BENCH_ITERATIONS, 0);
+
+    plan.desired.temperature = 64;
+    bench_run("control_getclicks/temperature", bench_getclicks, &plan,
+        BENCH_ITERATIONS, 0);
+
+    plan.desired.mode = MODE_ECO;
+    plan.desired.fan = FAN_LOW;
+    bench_run("control_getclicks/modefan", bench_getclicks, &plan,
+        BENCH_ITERATIONS, 0);
+
+    plan.actual.mode = MODE_NONE;
+    plan.actual.fan = FAN_NONE;
+    bench_run("control_getclicks/poweron", bench_getclicks, &plan,
+        BENCH_ITERATIONS, 0);
+    return 0;
+}
@@ -0,0 +1,138 @@
+/* Benchmarks irwave: loading the GE remote from its lircd.conf, which works
+ * out the pulses of every key, and the part of a press or a burst that is
+ * not the LED (finding the keys and sending them, without pigpio). Before
+ * that, it checks the timings of every key against the numbers in the
+ * lircd.conf, and how long a 64 to 86 F burst takes on the air.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "irwave.h"
+#include "gpio.h"
+#include "harness.h"
+
+#define BENCH_ITERATIONS    (1000000)
+#define BENCH_LOADS         (2000)
+#define BENCH_CONF          "etc/GE-AHP05LZQ2.lircd.conf"
+
+/* From BENCH_CONF */
+#define GE_HEADER_MARK      (9000)
+#define GE_HEADER_SPACE     (4500)
+#define GE_BIT_MARK         (563)
+#define GE_ONE_SPACE        (1687)
+#define GE_ZERO_SPACE       (562)
+#define GE_PRE_DATA         (0x19F6)
+#define GE_GAP              (108000)
+#define GE_CARRIER_US       (26)        /* 38 kHz, give or take */
+#define GE_SWEEP            (22)        /* 64 to 86 F */
+
+static int check_key(const struct irwave_key_st * key)
+{
+    uint32_t want[IRWAVE_TIMINGS_MAX];
+    uint32_t code = (GE_PRE_DATA << 16) | (uint32_t)key->code;
+    uint64_t total = 0, high = 0, marks = 0;
+    size_t n = 0;
+
+    want[n++] = GE_HEADER_MARK;
+    want[n++] = GE_HEADER_SPACE;
+    for(int b = 31; b >= 0; b--) {
+        want[n++] = GE_BIT_MARK;
+        want[n++] = ((code >> b) & 1)? GE_ONE_SPACE : GE_ZERO_SPACE;
+    }
+    want[n++] = GE_BIT_MARK;
+    for(size_t i=0; i<n; i++) {
+        total += want[i];
+        if(!(i & 1)) marks += want[i];
+    }
+    want[n++] = GE_GAP - total;     // CONST_LENGTH
+
+    if(key->ntimings != n || memcmp(key->timings, want, sizeof(*want) * n)) {
+        fprintf(stderr, "irwave: timings of %s don't match\n", key->name);
+        return -1;
+    }
+    if(key->length_us != GE_GAP) {
+        fprintf(stderr, "irwave: %s is %u us long\n", key->name, key->length_us);
+        return -1;
+    }
+
+    // The carrier can only be off by part of a cycle per mark.
+    total = 0;
+    for(size_t i=0; i<key->npulses; i++) {
+        total += key->pulses[i].usDelay;
+        if(key->pulses[i].gpioOn) high += key->pulses[i].usDelay;
+    }
+    if(total + GE_CARRIER_US * n / 2 < GE_GAP ||
+        total > GE_GAP + GE_CARRIER_US * n / 2) {
+        fprintf(stderr, "irwave: pulses of %s are %lu us long\n",
+            key->name, (unsigned long)total);
+        return -1;
+    }
+    // 33 % duty cycle, rounded to whole microseconds
+    if(high * 100 < marks * 30 || high * 100 > marks * 37) {
+        fprintf(stderr, "irwave: %s is on %lu of %lu us\n", key->name,
+            (unsigned long)high, (unsigned long)marks);
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_load(void * arg, unsigned long iterations)
+{
+    struct irwave_st * wave = arg;
+    for(unsigned long i=0; i<iterations; i++) {
+        irwave_initialize(wave, 0, _GPIO_H_LED_IR, BENCH_CONF);
+        bench_sink = wave->keys[0].npulses;
+        irwave_finalize(wave);
+    }
+}
+
+/* Alternate between two keys, like a temperature burst and its mode press. */
+static void bench_send(void * arg, unsigned long iterations)
+{
+    struct irwave_st * wave = arg;
+    static const char * names[] = { "KEY_UP", "KEY_MODE" };
+    for(unsigned long i=0; i<iterations; i++) {
+        irwave_send(wave, irwave_key(wave, names[i & 1]));
+    }
+    bench_sink = wave->presses;
+}
+
+/* A temperature sweep, chained */
+static void bench_burst(void * arg, unsigned long iterations)
+{
+    struct irwave_st * wave = arg;
+    const struct irwave_key_st * keys[GE_SWEEP];
+    for(size_t i=0; i<GE_SWEEP; i++) keys[i] = irwave_key(wave, "KEY_UP");
+    for(unsigned long i=0; i<iterations; i++) {
+        irwave_burst(wave, keys, GE_SWEEP, 0, NULL, NULL);
+    }
+    bench_sink = wave->presses;
+}
+
+int main(void)
+{
+    static struct irwave_st wave;
+    int r;
+
+    r = irwave_initialize(&wave, 0, _GPIO_H_LED_IR, BENCH_CONF);
+    if(r) {
+        fprintf(stderr, "irwave: can't load %s: %s\n", BENCH_CONF, strerror(-r));
+        return 1;
+    }
+    for(size_t i=0; i<wave.nkeys; i++) check_key(&wave.keys[i]);
+    irwave_finalize(&wave);
+
+    bench_run("irwave_initialize", bench_load, &wave, BENCH_LOADS, 0);
+
+    irwave_initialize(&wave, 0, _GPIO_H_LED_IR, BENCH_CONF);
+    bench_burst(&wave, 1);
+    if(wave.last_us != (uint64_t)GE_SWEEP * GE_GAP) {
+        fprintf(stderr, "irwave: a sweep takes %lu us\n", 
+            (unsigned long)wave.last_us);
+    }
+    bench_run("irwave_send/desktop", bench_send, &wave, BENCH_ITERATIONS, 0);
+    bench_run("irwave_burst/desktop", bench_burst, &wave, 
+        BENCH_ITERATIONS / GE_SWEEP, 0);
+    irwave_finalize(&wave);
+    return 0;
+}
@@ -0,0 +1,148 @@
+/* Benchmarks machvis_parse on JSON and binary transmissions, and the
+ * handoff from a datagram on the machvis socket to a parsed panel that the
+ * publisher can pick up, through a running machvis_receive thread.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "accpanel.h"
+#include "machvis.h"
+#include "harness.h"
+
+#define BENCH_ITERATIONS    (1000000)
+#define BENCH_HANDOFFS      (20000)
+#define BENCH_PORT          (64999)
+
+static const char json[] =
+    "{\"fan\": 3, \"mode\": 1, \"delay\": 0, \"msdigit\": 7, \"lsdigit\": 7, \"filterbad\": 0}";
+
+/* A frame as acc-machvis would send it. */
+static size_t bench_frame(uint8_t * buf, uint32_t seq, int temperature)
+{
+    uint32_t crc;
+    memset(buf, 0, ACCPANEL_FRAME_SIZE);
+    memcpy(buf, "ACCP", 4);
+    buf[4] = ACCPANEL_FRAME_VERSION;
+    buf[6] = ACCPANEL_FRAME_SIZE;
+    for(int i=0; i<4; i++) buf[8 + i] = (seq >> (8*i)) & 0xFF;
+    buf[20] = FAN_MED;
+    buf[21] = MODE_COOL;
+    buf[23] = temperature / 10;
+    buf[24] = temperature % 10;
+    memset(&buf[28], 100, ACCPANEL_MARGINS);
+    crc = accpanel_crc32(buf, ACCPANEL_FRAME_SIZE - 4);
+    for(int i=0; i<4; i++) 
+        buf[ACCPANEL_FRAME_SIZE - 4 + i] = (crc >> (8*i)) & 0xFF;
+    return ACCPANEL_FRAME_SIZE;
+}
+
+static void bench_parse(void * arg, unsigned long iterations)
+{
+    struct machvis_st * mv = arg;
+    struct panel_atomic_st * panel = machvis_machvispanel_get(mv);
+    struct panel_st p = PANEL_INITIALIZER;
+    for(unsigned long i=0; i<iterations; i++) {
+        mv->machvispanelparsed = false;
+        machvis_parse(mv, panel);
+    }
+    accpanel_atomic_load(panel, &p);
+    bench_sink = p.temperature;
+}
+
+struct handoff_st {
+    struct machvis_st * mv;
+    int fd;
+    struct sockaddr_in addr;
+    bool binary;
+    uint32_t seq;
+};
+
+/* One datagram out, and wait for machvis to have the panel parsed. */
+static void bench_handoff(void * arg, unsigned long iterations)
+{
+    struct handoff_st * h = arg;
+    uint8_t frame[ACCPANEL_FRAME_SIZE];
+    char text[ACCPANEL_JSON_SIZE];
+    struct timespec deadline;
+    unsigned long generation = machvis_generation(h->mv), lost = 0;
+    const void * buf;
+    size_t len;
+
+    for(unsigned long i=0; i<iterations; i++) {
+        int t = 64 + (h->seq % 20);
+        if(h->binary) {
+            len = bench_frame(frame, h->seq, t);
+            buf = frame;
+        }
+        else {
+            len = snprintf(text, sizeof(text), "{\"fan\": 3, \"mode\": 1, "
+                "\"delay\": 0, \"msdigit\": %d, \"lsdigit\": %d, "
+                "\"filterbad\": 0}", t / 10, t % 10) + 1;
+            buf = text;
+        }
+        h->seq++;
+        sendto(h->fd, buf, len, 0, (struct sockaddr *)&h->addr,
+            sizeof(h->addr));
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += 1;
+        if(machvis_wait(h->mv, &generation, &deadline)) lost++;
+    }
+    if(lost) fprintf(stderr, "handoff: %lu datagrams lost\n", lost);
+}
+
+int main(void)
+{
+    static struct machvis_st mv;
+    struct panel_atomic_st panel;
+    struct machvis_slot_st * slot;
+    pthread_t receiver;
+
+    accpanel_atomic_init(&panel, &(struct panel_st)PANEL_INITIALIZER);
+    machvis_initialize(&mv, BENCH_PORT);
+    machvis_machvispanel_set(&mv, &panel);
+
+    slot = &mv.ring[mv.mailbox];
+    memcpy(slot->buffer, json, sizeof(json));
+    slot->length = sizeof(json);
+    slot->binary = false;
+    mv.machvistransmission = slot->buffer;
+    mv.machvistransmissionsize = slot->length;
+    bench_run("machvis_parse/json", bench_parse, &mv, BENCH_ITERATIONS,
+        slot->length);
+
+    slot->length = bench_frame((uint8_t *)slot->buffer, 1, 77);
+    slot->binary = true;
+    accpanel_frame_decode(&slot->frame, slot->buffer, slot->length);
+    bench_run("machvis_parse/binary", bench_parse, &mv, BENCH_ITERATIONS,
+        slot->length);
+
+    struct handoff_st h = { .mv = &mv };
+    h.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    h.addr.sin_family = AF_INET;
+    h.addr.sin_port = htons(BENCH_PORT);
+    h.addr.sin_addr.s_addr = inet_addr(MACHVIS_SOCKET_PATH);
+    pthread_create(&receiver, NULL, machvis_receive, &mv);
+    usleep(100000);     // let it bind
+
+    h.binary = false;
+    bench_run("machvis_handoff/json", bench_handoff, &h, BENCH_HANDOFFS,
+        sizeof(json));
+    h.binary = true;
+    bench_run("machvis_handoff/binary", bench_handoff, &h, BENCH_HANDOFFS,
+        ACCPANEL_FRAME_SIZE);
+
+    // One more datagram, so machvis_receive sees it has to stop.
+    mv.receive = false;
+    sendto(h.fd, json, sizeof(json), 0, (struct sockaddr *)&h.addr,
+        sizeof(h.addr));
+    pthread_join(receiver, NULL);
+    close(h.fd);
+    machvis_finalize(&mv);
+    return 0;
+}
@@ -0,0 +1,142 @@
+/* Benchmarks acc-control's side of MQTT over the loopback transport, so the
+ * broker is out of the picture: publishing panel states as they change, the
+ * history and stats buffers, and commands going through the listener
+ * routing into control_command.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "accpanel.h"
+#include "infrared.h"
+#include "irqueue.h"
+#include "machvis.h"
+#include "mqtt.h"
+#include "mqttloopback.h"
+#include "history.h"
+#include "control.h"
+#include "harness.h"
+
+#define BENCH_ITERATIONS    (200000)
+#define BENCH_PORT          (64998)
+#define BENCH_UNIT          "bench"
+
+static const char json[] =
+    "{\"fan\": 3, \"mode\": 1, \"delay\": 0, \"msdigit\": 7, \"lsdigit\": 7, \"filterbad\": 0}";
+
+struct daemon_st {
+    struct mqtt_st mqtt;        /* acc-control's connection */
+    struct mqtt_st load;        /* the other end */
+    struct machvis_st mv;
+    struct control_st control;
+    unsigned long received;     /* by load */
+    unsigned long panels;
+};
+
+static void bench_received(
+    struct mqtt_st * mqtt,
+    const char * topic,
+    const void * payload,
+    size_t len)
+{
+    struct daemon_st * d = mqtt->userdata;
+    (void)topic;
+    (void)payload;
+    (void)len;
+    d->received++;
+}
+
+/* A new panel every time, so that none is suppressed. */
+static void bench_panel(void * arg, unsigned long iterations)
+{
+    struct daemon_st * d = arg;
+    struct panel_st panel = PANEL_INITIALIZER;
+    unsigned long published = 0;
+    accpanel_parse(&panel, json, sizeof(json));
+    for(unsigned long i=0; i<iterations; i++) {
+        panel.temperature = 70 + (d->panels++ & 1);
+        accpanel_atomic_store(d->mv.machvispanel, &panel);
+        d->mv.machvispanelparsed = true;
+        d->mv.machvispanelpublished = false;
+        if(mqtt_publish_panel_state(&d->mqtt, &d->mv,
+            &d->control.publisher) == 0) published++;
+    }
+    bench_sink = published;
+}
+
+static void bench_buffer(void * arg, unsigned long iterations)
+{
+    struct daemon_st * d = arg;
+    for(unsigned long i=0; i<iterations; i++) {
+        mqtt_publish_buffer(&d->mqtt, d->control.historytopic, json,
+            sizeof(json) - 1);
+    }
+}
+
+/* Alternate between two setpoints, so every command changes the plan. */
+static void bench_command(void * arg, unsigned long iterations)
+{
+    struct daemon_st * d = arg;
+    struct panel_st desired = PANEL_INITIALIZER;
+    static const char * commands[] = {
+        "{\"temperature\": 70}", "{\"temperature\": 71}" };
+    for(unsigned long i=0; i<iterations; i++) {
+        const char * c = commands[i & 1];
+        mqtt_publish_buffer(&d->load, d->control.listentopic, c, strlen(c));
+    }
+    accpanel_atomic_load(d->control.desiredpanel, &desired);
+    bench_sink = desired.temperature;
+}
+
+int main(void)
+{
+    static struct daemon_st d;
+    static struct mqtt_loopback_st broker;
+    static struct infra_st infra;       // never sent through
+    static struct irqueue_st irq;
+    static struct irqueue_client_st client;
+    struct machvis_slot_st * slot;
+    struct panel_st panel = PANEL_INITIALIZER;
+    unsigned long expected = 0;
+
+    mqtt_loopback_initialize(&broker);
+    mqtt_initialize_loopback(&d.mqtt, NULL, &broker);
+    mqtt_initialize_loopback(&d.load, NULL, &broker);
+    d.load.message = bench_received;
+    d.load.userdata = &d;
+    mqtt_subscribe(&d.load, MQTT_TOPIC "/#");
+    mqtt_subscribe(&d.load, HISTORY_TOPIC "/#");
+
+    irqueue_initialize(&irq);
+    irqueue_emitter_add(&irq, &infra);
+    irqueue_client_initialize(&irq, &client, 0, 0);
+    machvis_initialize(&d.mv, BENCH_PORT);
+    control_initialize(&d.control, &d.mqtt, &client, &d.mv, BENCH_UNIT);
+    accpanel_parse(&panel, json, sizeof(json));
+    accpanel_atomic_store(d.control.actualpanel, &panel);
+
+    slot = &d.mv.ring[d.mv.mailbox];
+    memcpy(slot->buffer, json, sizeof(json));
+    d.mv.machvistransmissionsize = sizeof(json);
+
+    bench_run("mqtt_publish_panel_state/loopback", bench_panel, &d,
+        BENCH_ITERATIONS, sizeof(json));
+    expected += BENCH_REPEAT * BENCH_ITERATIONS + BENCH_ITERATIONS / 10 + 1;
+    bench_run("mqtt_publish_buffer/loopback", bench_buffer, &d,
+        BENCH_ITERATIONS, sizeof(json) - 1);
+    expected += BENCH_REPEAT * BENCH_ITERATIONS + BENCH_ITERATIONS / 10 + 1;
+    bench_run("mqtt_command/loopback", bench_command, &d,
+        BENCH_ITERATIONS, 20);
+
+    if(d.received != expected) {
+        fprintf(stderr, "mqtt: %lu of %lu messages arrived\n",
+            d.received, expected);
+    }
+
+    control_finalize(&d.control);
+    irqueue_finalize(&irq);
+    machvis_finalize(&d.mv);
+    mqtt_finalize(&d.load);
+    mqtt_finalize(&d.mqtt);
+    mqtt_loopback_finalize(&broker);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "harness.h"
+
+volatile uintptr_t bench_sink;
+
+static atomic_ulong bench_allocs;
+
+#ifdef BENCH_WRAP_MALLOC
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t n, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+void * __wrap_malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t n, size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    return __real_calloc(n, size);
+}
+
+void * __wrap_realloc(void * ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+#endif
+
+static double bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void bench_run(
+    const char * name,
+    bench_fn fn,
+    void * arg,
+    unsigned long iterations,
+    size_t bytes)
+{
+    double best = 0, start, elapsed, ns;
+    unsigned long allocs;
+
+    fn(arg, iterations / 10 + 1);      // warm up the caches
+
+    allocs = atomic_load(&bench_allocs);
+    for(int i = 0; i < BENCH_REPEAT; i++) {
+        start = bench_now_ns();
+        fn(arg, iterations);
+        elapsed = bench_now_ns() - start;
+        if(i == 0 || elapsed < best) best = elapsed;
+    }
+    allocs = atomic_load(&bench_allocs) - allocs;
+    ns = best / iterations;
+
+    printf("{\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.1f, ",
+        name, iterations, ns);
+    #ifdef BENCH_WRAP_MALLOC
+    printf("\"allocs_per_op\": %.2f, ",
+        (double)allocs / ((double)iterations * BENCH_REPEAT));
+    #else
+    (void)allocs;
+    printf("\"allocs_per_op\": null, ");
+    #endif
+    printf("\"ops_per_s\": %.0f, ", 1e9 / ns);
+    if(bytes)
+        printf("\"mb_per_s\": %.1f}\n", bytes * 1e3 / ns);
+    else
+        printf("\"mb_per_s\": null}\n");
+    fflush(stdout);
+}
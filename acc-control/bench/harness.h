@@ -0,0 +1,38 @@
+/* harness.h runs the microbenchmarks in bench/ and reports them, one JSON
+ * object per line:
+ *
+ *   {"name": "accpanel_parse/machvis", "iterations": 1000000,
+ *    "ns_per_op": 58.9, "allocs_per_op": 0.00, "ops_per_s": 16977928,
+ *    "mb_per_s": 1443.1}
+ *
+ * ns_per_op is the best of BENCH_REPEAT runs, after a warm-up run. Allocations
+ * are counted by wrapping malloc, calloc and realloc at link time, which the
+ * Makefile only does with GNU ld. Without it allocs_per_op is null.
+ * mb_per_s is null for benchmarks that don't process a payload.
+ */
+
+#ifndef _HARNESS_H_
+#define _HARNESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_REPEAT    (5)
+
+/* Run @param iterations operations on @param arg. */
+typedef void (*bench_fn)(void * arg, unsigned long iterations);
+
+/* Time @param fn and print its line. @param bytes is the payload of one
+ * operation, or 0.
+ */
+void bench_run(
+    const char * name,
+    bench_fn fn,
+    void * arg,
+    unsigned long iterations,
+    size_t bytes);
+
+/* Somewhere to put results, so the compiler can't drop the work. */
+extern volatile uintptr_t bench_sink;
+
+#endif /* #ifndef _HARNESS_H_ */
@@ -1,8 +1,10 @@
 #ifndef _PANEL_H_
 #define _PANEL_H_
 
-#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 enum panel_fan {
     FAN_NONE = 0,
@@ -33,14 +35,22 @@ enum panel_temperature {
     TEMPERATURE_MAXIMUM = 86
 };
 
+/* Bits reported by accpanel_decode for the fields found in a JSON object. */
+enum panel_field {
+    PANEL_FIELD_FAN         = 1 << 0,
+    PANEL_FIELD_MODE        = 1 << 1,
+    PANEL_FIELD_DELAY       = 1 << 2,
+    PANEL_FIELD_TEMPERATURE = 1 << 3,
+    PANEL_FIELD_FILTERBAD   = 1 << 4,
+    PANEL_FIELD_ALL         = (1 << 5) - 1
+};
+
 struct panel_st {
     enum panel_fan fan;
     enum panel_mode mode;
     enum panel_delay delay;
     int temperature;
     bool filterbad;
-    pthread_mutex_t mutex;
-    bool consumed;
 };
 
 #define PANEL_INITIALIZER \
@@ -49,9 +59,7 @@ struct panel_st {
     .mode = MODE_NONE, \
     .delay = DELAY_NONE, \
     .temperature = -1, \
-    .filterbad = false, \
-    .mutex = PTHREAD_MUTEX_INITIALIZER, \
-    .consumed = true \
+    .filterbad = false \
 }
 
 #define PANEL_TESTPANEL \
@@ -60,19 +68,185 @@ struct panel_st {
     .mode = MODE_COOL, \
     .delay = DELAY_NONE, \
     .temperature = 77, \
-    .filterbad = false, \
-    .mutex = PTHREAD_MUTEX_INITIALIZER, \
-    .consumed = false, \
+    .filterbad = false \
 }
 
+/* A panel that one thread stores and others load, such as the panel machvis
+ * last saw or the last command. It is a single atomic word, so readers never
+ * block the writer, nor see half a panel:
+ *
+ *   bits   0-3   fan
+ *          4-7   mode
+ *          8-11  delay
+ *         12     filterbad
+ *         16-31  temperature, signed
+ *         32-63  generation, incremented by every store
+ *
+ * The generation tells a reader whether there is something new since it last
+ * looked, without anyone having to mark the panel as consumed.
+ */
+struct panel_atomic_st {
+    _Atomic uint64_t word;
+};
+
+/* Binary panel frame, as sent by acc-machvis. All fields are little-endian.
+ *
+ *  offset  size  field
+ *   0      4     magic, ACCPANEL_FRAME_MAGIC ("ACCP")
+ *   4      1     version
+ *   5      1     flags, ACCPANEL_FRAME_FLAG_*
+ *   6      2     frame size in bytes
+ *   8      4     sequence number
+ *  12      8     capture timestamp, microseconds since the epoch
+ *  20      1     fan
+ *  21      1     mode
+ *  22      1     delay
+ *  23      1     msdigit (signed, -1 if unreadable)
+ *  24      1     lsdigit (signed, -1 if unreadable)
+ *  25      1     filterbad
+ *  26      2     reserved, zero
+ *  28      5     margins, by enum accpanel_margin (version 2 only)
+ *  33      3     reserved, zero
+ *  36      4     CRC-32 of all the bytes before it
+ *
+ * Version 1 frames end with the CRC at 28, and are 32 bytes. A margin is how
+ * far the features of a field were from their thresholds, at the closest,
+ * from 0 to 255. A field read with a small margin may well be a misread.
+ *
+ * JSON is kept as a fallback. acc-machvis starts out sending JSON, and
+ * switches to frames once acc-control answers with a capabilities datagram:
+ *
+ *   0      4     magic, ACCPANEL_CAPS_MAGIC ("ACCC")
+ *   4      1     highest frame version understood
+ *   5      3     reserved, zero
+ */
+#define ACCPANEL_FRAME_MAGIC    (0x50434341u)
+#define ACCPANEL_FRAME_VERSION  (2)
+#define ACCPANEL_FRAME_SIZE     (40)    /* of ACCPANEL_FRAME_VERSION */
+#define ACCPANEL_FRAME_V1_SIZE  (32)
+/* Nothing on the panel changed since the last frame that was parsed, which
+ * is sent again as it was.
+ */
+#define ACCPANEL_FRAME_FLAG_UNCHANGED   (1 << 0)
+#define ACCPANEL_CAPS_MAGIC     (0x43434341u)
+#define ACCPANEL_CAPS_SIZE      (8)
+#define ACCPANEL_JSON_SIZE      (128)   /* fits any accpanel_*snprint */
+
+/* The margins of a frame, one per field of the panel. */
+enum accpanel_margin {
+    ACCPANEL_MARGIN_FAN,
+    ACCPANEL_MARGIN_MODE,
+    ACCPANEL_MARGIN_DELAY,
+    ACCPANEL_MARGIN_TEMPERATURE,
+    ACCPANEL_MARGIN_FILTERBAD,
+    ACCPANEL_MARGINS
+};
+
+struct accpanel_frame_st {
+    uint8_t version;
+    uint8_t flags;
+    uint32_t seq;
+    uint64_t timestamp;
+    uint8_t fan;
+    uint8_t mode;
+    uint8_t delay;
+    int8_t msdigit;
+    int8_t lsdigit;
+    uint8_t filterbad;
+    uint8_t margins[ACCPANEL_MARGINS];  /* all 0 in version 1 frames */
+};
+
 int accpanel_initialize(struct panel_st * panel, struct panel_st * template);
-int accpanel_parse(struct panel_st * panel, const char * json);
+/* Decode the JSON object in the first @param len bytes of @param json. It does
+ * not need to be NUL terminated, and keys can come in any order. Only the 
+ * fields present are written to @param panel, and @param present (if not NULL)
+ * gets a mask of `enum panel_field`. The temperature is either a "temperature"
+ * key, TEMPERATURE_MINIMUM to TEMPERATURE_MAXIMUM or -1, or the "msdigit" and
+ * "lsdigit" pair. Unknown keys are skipped. 
+ * @returns 0 on success or -EINVAL, in which case @param panel is untouched.
+ */
+int accpanel_decode(
+    struct panel_st * panel, 
+    const char * json, 
+    size_t len, 
+    unsigned int * present);
+
+/* Like accpanel_decode, but every field must be present. */
+int accpanel_parse(struct panel_st * panel, const char * json, size_t len);
 struct panel_st * accpanel_sub(struct panel_st * a, struct panel_st * b);
 
-/* Copy the contents of @param src to @param dest, respecting the mutex locks.
- * The `consumed` attribute is also copied. @returns 0 on success, negative 
- * errnos on failure.
+/* Print @param panel in the JSON of acc-machvis, the temperature as msdigit
+ * and lsdigit (both -1 if it is -1). Returns what snprintf returns.
+ */
+int accpanel_snprint(char * str, size_t n, const struct panel_st * panel);
+
+/* @returns true if the panel fields of @param a and @param b match. */
+bool accpanel_equal(const struct panel_st * a, const struct panel_st * b);
+
+/* Copy the contents of @param src to @param dest. @returns 0 on success, 
+ * negative errnos on failure.
  */
-int accpanel_cpy(struct panel_st * dest, struct panel_st * src, bool lock);
+int accpanel_cpy(struct panel_st * dest, const struct panel_st * src);
+
+/* Set @param shared to @param panel, at generation 0. Not thread-safe. */
+void accpanel_atomic_init(
+    struct panel_atomic_st * shared, 
+    const struct panel_st * panel);
+
+/* Copy @param shared to @param panel, which can be NULL to only get the
+ * generation. @returns the generation of what was copied.
+ */
+uint32_t accpanel_atomic_load(
+    struct panel_atomic_st * shared, 
+    struct panel_st * panel);
+
+/* Publish @param panel in @param shared. @returns the new generation. */
+uint32_t accpanel_atomic_store(
+    struct panel_atomic_st * shared, 
+    const struct panel_st * panel);
+
+/* @returns true if @param buf starts like a binary panel frame. */
+bool accpanel_frame_is(const void * buf, size_t len);
+
+/* Decode the binary frame in @param buf into @param frame. @returns 0 on
+ * success, -EINVAL if it is not a frame, -EPROTONOSUPPORT if the version is
+ * unknown, or -EBADMSG if the CRC does not match.
+ */
+int accpanel_frame_decode(
+    struct accpanel_frame_st * frame, 
+    const void * buf, 
+    size_t len);
+
+/* Copy the panel fields of @param frame to @param panel. @returns 0 on success
+ * or -EINVAL if a field is out of range, in which case @param panel is left
+ * untouched.
+ */
+int accpanel_frame_topanel(
+    struct panel_st * panel, 
+    const struct accpanel_frame_st * frame);
+
+/* Print @param frame as the JSON that acc-machvis would have sent. Returns
+ * what snprintf returns.
+ */
+int accpanel_frame_snprint(
+    char * str, 
+    size_t n, 
+    const struct accpanel_frame_st * frame);
+
+/* Encode @param frame into @param buf, as acc-machvis would send it, in the
+ * layout of frame->version. @returns the size of the frame, or 0 if @param n
+ * is too small or the version is unknown.
+ */
+size_t accpanel_frame_encode(
+    void * buf, 
+    size_t n, 
+    const struct accpanel_frame_st * frame);
+
+/* Write a capabilities datagram to @param buf. @returns its size, or 0 if 
+ * @param n is too small.
+ */
+size_t accpanel_caps_encode(void * buf, size_t n);
+
+uint32_t accpanel_crc32(const void * buf, size_t len);
 
 #endif /* #ifndef _PANEL_H_ */
@@ -0,0 +1,127 @@
+/* acsim.h is a software model of the GE AHP05LZQ2 front panel, for desktop
+ * builds. It takes the key codes that infrared_send would have sent, and
+ * sends what acc-machvis would have seen to a machvis socket, so the control
+ * loop can run closed-loop without an air conditioner.
+ *
+ * The model follows the unit, and the rules control_getclicks plans with:
+ *
+ *   power      toggles. The unit comes back on in the mode, fan and setpoint
+ *              it had. Other keys are ignored while it is off, except delay.
+ *   mode       COOL -> ECO -> FAN -> COOL
+ *   speed      AUTO -> LOW -> MED -> HIGH -> AUTO. MODE_FAN has no FAN_AUTO,
+ *              so it is skipped there, and a unit on FAN_AUTO that enters
+ *              MODE_FAN runs on FAN_HIGH.
+ *   up, down   setpoint, TEMPERATURE_MINIMUM to TEMPERATURE_MAXIMUM. In
+ *              MODE_FAN the display shows the room temperature instead, and
+ *              the setpoint can't be changed.
+ *   delay      delay-off timer LED while on, delay-on while off, toggles.
+ *   eco        straight to MODE_ECO.
+ *
+ * A press takes effect latency_ms after it is sent, and drop_percent of them
+ * are lost, picked by a PRNG seeded with seed, so a run can be repeated.
+ * Datagrams go out every frame_ms, as JSON until machvis answers with its
+ * capabilities and then as binary frames, like acc-machvis. Frames read the
+ * panel with the largest margins, unless acsim_misread asks for one wrong.
+ */
+
+#ifndef _ACSIM_H_
+#define _ACSIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "accpanel.h"
+#include "infrared.h"
+
+#define ACSIM_LATENCY_MS    (0)
+#define ACSIM_FRAME_MS      (10)
+#define ACSIM_ROOM          (78)
+#define ACSIM_QUEUE_MAX     (64)    /* presses waiting for their latency */
+
+struct acsim_config_st {
+    long latency_ms;
+    int drop_percent;
+    long frame_ms;
+    int room;               /* shown in MODE_FAN */
+    uint32_t seed;
+};
+
+struct acsim_press_st {
+    enum InfraCodes code;
+    struct timespec due;
+};
+
+struct acsim_st {
+    struct acsim_config_st config;
+
+    /* The unit */
+    bool on;
+    enum panel_mode mode;
+    enum panel_fan fan;
+    int setpoint;
+    enum panel_delay delay;
+    bool filterbad;
+
+    struct acsim_press_st queue[ACSIM_QUEUE_MAX];
+    size_t head;
+    size_t length;
+    uint32_t rng;
+
+    int fd;
+    struct sockaddr_in addr;
+    bool binary;            /* machvis said it takes frames */
+    uint32_t seq;
+
+    /* Sent once instead of the panel, by acsim_misread */
+    bool misread;
+    struct panel_st misreadpanel;
+    uint8_t misreadmargin;
+
+    unsigned long presses;
+    unsigned long dropped;
+    unsigned long frames;
+    unsigned long misreads;     /* sent */
+
+    volatile bool run;      /* Controls the acsim_run thread */
+    pthread_mutex_t mutex;
+};
+
+/* Fill @param config with the defaults. */
+void acsim_config_default(struct acsim_config_st * config);
+
+/* Initialize @param sim to send to the machvis socket on @param port. The
+ * unit starts off, in MODE_COOL, FAN_AUTO at 72.
+ */
+int acsim_initialize(
+    struct acsim_st * sim,
+    int port,
+    const struct acsim_config_st * config);
+int acsim_finalize(struct acsim_st * sim);
+
+/* A key press reached the unit. */
+void acsim_press(struct acsim_st * sim, enum InfraCodes code);
+
+/* Put the unit in the state of @param panel straight away, as if someone
+ * used the remote. A panel with MODE_NONE is off.
+ */
+void acsim_panel_set(struct acsim_st * sim, const struct panel_st * panel);
+
+/* What the panel shows right now. */
+void acsim_panel_get(struct acsim_st * sim, struct panel_st * panel);
+
+/* Send @param panel, read with every margin @param margin, in the next frame
+ * only, as if acc-machvis misread the panel once. The unit is left alone.
+ */
+void acsim_misread(
+    struct acsim_st * sim, 
+    const struct panel_st * panel, 
+    uint8_t margin);
+
+/* Thread that applies the presses as they come due and sends the panel
+ * every frame_ms, until run is cleared.
+ */
+void *acsim_run(void * args);
+
+#endif /* #ifndef _ACSIM_H_ */
@@ -3,29 +3,126 @@
 
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
 #include "mqtt.h"
 #include "accpanel.h"
+#include "irqueue.h"
+#include "history.h"
+#include "trace.h"
+
+/* How long to plan from the presses sent, rather than from the panel, when
+ * machvis has not caught up with them yet.
+ */
+#define CONTROL_EXPECTED_MS     (3000)
+/* After a partial command (power-on, leaving MODE_FAN), how long to wait for
+ * the panel to show it, and how long it must keep showing it before the rest
+ * of the command is sent.
+ */
+#define CONTROL_CONVERGE_DEADLINE_MS    (10000)
+#define CONTROL_CONVERGE_SETTLE_MS      (300)
+
+/* *** buttonclick data structures ***
+ * Always update together the buttonclick_enum, buttonclick_st and the 
+ * buttonclick_to_infracodes_binding in control.c.
+ * 
+ * The button clicks will be sent out in the order they appear in the data
+ * structures. For example, if power is at the top of the list, and then fan, 
+ * the power button is the first to be pressed, then the fan, and so on.
+ * 
+ */
+
+enum buttonclick_enum {
+    BUTTON_POWER = 0,
+    BUTTON_MODE,
+    BUTTON_FAN,
+    BUTTON_DELAY,
+    BUTTON_PLUS,
+    BUTTON_MINUS,
+    BUTTON_ENUMSIZE          // always keep last
+};
+
+struct buttonclick_st {
+    int power;
+    int mode;
+    int fan;
+    int delay;
+    int plus;
+    int minus;
+};
 
 struct control_st {
     struct mqtt_st * mqtt;
     struct machvis_st * mv;
-    struct infra_st * infra;
-    struct panel_st * desiredpanel;
-    struct panel_st * actualpanel;
+    struct irqueue_client_st * ir;
+    struct mqtt_publisher_st publisher; /* where the panel state goes */
+    char listentopic[MQTT_TOPIC_SIZE];  /* where commands come from */
+    char historytopic[MQTT_TOPIC_SIZE]; /* where history batches go */
+    struct history_st history;
+    unsigned long historyreceived;      /* machvis count at the last sample */
+    char statstopic[MQTT_TOPIC_SIZE];   /* where the trace histograms go */
+    struct trace_st trace;
+    unsigned long tracegeneration;      /* machvis panel last checked */
+    struct panel_atomic_st * desiredpanel;  /* the last command */
+    struct panel_atomic_st * actualpanel;   /* what machvis last saw */
+    uint32_t desiredplanned;            /* generations the last plan took */
+    uint32_t actualplanned;
+    struct panel_st expected;           /* the panel after the last burst */
+    bool expectedvalid;
+    struct timespec expectedsince;
+    unsigned long preempted;            /* bursts cut short by a command */
+    long expected_ms;                   /* CONTROL_EXPECTED_MS */
+    long deadline_ms;                   /* CONTROL_CONVERGE_DEADLINE_MS */
+    long settle_ms;                     /* CONTROL_CONVERGE_SETTLE_MS */
     bool publish;
     bool loop;
     pthread_t control_publish_thread;
     pthread_t control_loop_thread;
 };
 
+/* Initialize the control loop of one AC unit. If @param name is not NULL or
+ * empty, it is appended to the MQTT topics, as in `ac-cloudifier/name`.
+ * @param mqtt can be NULL for a unit that only takes commands through
+ * control_command, in which case control_publish must not be started.
+ */
 int control_initialize(
     struct control_st * control, 
     struct mqtt_st * mqtt, 
-    struct infra_st * infra,
-    struct machvis_st * mv);
+    struct irqueue_client_st * ir,
+    struct machvis_st * mv,
+    const char * name);
 int control_finalize(struct control_st * control);
+
+/* Take the JSON command in the first @param len bytes of @param payload.
+ * Commands can carry only some of the fields. @returns 0, or -EINVAL if
+ * there is nothing to take from it.
+ */
+int control_command(
+    struct control_st * control, 
+    const void * payload, 
+    size_t len);
+
+/* A newer command arrived. Stop the burst on the air after the current
+ * press, so that the rest is planned against the new command.
+ */
+void control_preempt(struct control_st * control);
 void *control_publish(void *args);
 void *control_listen(void *args);
 void *control_loop(void *args);
 
+/* Work out the @param clicks that take the AC from @param actual to @param
+ * desired. @returns 0, -EAGAIN if only the first part of the way can be
+ * planned (the rest once the AC shows it), or another negative errno.
+ */
+int control_getclicks(
+    struct buttonclick_st * clicks,
+    struct panel_st * desired, 
+    struct panel_st * actual);
+
+/* @returns true if @param actual shows what @param desired asks for. The
+ * temperature doesn't count when the AC is off or in MODE_FAN.
+ */
+bool control_reached(
+    const struct panel_st * actual, 
+    const struct panel_st * desired);
+
 #endif /* #ifndef _CONTROL_H_ */
\ No newline at end of file
@@ -0,0 +1,102 @@
+/* gateway.h lets one acc-control process drive several AC units. Every unit
+ * has its own machvis socket, panel state and control loop. All of them share
+ * one MQTT connection and one infrared queue.
+ *
+ * The configuration file has one declaration per line, `#` starts a comment:
+ *
+ *   emitter <index> [lircd socket | wave <lircd.conf>]
+ *   unit <name> port <port> [emitter <index>] [transmitter <n>]
+ *        [debounce <ms>] [heartbeat <s>] [deadline <ms>] [settle <ms>]
+ *        [interval <ms>]
+ *   simulator [latency <ms>] [drop <percent>] [frame <ms>] [room <F>]
+ *        [seed <n>]
+ *
+ * Emitters are numbered from 0, in order. Without any emitter lines, emitter
+ * 0 is the default lircd socket. A `wave` emitter sends from the GPIO without
+ * lircd (irwave.h), with the remote in the lircd.conf; there can be only one,
+ * and it has only transmitter 1. A unit publishes on `ac-cloudifier/<name>`
+ * and listens on `ac-cloudifier-cmd/<name>`. Units that share an emitter can
+ * pick their LIRC transmitter with `transmitter`. `debounce` and `heartbeat`
+ * override MQTT_PUBLISH_DEBOUNCE_MS and MQTT_PUBLISH_HEARTBEAT_S. `deadline` and
+ * `settle` override CONTROL_CONVERGE_DEADLINE_MS and CONTROL_CONVERGE_SETTLE_MS.
+ * `interval` is the shortest time between presses the unit takes, from start
+ * to start, if it is longer than the gap of the remote (IRQUEUE_INTERVAL_MS).
+ *
+ * `simulator` is only for desktop builds. Every unit then gets a simulated
+ * AC (acsim.h) that takes the presses of its emitter and transmitter and
+ * sends the panel to its machvis port, in place of acc-machvis.
+ */
+
+#ifndef _GATEWAY_H_
+#define _GATEWAY_H_
+
+#include <stddef.h>
+#include <pthread.h>
+#include "gpio.h"
+#include "infrared.h"
+#include "irqueue.h"
+#include "machvis.h"
+#include "mqtt.h"
+#include "control.h"
+#include "acsim.h"
+
+#define GATEWAY_UNITS_MAX       (IRQUEUE_CLIENTS_MAX)
+#define GATEWAY_EMITTERS_MAX    (IRQUEUE_EMITTERS_MAX)
+#define GATEWAY_NAME_SIZE       (64)
+#define GATEWAY_PATH_SIZE       (256)
+
+struct gateway_unit_st {
+    char name[GATEWAY_NAME_SIZE];   /* empty in single unit mode */
+    int port;
+    unsigned int emitter;
+    int transmitter;
+    int debounce_ms;                /* -1 for the default */
+    int heartbeat_s;                /* -1 for the default */
+    int deadline_ms;                /* -1 for the default */
+    int settle_ms;                  /* -1 for the default */
+    int interval_ms;                /* -1 for the default */
+    struct machvis_st mv;
+    struct irqueue_client_st ir;
+    struct control_st control;
+    pthread_t machvis_thread;
+    struct acsim_st sim;            /* if the gateway simulates */
+    pthread_t sim_thread;
+};
+
+struct gateway_emitter_st {
+    char lircd[GATEWAY_PATH_SIZE];  /* empty for the default socket */
+    char wave[GATEWAY_PATH_SIZE];   /* lircd.conf, to send without lircd */
+    struct infra_st infra;
+};
+
+struct gateway_st {
+    struct gateway_emitter_st emitters[GATEWAY_EMITTERS_MAX];
+    size_t nemitters;
+    struct gateway_unit_st units[GATEWAY_UNITS_MAX];
+    size_t nunits;
+    struct irqueue_st irq;
+    pthread_t irqueue_thread;
+    bool simulate;
+    struct acsim_config_st simconfig;
+};
+
+/* Configure @param gw with a single unnamed unit on the default port and
+ * emitter, which is how acc-control runs without a configuration file.
+ */
+int gateway_default(struct gateway_st * gw);
+
+/* Configure @param gw from the file at @param path. @returns 0, or a
+ * negative errno if the file can't be read or has errors (which are logged).
+ */
+int gateway_load(struct gateway_st * gw, const char * path);
+
+/* Open the emitters and start the threads of every unit. */
+int gateway_start(
+    struct gateway_st * gw,
+    struct GPIO * gpio,
+    struct mqtt_st * mqtt);
+
+/* Stop the threads started by gateway_start and release everything. */
+int gateway_stop(struct gateway_st * gw);
+
+#endif /* #ifndef _GATEWAY_H_ */
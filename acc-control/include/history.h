@@ -0,0 +1,98 @@
+/* history.h buffers the panel state of a unit, sampled once a second, and
+ * encodes it in batches for the history topic.
+ *
+ * A batch is little-endian binary:
+ *
+ *   u8      version, HISTORY_VERSION
+ *   u8      reserved, zero
+ *   u16     number of samples
+ *   u64     timestamp of the first sample, milliseconds since the epoch
+ *   records, until every sample is accounted for
+ *
+ * Each record starts with a tag byte and a varint (LEB128) with the time
+ * since the previous sample, in milliseconds:
+ *
+ *   tag & HISTORY_TAG_RUN   varint n follows. n samples, each `delta` after
+ *                           the previous one, with nothing changed.
+ *   otherwise               one sample. The low bits of the tag are the
+ *                           `enum panel_field` bits that changed, and one
+ *                           byte per changed field follows, in bit order.
+ *                           The temperature byte is signed.
+ *
+ * The first record always has every field. utils/historydecode.py turns a
+ * batch back into rows.
+ */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "accpanel.h"
+
+#define HISTORY_TOPIC           "ac-cloudifier-history"
+#define HISTORY_VERSION         (1)
+#define HISTORY_SAMPLE_MS       (1000)
+#define HISTORY_BATCH_S         (60)
+#define HISTORY_SAMPLES_MAX     (600)
+#define HISTORY_TAG_RUN         (0x80)
+
+#define HISTORY_HEADER_SIZE     (12)
+/* tag, two varints and five fields */
+#define HISTORY_RECORD_MAX      (1 + 10 + 10 + 5)
+#define HISTORY_BUFFER_SIZE \
+    (HISTORY_HEADER_SIZE + HISTORY_SAMPLES_MAX * HISTORY_RECORD_MAX)
+
+struct history_sample_st {
+    uint64_t timestamp;     /* milliseconds since the epoch */
+    uint8_t fan;
+    uint8_t mode;
+    uint8_t delay;
+    int8_t temperature;
+    uint8_t filterbad;
+};
+
+struct history_st {
+    long sample_ms;
+    long batch_s;
+    struct history_sample_st samples[HISTORY_SAMPLES_MAX];
+    size_t nsamples;
+    unsigned long dropped;      /* samples lost to a full buffer */
+    uint64_t nextsample;        /* when the next sample is due, in ms */
+    uint64_t nextbatch;         /* when the next batch is due, in ms */
+    uint8_t buffer[HISTORY_BUFFER_SIZE];
+};
+
+int history_initialize(struct history_st * h);
+
+/* Milliseconds since the epoch. */
+uint64_t history_now(void);
+
+/* Record @param panel if a sample is due at @param now. Samples are kept on
+ * a fixed grid of sample_ms, so steady stretches encode as runs. @returns
+ * true if a sample was recorded.
+ */
+bool history_sample(
+    struct history_st * h,
+    const struct panel_st * panel,
+    uint64_t now);
+
+/* Skip the samples that were due while there was nothing to sample. */
+void history_skip(struct history_st * h, uint64_t now);
+
+/* If a batch is due at @param now and there are samples, encode them into
+ * the internal buffer and start a new batch. @returns the encoded size, or 0.
+ */
+size_t history_batch(struct history_st * h, uint64_t now);
+
+/* Encode @param n samples into @param buf. @returns the size used, or 0 if
+ * @param size is too small.
+ */
+size_t history_encode(
+    const struct history_sample_st * samples,
+    size_t n,
+    uint8_t * buf,
+    size_t size);
+
+#endif /* #ifndef _HISTORY_H_ */
@@ -5,6 +5,7 @@
 # include <config.h>	// this is LIRC code
 #endif
 #include "gpio.h"
+#include "irwave.h"
 
 enum InfraCodes {
         infra_power     =   0, 
@@ -22,17 +23,73 @@ struct infra_dev_st {
     char * InfraStrings[];
 };
 
+#define INFRARED_BURST_MAX  (64)     /* presses in one infrared_send_burst */
+
+/* Asked between the presses of a burst. @returns true to stop there. */
+typedef irwave_stop_fn infrared_stop_fn;
+
+struct acsim_st;
+#ifdef _DESKTOP_BUILD_
+#define INFRARED_SIMULATORS_MAX (16)
+#endif
+
 /* Holds variables for the infra object. 
  */
 struct infra_st {
     int _fd;
     struct infra_dev_st * dev;
+    struct irwave_st * wave;        /* NULL when sending through lircd */
     struct GPIO * gpio;
+    #ifdef _DESKTOP_BUILD_
+    int transmitter;                /* as set by infrared_transmitter_set */
+    struct acsim_st * sims[INFRARED_SIMULATORS_MAX];
+    int simtransmitters[INFRARED_SIMULATORS_MAX];
+    size_t nsims;
+    #endif
 };
 
-int infrared_initialize(struct infra_st * infra, struct GPIO * gpio);
+/* Opens the lircd socket at @param lircd, or the default one if NULL. */
+int infrared_initialize(
+    struct infra_st * infra, 
+    struct GPIO * gpio, 
+    const char * lircd);
+/* Send from the GPIO instead, with the remote in the lircd.conf at @param
+ * conf (irwave.h). It must have every key of infra_dev_st. The only
+ * transmitter is then 1, the LED on _GPIO_H_LED_IR.
+ */
+int infrared_initialize_wave(
+    struct infra_st * infra, 
+    struct GPIO * gpio, 
+    const char * conf);
 int infrared_finalize(struct infra_st * infra);
 /* This is a blocking call*/
 int infrared_send(struct infra_st * infra, enum InfraCodes code);
+/* Send the @param n presses in @param codes, at least @param interval_ms
+ * apart from start to start, as one chained transmission on wave emitters
+ * and one press after the other on lircd. Before every press but the first,
+ * @param stop (if not NULL) is called with @param arg, and the burst ends
+ * there if it returns true. This is a blocking call. @returns the number of
+ * presses sent, or a negative errno if none could be.
+ */
+int infrared_send_burst(
+    struct infra_st * infra, 
+    const enum InfraCodes * codes, 
+    size_t n,
+    long interval_ms,
+    infrared_stop_fn stop,
+    void * arg);
+/* Route the following sends to LIRC transmitter @param transmitter only (as
+ * in `irsend SET_TRANSMITTERS`). Transmitters are numbered from 1.
+ */
+int infrared_transmitter_set(struct infra_st * infra, int transmitter);
+
+/* Desktop builds only: send the presses to the simulated AC @param sim
+ * instead, when LIRC transmitter @param transmitter is selected (0 for any).
+ * @returns 0, -ENOSPC, or -ENOTSUP in hardware builds.
+ */
+int infrared_simulator_add(
+    struct infra_st * infra, 
+    struct acsim_st * sim, 
+    int transmitter);
 
 #endif
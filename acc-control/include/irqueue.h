@@ -0,0 +1,98 @@
+/* irqueue.h is the shared infrared transmit queue. Every AC unit owns an
+ * irqueue_client_st, and a single thread (irqueue_run) sends the queued
+ * presses. A burst goes out as one infrared_send_burst, chained on wave
+ * emitters. When several units have presses queued, they are interleaved one
+ * press at a time, so a long burst on one unit does not hold up the others;
+ * a chained burst stops between presses as soon as another unit has
+ * presses queued. A burst can be cancelled between presses, when the unit
+ * has a newer command and the rest of the burst is no longer wanted.
+ */
+
+#ifndef _IRQUEUE_H_
+#define _IRQUEUE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "infrared.h"
+#include "trace.h"
+
+#define IRQUEUE_EMITTERS_MAX    (4)
+#define IRQUEUE_CLIENTS_MAX     (16)
+#define IRQUEUE_BURST_MAX       (INFRARED_BURST_MAX)   /* presses in one burst */
+#define IRQUEUE_INTERVAL_MS     (0)     /* besides the remote's gap */
+
+struct irqueue_st;
+
+/* One per AC unit. A client has at most one burst queued at a time. */
+struct irqueue_client_st {
+    struct irqueue_st * queue;
+    unsigned int emitter;       /* index into irqueue_st.emitters */
+    int transmitter;            /* LIRC transmitter, or 0 to leave it alone */
+    long interval_ms;           /* shortest time from press to press */
+    struct trace_st * trace;    /* times every press, if not NULL */
+    enum InfraCodes burst[IRQUEUE_BURST_MAX];
+    size_t length;
+    size_t sent;
+    bool pending;
+    unsigned long cancels;      /* irqueue_cancel calls so far */
+    unsigned long ticket;       /* cancels when the burst was planned */
+    pthread_cond_t done;
+};
+
+struct irqueue_st {
+    struct infra_st * emitters[IRQUEUE_EMITTERS_MAX];
+    int transmitters[IRQUEUE_EMITTERS_MAX];     /* currently selected */
+    size_t nemitters;
+    struct irqueue_client_st * clients[IRQUEUE_CLIENTS_MAX];
+    size_t nclients;
+    size_t next;                /* round-robin position in clients */
+    volatile bool run;          /* Controls the irqueue_run thread */
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+};
+
+int irqueue_initialize(struct irqueue_st * queue);
+int irqueue_finalize(struct irqueue_st * queue);
+
+/* Add an initialized infra_st to the queue. @returns its emitter index, or a
+ * negative errno.
+ */
+int irqueue_emitter_add(struct irqueue_st * queue, struct infra_st * infra);
+
+/* Register @param client with @param queue, sending through the emitter
+ * with index @param emitter. @returns 0 or a negative errno.
+ */
+int irqueue_client_initialize(
+    struct irqueue_st * queue,
+    struct irqueue_client_st * client,
+    unsigned int emitter,
+    int transmitter);
+
+/* @returns the ticket to plan a burst of @param client with. Take it before
+ * working out what to send: irqueue_cancel calls from then on cancel the
+ * burst, even if it is not queued yet.
+ */
+unsigned long irqueue_ticket(struct irqueue_client_st * client);
+
+/* Queue @param n presses, planned with @param ticket, and wait for them to be
+ * sent. @returns the number of presses sent, which is less than @param n if
+ * the burst was cancelled or a press failed, or a negative errno.
+ */
+int irqueue_send(
+    struct irqueue_client_st * client, 
+    const enum InfraCodes * codes, 
+    size_t n,
+    unsigned long ticket);
+
+/* Stop the burst of @param client after the press that is on the air, if
+ * any, and any burst planned before now that is still to be sent.
+ * irqueue_send returns the presses sent until then.
+ */
+void irqueue_cancel(struct irqueue_client_st * client);
+
+/* Thread that sends the queued presses until irqueue_stop is called. */
+void *irqueue_run(void *args);
+void irqueue_stop(struct irqueue_st * queue);
+
+#endif /* #ifndef _IRQUEUE_H_ */
@@ -0,0 +1,148 @@
+/* irwave.h sends infrared codes straight from the GPIO, without lircd. It
+ * reads the remote from a lircd.conf (etc/GE-AHP05LZQ2.lircd.conf), works
+ * out the marks and spaces of every key once, and plays them through pigpio
+ * waveforms on _GPIO_H_LED_IR.
+ *
+ * Only what the GE remote uses is supported: SPACE_ENC, with or without
+ * CONST_LENGTH, `header`, `one`, `zero`, `ptrail`, `pre_data`, `post_data`,
+ * `gap`, `frequency` and `duty_cycle`. A key is sent as
+ *
+ *   header, pre_data, the code, post_data, ptrail, gap
+ *
+ * with the bits most significant first. Every mark is modulated with the
+ * carrier. With CONST_LENGTH the gap is counted from the start of the key,
+ * as lircd does, so presses sent back to back are `gap` apart.
+ *
+ * A burst of presses goes out as one pigpio wave chain: the waveform of
+ * every key is made once and kept, and the chain repeats it as many times
+ * as it is pressed in a row, so there is nothing to do between presses.
+ *
+ * pigpio has a single waveform transmitter, so there can only be one irwave
+ * per process. In desktop builds nothing is played: irwave_format gives the
+ * timings of a key instead, to check them against the lircd.conf.
+ */
+
+#ifndef _IRWAVE_H_
+#define _IRWAVE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#ifndef _DESKTOP_BUILD_
+#include <pigpiod_if2.h>
+#endif
+
+#define IRWAVE_NAME_SIZE    (32)
+#define IRWAVE_KEYS_MAX     (32)
+#define IRWAVE_BITS_MAX     (64)
+/* header, pre_data, code, post_data, ptrail and the gap */
+#define IRWAVE_TIMINGS_MAX  (2 + 2 * 3 * IRWAVE_BITS_MAX + 2)
+#define IRWAVE_CHAIN_MAX    (600)   /* bytes in a pigpio wave chain */
+/* How long before the next press of a chain a stop is asked for. It must
+ * be shorter than the gap, so the chain is stopped between presses.
+ */
+#define IRWAVE_STOP_MARGIN_US   (5000)
+
+#define IRWAVE_FLAG_SPACE_ENC       (1 << 0)
+#define IRWAVE_FLAG_CONST_LENGTH    (1 << 1)
+
+#ifdef _DESKTOP_BUILD_
+/* The same as pigpio's, so desktop builds can work out the carrier too. */
+typedef struct {
+    uint32_t gpioOn;
+    uint32_t gpioOff;
+    uint32_t usDelay;
+} gpioPulse_t;
+#endif
+
+/* The remote, as written in the lircd.conf. Times are in microseconds. */
+struct irwave_remote_st {
+    char name[IRWAVE_NAME_SIZE];
+    int flags;
+    int bits;
+    uint32_t header[2];         /* mark, space. Zero if there is none */
+    uint32_t one[2];
+    uint32_t zero[2];
+    uint32_t ptrail;
+    int pre_data_bits;
+    uint64_t pre_data;
+    int post_data_bits;
+    uint64_t post_data;
+    uint32_t gap;
+    uint32_t frequency;         /* Hz */
+    int duty_cycle;             /* percent */
+};
+
+/* A key, ready to send. timings[] alternates marks and spaces, starting
+ * with a mark, and the last one is the gap. pulses[] is the same with the
+ * carrier, as pigpio takes it.
+ */
+struct irwave_key_st {
+    char name[IRWAVE_NAME_SIZE];
+    uint64_t code;
+    uint32_t timings[IRWAVE_TIMINGS_MAX];
+    size_t ntimings;
+    uint32_t length_us;         /* of every timing, the gap included */
+    gpioPulse_t * pulses;
+    size_t npulses;
+};
+
+struct irwave_st {
+    int pi;                     /* pigpio handle, as in struct GPIO */
+    unsigned int gpio;
+    struct irwave_remote_st remote;
+    struct irwave_key_st keys[IRWAVE_KEYS_MAX];
+    size_t nkeys;
+    int waveids[IRWAVE_KEYS_MAX];   /* pigpio waveform of each key, or -1 */
+    unsigned long presses;      /* sent by irwave_send and irwave_burst */
+    uint64_t last_us;           /* how long the last send took */
+};
+
+/* Asked between the presses of a burst. @returns true to stop there. */
+typedef bool (*irwave_stop_fn)(void * arg);
+
+/* Read the remote in the lircd.conf at @param path, and get every key ready
+ * to send through GPIO @param gpio of the pigpio handle @param pi.
+ * @returns 0, -ENOTSUP for encodings other than SPACE_ENC, -EINVAL if the
+ * file has errors (which are logged), or another negative errno.
+ */
+int irwave_initialize(
+    struct irwave_st * wave,
+    int pi,
+    unsigned int gpio,
+    const char * path);
+int irwave_finalize(struct irwave_st * wave);
+
+/* @returns the key called @param name (as in `KEY_POWER`), or NULL. */
+const struct irwave_key_st * irwave_key(
+    const struct irwave_st * wave,
+    const char * name);
+
+/* Send @param key and wait until its gap is over. This is a blocking call.
+ * @returns 0 or a negative errno.
+ */
+int irwave_send(struct irwave_st * wave, const struct irwave_key_st * key);
+
+/* Send the @param n presses of @param keys as one chained transmission, and
+ * wait until the gap of the last one is over. This is a blocking call.
+ * Presses start at least @param interval_us apart; the gap already keeps
+ * them a key's length_us apart. Before every press but the first, @param
+ * stop (if not NULL) is called with @param arg, and the chain ends there if
+ * it returns true. @returns the number of presses sent, or a negative errno
+ * if none could be.
+ */
+int irwave_burst(
+    struct irwave_st * wave,
+    const struct irwave_key_st * const * keys,
+    size_t n,
+    uint32_t interval_us,
+    irwave_stop_fn stop,
+    void * arg);
+
+/* Write the timings of @param key to @param buf as text, marks and spaces
+ * separated by spaces, like the raw codes of a lircd.conf. @returns the
+ * length it needs, as snprintf does.
+ */
+int irwave_format(const struct irwave_key_st * key, char * buf, size_t size);
+
+#endif /* #ifndef _IRWAVE_H_ */
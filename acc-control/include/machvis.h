@@ -2,36 +2,123 @@
 #define _MACHVIS_H_
 
 #include <pthread.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include "accpanel.h"
 
 #define MACHVIS_SOCKET_FAM  (AF_INET)
 #define MACHVIS_SOCKET_PATH "127.0.0.1"
 #define MACHVIS_SOCKET_PORT (64000)
 
+/* Receive ring. Datagrams are received straight into these preallocated slots,
+ * in batches of up to MACHVIS_RING_SLOTS - 1 (the slot in the mailbox is never
+ * written to while it is being published).
+ */
+#define MACHVIS_SLOT_SIZE   (1024)
+#define MACHVIS_RING_SLOTS  (8)
+
+/* A JSON sender is told machvis takes frames straight away, then at most this
+ * often, in case it never listens.
+ */
+#define MACHVIS_CAPS_INTERVAL_MS    (1000)
+
+struct machvis_slot_st {
+    char buffer[MACHVIS_SLOT_SIZE + 1];     /* +1 so it is always terminated */
+    size_t length;
+    bool binary;                    /* buffer holds an accpanel frame */
+    struct accpanel_frame_st frame; /* decoded, if binary */
+    char text[ACCPANEL_JSON_SIZE];  /* frame rendered as JSON, for MQTT */
+};
+
+/* Temporal voting. Every field of the panel keeps its last MACHVIS_VOTE_WINDOW
+ * readings, each weighted by its frame margin plus one (JSON and version 1
+ * frames weigh 1). A reading that differs from the panel published so far
+ * only replaces it once MACHVIS_VOTE_QUORUM readings agree with it and they
+ * hold more than half the weight of the window. A misread can come with a
+ * large margin too, so however sure, one frame does not make control plan
+ * again.
+ */
+#define MACHVIS_VOTE_WINDOW (5)
+#define MACHVIS_VOTE_QUORUM ((MACHVIS_VOTE_WINDOW + 1) / 2)
+
+struct machvis_vote_st {
+    int value[MACHVIS_VOTE_WINDOW];
+    unsigned int weight[MACHVIS_VOTE_WINDOW];
+    unsigned int next;          /* where the next reading goes */
+    unsigned int count;         /* readings in the window */
+    int committed;              /* what the published panel shows */
+    bool pending;               /* a differing reading is being outvoted */
+};
+
+struct machvis_counters_st {
+    unsigned long received;     /* datagrams read from the socket */
+    unsigned long coalesced;    /* superseded by a newer one before parsing */
+    unsigned long dropped;      /* empty or truncated datagrams */
+    unsigned long unchanged;    /* frames acc-machvis did not parse again */
+    unsigned long suppressed;   /* field flips outvoted before publishing */
+};
+
 struct machvis_st {
 
     int socketfd;
+    int port;
     bool socketopen;
     pthread_mutex_t socketmutex;
 
     volatile bool receive;   /* Controls the machvis_receive thread */
 
-    char * machvistransmission;
-    size_t machvistransmissionsize;
+    struct machvis_slot_st ring[MACHVIS_RING_SLOTS];
+    unsigned int mailbox;       /* ring slot holding the latest transmission */
+    struct machvis_counters_st counters;
+    struct sockaddr_in capspeer;    /* last told the capabilities */
+    struct timespec capssent;
+    struct machvis_vote_st votes[ACCPANEL_MARGINS];
+
+    char * machvistransmission;         /* points into the mailbox slot */
+    size_t machvistransmissionsize;     /* exact length received */
+    uint32_t machvisseq;                /* of the last binary frame */
+    uint64_t machvistimestamp;          /* of the last binary frame, in us */
     bool machvispanelparsed;
     bool machvispanelpublished;
-    struct panel_st * machvispanel;
+    struct panel_atomic_st * machvispanel;
+    unsigned long machvisgeneration;    /* panels parsed so far */
+    pthread_cond_t machvischanged;      /* signalled on every parsed panel */
     pthread_mutex_t machvismutex;
 };
 
-int machvis_initialize(struct machvis_st * mv);
+/* Initialize @param mv to listen on UDP @param port, normally
+ * MACHVIS_SOCKET_PORT.
+ */
+int machvis_initialize(struct machvis_st * mv, int port);
 int machvis_finalize(struct machvis_st *mv);
 int machvis_open(struct machvis_st * mv);
 int machvis_close(struct machvis_st *mv);
 void *machvis_receive(void *args);
-int machvis_parse(struct machvis_st *mv, struct panel_st *panel);
-void machvis_machvispanel_set(struct machvis_st *mv, struct panel_st *panel);
-struct panel_st * machvis_machvispanel_get(struct machvis_st *mv);
+/* Parse the latest transmission, vote on it, and store the panel that won in
+ * @param panel.
+ */
+int machvis_parse(struct machvis_st *mv, struct panel_atomic_st *panel);
+void machvis_machvispanel_set(
+    struct machvis_st *mv, 
+    struct panel_atomic_st *panel);
+struct panel_atomic_st * machvis_machvispanel_get(struct machvis_st *mv);
+
+/* @returns the number of panels parsed so far, to pass to machvis_wait. */
+unsigned long machvis_generation(struct machvis_st *mv);
+
+/* Wait until machvis parses a panel newer than @param generation, which is
+ * updated, or until @param deadline (CLOCK_MONOTONIC). @returns 0, or
+ * -ETIMEDOUT.
+ */
+int machvis_wait(
+    struct machvis_st *mv, 
+    unsigned long *generation, 
+    const struct timespec *deadline);
+
+/* Copy the datagram counters of @param mv to @param counters. */
+void machvis_counters_get(
+    struct machvis_st *mv, 
+    struct machvis_counters_st *counters);
 
 #endif /* #ifndef _MACHVIS_H_ */
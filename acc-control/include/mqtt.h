@@ -2,9 +2,14 @@
 #define _MQTT_H_
 
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 #include <mosquitto.h>
 #include "accpanel.h"
-#include "control.h"
+
+struct control_st;
+struct mqtt_st;
+struct mqtt_loopback_st;
 
 #define MQTT_BROKER_HOSTNAME "mosquitto.int.ivanveloz.com"
 #define MQTT_BROKER_PORT (1883)
@@ -17,22 +22,135 @@
 #define MQTT_LISTEN_TOPIC "ac-cloudifier-cmd"
 #define MQTT_LISTEN_QOS (0)
 
+#define MQTT_TOPIC_SIZE (128)
+
+#define MQTT_PUBLISH_DEBOUNCE_MS (0)
+#define MQTT_PUBLISH_HEARTBEAT_S (60)
+#define MQTT_LISTENERS_MAX (16)
+
+/* How an mqtt_st reaches its broker. Messages received are handed to
+ * mqtt_deliver. Every call @returns 0 or a negative errno.
+ */
+struct mqtt_transport_st {
+    const char * name;
+    int (*open)(struct mqtt_st * mqtt);
+    void (*close)(struct mqtt_st * mqtt);
+    int (*connect)(struct mqtt_st * mqtt);
+    int (*disconnect)(struct mqtt_st * mqtt);
+    int (*publish)(
+        struct mqtt_st * mqtt, 
+        const char * topic, 
+        const void * payload, 
+        size_t len, 
+        int qos, 
+        bool retain);
+    int (*subscribe)(struct mqtt_st * mqtt, const char * topic, int qos);
+};
+
+/* libmosquitto, to MQTT_BROKER_HOSTNAME */
+extern const struct mqtt_transport_st mqtt_transport_mosquitto;
+/* In-process, see mqttloopback.h */
+extern const struct mqtt_transport_st mqtt_transport_loopback;
+
+/* Called with the messages that are not commands for a control loop. */
+typedef void (*mqtt_message_fn)(
+    struct mqtt_st * mqtt, 
+    const char * topic, 
+    const void * payload, 
+    size_t len);
+
+/* Routes the commands received on a topic to the control loop of one unit. */
+struct mqtt_listener_st {
+    char topic[MQTT_TOPIC_SIZE];
+    struct control_st *control;
+};
+
+/* Change-driven publishing of one unit's panel state. A panel is published
+ * when it differs from the last one published, and has held for debounce_ms.
+ * An unchanged panel is only republished every heartbeat_s, as long as 
+ * machvis keeps sending.
+ */
+struct mqtt_publisher_st {
+    char topic[MQTT_TOPIC_SIZE];
+    long debounce_ms;
+    long heartbeat_s;
+    bool haslast;
+    struct panel_st last;           /* as last published */
+    struct timespec lastsent;
+    bool pending;                   /* a change is waiting out the debounce */
+    struct panel_st pendingpanel;
+    struct timespec pendingsince;
+    unsigned long published;
+    unsigned long suppressed;       /* unchanged, before the heartbeat */
+    unsigned long debounced;        /* panels held back by the debounce */
+    unsigned long heldgeneration;   /* machvis panel last counted as held */
+};
+
 struct mqtt_st {
+    const struct mqtt_transport_st * transport;
     struct mosquitto *mosq;     /* libmosquitto client instance */
+    struct mqtt_loopback_st *loopback;  /* the broker, for the loopback */
     bool connected;
     bool publish;               /* Flag to control the mqtt_publish thread */
     char uuid[256];
     struct machvis_st *mv;      /* machvis instance to get transmissions from */
+    struct mqtt_listener_st listeners[MQTT_LISTENERS_MAX];
+    size_t nlisteners;
+    pthread_mutex_t listenmutex;
+    mqtt_message_fn message;    /* can be NULL */
+    void * userdata;            /* for message */
 };
 
+/* Connect to MQTT_BROKER_HOSTNAME with libmosquitto.
+ * @param mv is only used by the mqtt_publish thread, and can be NULL. 
+ */
 int mqtt_initialize(struct mqtt_st * mqtt, struct machvis_st * mv);
+/* Connect to the in-process @param broker instead. */
+int mqtt_initialize_loopback(
+    struct mqtt_st * mqtt, 
+    struct machvis_st * mv,
+    struct mqtt_loopback_st * broker);
 int mqtt_finalize(struct mqtt_st * mqtt);
 int mqtt_connect(struct mqtt_st * mqtt);
 int mqtt_disconnect(struct mqtt_st * mqtt);
 void *mqtt_publish(void *args);
-void mqtt_listen_callback_set(struct mqtt_st *mqtt, struct control_st *control);
-int mqtt_publish_panel_state(struct mqtt_st * mqtt, struct machvis_st * mv);
+/* Subscribe to @param topic and hand the commands received on it to
+ * @param control. @returns 0 or a negative errno.
+ */
+int mqtt_listen_add(
+    struct mqtt_st *mqtt, 
+    const char *topic, 
+    struct control_st *control);
+void mqtt_listen_remove(struct mqtt_st *mqtt, struct control_st *control);
+/* Subscribe to @param topic, for the message callback. */
+int mqtt_subscribe(struct mqtt_st * mqtt, const char * topic);
+void mqtt_publisher_initialize(
+    struct mqtt_publisher_st * pub, 
+    const char * topic);
+/* Publish the panel decoded by @param mv if it changed, or if a heartbeat is
+ * due. @returns 0 if it was published, -EALREADY if there was nothing to
+ * publish, or -EAGAIN if publishing failed.
+ */
+int mqtt_publish_panel_state(
+    struct mqtt_st * mqtt, 
+    struct machvis_st * mv, 
+    struct mqtt_publisher_st * pub);
 int mqtt_publish_unit_ping(struct mqtt_st * mqtt);
+/* Publish @param len bytes of @param payload on @param topic, QoS 1. */
+int mqtt_publish_buffer(
+    struct mqtt_st * mqtt, 
+    const char * topic, 
+    const void * payload, 
+    size_t len);
 char * mqtt_listen_command(struct mqtt_st *mqtt);
+/* A message arrived on @param topic. Commands go to the control loop that
+ * listens on the topic, anything else to the message callback. For the
+ * transports to call.
+ */
+void mqtt_deliver(
+    struct mqtt_st * mqtt, 
+    const char * topic, 
+    const void * payload, 
+    size_t len);
 
 #endif /* #ifndef _MQTT_H_ */
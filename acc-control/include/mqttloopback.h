@@ -0,0 +1,50 @@
+/* mqttloopback.h is an MQTT broker inside the process, for the loopback
+ * transport (mqtt_initialize_loopback). Publishes are handed to the
+ * subscribers of every mqtt_st connected to the same broker, in the thread
+ * that publishes, with no sockets in between. It keeps retained messages,
+ * and hands them to new subscriptions like a broker would. Topic filters
+ * take the `+` and `#` wildcards.
+ *
+ * Delivery doesn't hold the broker lock, so subscribers can publish from
+ * their callbacks. QoS is ignored: nothing is lost in the process.
+ */
+
+#ifndef _MQTTLOOPBACK_H_
+#define _MQTTLOOPBACK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "mqtt.h"
+
+#define MQTT_LOOPBACK_SUBSCRIPTIONS_MAX (64)
+#define MQTT_LOOPBACK_RETAINED_MAX      (64)
+
+struct mqtt_loopback_sub_st {
+    char filter[MQTT_TOPIC_SIZE];
+    struct mqtt_st * client;
+};
+
+struct mqtt_loopback_retained_st {
+    char topic[MQTT_TOPIC_SIZE];
+    void * payload;
+    size_t len;
+};
+
+struct mqtt_loopback_st {
+    struct mqtt_loopback_sub_st subs[MQTT_LOOPBACK_SUBSCRIPTIONS_MAX];
+    size_t nsubs;
+    struct mqtt_loopback_retained_st retained[MQTT_LOOPBACK_RETAINED_MAX];
+    size_t nretained;
+    unsigned long published;
+    unsigned long delivered;
+    pthread_mutex_t mutex;
+};
+
+int mqtt_loopback_initialize(struct mqtt_loopback_st * broker);
+int mqtt_loopback_finalize(struct mqtt_loopback_st * broker);
+
+/* @returns true if @param topic matches the subscription @param filter. */
+bool mqtt_loopback_match(const char * filter, const char * topic);
+
+#endif /* #ifndef _MQTTLOOPBACK_H_ */
@@ -0,0 +1,100 @@
+/* trace.h follows every command of a unit from MQTT to the panel, and keeps
+ * latency histograms of each stage:
+ *
+ *   queue      command received, to planned by control_getclicks
+ *   press      each infrared_send
+ *   burst      planned, to the last press sent
+ *   confirm    last press sent, to the first machvis panel that shows the
+ *              command took effect
+ *   total      command received, to confirmed
+ *
+ * The histograms are log-linear, like HdrHistogram: TRACE_SUB_BUCKETS per
+ * power of two, so any value is off by less than 1/TRACE_SUB_BUCKETS. They
+ * cover a window of TRACE_WINDOW_S and are published as JSON on TRACE_TOPIC.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define TRACE_TOPIC             "ac-cloudifier-stats"
+#define TRACE_WINDOW_S          (60)
+#define TRACE_SUB_BITS          (4)
+#define TRACE_SUB_BUCKETS       (1 << TRACE_SUB_BITS)
+/* Up to 2^31 us, a little over half an hour. Longer is counted there. */
+#define TRACE_BUCKETS           ((31 - TRACE_SUB_BITS + 1) * TRACE_SUB_BUCKETS)
+#define TRACE_JSON_SIZE         (1024)
+
+enum trace_stage {
+    TRACE_STAGE_QUEUE = 0,
+    TRACE_STAGE_PRESS,
+    TRACE_STAGE_BURST,
+    TRACE_STAGE_CONFIRM,
+    TRACE_STAGE_TOTAL,
+    TRACE_STAGE_ENUMSIZE     // always keep last
+};
+
+struct trace_hist_st {
+    uint32_t counts[TRACE_BUCKETS];
+    uint64_t count;
+    uint64_t max;           /* us */
+};
+
+/* The command being followed. Timestamps are CLOCK_MONOTONIC. */
+struct trace_cmd_st {
+    uint64_t id;
+    bool active;
+    bool planned;
+    bool sent;
+    struct timespec received;
+    struct timespec plannedat;
+    struct timespec lastpress;
+};
+
+struct trace_st {
+    struct trace_cmd_st cmd;
+    uint64_t nextid;
+    unsigned long confirmed;    /* in this window */
+    unsigned long superseded;   /* replaced by a newer command before confirmed */
+    struct trace_hist_st hist[TRACE_STAGE_ENUMSIZE];
+    struct timespec windowstart;
+    pthread_mutex_t mutex;
+};
+
+int trace_initialize(struct trace_st * trace);
+int trace_finalize(struct trace_st * trace);
+
+/* A command was received. @returns its trace ID. */
+uint64_t trace_received(struct trace_st * trace);
+
+/* The current command was planned. Only the first plan counts. */
+void trace_planned(struct trace_st * trace);
+
+/* One press went out, from @param start to @param end. */
+void trace_press(
+    struct trace_st * trace,
+    const struct timespec * start,
+    const struct timespec * end);
+
+/* @returns true if there is a command waiting for the panel to confirm it. */
+bool trace_pending(struct trace_st * trace);
+
+/* The panel shows the current command took effect. */
+void trace_confirmed(struct trace_st * trace);
+
+/* If the window is over, write it as JSON to @param str and start a new
+ * one. @returns the length written, or 0 if the window is not over.
+ */
+size_t trace_window(struct trace_st * trace, char * str, size_t n);
+
+void trace_hist_record(struct trace_hist_st * h, uint64_t us);
+
+/* @returns the value at percentile @param p (0-100) of @param h, in us. */
+uint64_t trace_hist_percentile(const struct trace_hist_st * h, double p);
+
+#endif /* #ifndef _TRACE_H_ */
@@ -0,0 +1,502 @@
+/* Runs command scenarios against simulated ACs (acsim.h), through the real
+ * MQTT command path (on the loopback transport), control loop, IR queue and
+ * machvis socket, and reports how many reached their target and how long it
+ * took.
+ *
+ *   scenarios [-j lanes] [-n random] [-s seed] [-l latency ms] [-d drop %]
+ *             [-f frame ms] [-t timeout ms] [file]
+ *
+ * Every line of the file is one scenario: the panel to start from, `=>`, and
+ * the command to send, both as JSON. `#` starts a comment.
+ *
+ *   {"mode": 0, "fan": 0, "temperature": 72} => {"mode": 1, "fan": 2, "temperature": 80}
+ *
+ * With `~>` instead, the fields after it are misread for one frame, with the
+ * margin after an `@` (255 if there is none). The scenario passes if machvis
+ * suppresses the flip: the actual panel never shows it and no key is pressed.
+ *
+ *   {"mode": 1, "fan": 1, "temperature": 72} ~> {"temperature": 78} @ 40
+ *
+ * -n adds random scenarios, the same ones for the same seed. Lanes are units
+ * that run scenarios side by side, on one emitter with a transmitter each.
+ * Failures are printed as they happen, and the summary at the end is one
+ * JSON object. The exit status is 1 if any scenario failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "gpio.h"
+#include "infrared.h"
+#include "irqueue.h"
+#include "machvis.h"
+#include "mqtt.h"
+#include "mqttloopback.h"
+#include "control.h"
+#include "trace.h"
+#include "acsim.h"
+
+#define SCENARIOS_LANES_MAX     (IRQUEUE_CLIENTS_MAX)
+#define SCENARIOS_PORT          (64200)
+#define SCENARIOS_LINE_SIZE     (512)
+#define SCENARIOS_TIMEOUT_MS    (15000)
+
+struct scenario_st {
+    struct panel_st start;
+    struct panel_st target;
+    char startcommand[ACCPANEL_JSON_SIZE];
+    char command[ACCPANEL_JSON_SIZE];
+    int line;               /* 0 for random ones */
+    bool misread;           /* command is misread for a frame, not sent */
+    uint8_t margin;         /* of the misread */
+};
+
+struct lane_st {
+    int index;
+    struct machvis_st mv;
+    struct irqueue_client_st ir;
+    struct control_st control;
+    struct acsim_st sim;
+    pthread_t machvis_thread;
+    pthread_t sim_thread;
+    pthread_t thread;
+    struct trace_hist_st hist;      /* ms to reach the target */
+    unsigned long passed;
+    unsigned long failed;
+};
+
+static struct scenario_st * scenarios;
+static size_t nscenarios;
+static size_t lanes = 4;
+static long timeout_ms = SCENARIOS_TIMEOUT_MS;
+static struct lane_st lane[SCENARIOS_LANES_MAX];
+static struct mqtt_loopback_st broker;
+static struct mqtt_st gateway;      /* the control loops' connection */
+static struct mqtt_st load;         /* sends the commands */
+static pthread_mutex_t printmutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int scenarios_load(const char * path);
+static int scenarios_add(
+    const char * start, 
+    const char * command, 
+    int line, 
+    bool misread);
+static void scenarios_random(unsigned long n, uint32_t seed);
+static void *lane_run(void * args);
+static int lane_wait(
+    struct lane_st * l,
+    const struct panel_st * target,
+    long ms);
+static int lane_misread(struct lane_st * l, const struct scenario_st * s);
+static double now_ms(void);
+
+static void usage(const char * name)
+{
+    fprintf(stderr, "Usage: %s [-j lanes] [-n random] [-s seed] "
+        "[-l latency ms] [-d drop %%] [-f frame ms] [-t timeout ms] [file]\n",
+        name);
+}
+
+int main(int argc, char * argv[])
+{
+    int r, opt;
+    unsigned long nrandom = 0;
+    uint32_t seed = 1;
+    struct acsim_config_st config;
+    struct GPIO gpio;
+    struct infra_st infra;
+    struct irqueue_st irq;
+    pthread_t irqueue_thread;
+    struct trace_hist_st hist;
+    unsigned long passed = 0, failed = 0, presses = 0, dropped = 0;
+
+    acsim_config_default(&config);
+    while((opt = getopt(argc, argv, "j:n:s:l:d:f:t:h")) != -1) {
+        switch(opt) {
+            case 'j': lanes = strtoul(optarg, NULL, 10); break;
+            case 'n': nrandom = strtoul(optarg, NULL, 10); break;
+            case 's': seed = strtoul(optarg, NULL, 10); break;
+            case 'l': config.latency_ms = strtol(optarg, NULL, 10); break;
+            case 'd': config.drop_percent = atoi(optarg); break;
+            case 'f': config.frame_ms = strtol(optarg, NULL, 10); break;
+            case 't': timeout_ms = strtol(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h')? 0 : 2;
+        }
+    }
+    if(lanes < 1 || lanes > SCENARIOS_LANES_MAX) {
+        fprintf(stderr, "Lanes must be 1 to %d\n", SCENARIOS_LANES_MAX);
+        return 2;
+    }
+    if(optind < argc && scenarios_load(argv[optind])) return 2;
+    scenarios_random(nrandom, seed);
+    if(nscenarios == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    mqtt_loopback_initialize(&broker);
+    mqtt_initialize_loopback(&gateway, NULL, &broker);
+    mqtt_initialize_loopback(&load, NULL, &broker);
+    GPIO_initialize(&gpio);
+    infrared_initialize(&infra, &gpio, NULL);
+    irqueue_initialize(&irq);
+    irqueue_emitter_add(&irq, &infra);
+    pthread_create(&irqueue_thread, NULL, irqueue_run, &irq);
+
+    for(size_t i=0; i<lanes; i++) {
+        struct lane_st * l = &lane[i];
+        struct acsim_config_st c = config;
+        char name[32];
+
+        l->index = i;
+        c.seed = seed + i;
+        snprintf(name, sizeof(name), "lane%zu", i);
+        r = machvis_initialize(&l->mv, SCENARIOS_PORT + i);
+        if(!r) r = acsim_initialize(&l->sim, SCENARIOS_PORT + i, &c);
+        if(!r) r = infrared_simulator_add(&infra, &l->sim, i + 1);
+        if(!r) r = irqueue_client_initialize(&irq, &l->ir, 0, i + 1);
+        if(!r) r = control_initialize(&l->control, &gateway, &l->ir, &l->mv,
+            name);
+        if(r) {
+            fprintf(stderr, "Can't set up %s: %s\n", name, strerror(-r));
+            return 1;
+        }
+        // Keep the waits in step with how fast the simulated panel is.
+        l->control.settle_ms = 2 * c.frame_ms;
+        l->control.expected_ms = c.latency_ms + 4 * c.frame_ms;
+        l->control.deadline_ms = timeout_ms;
+        pthread_create(&l->machvis_thread, NULL, machvis_receive, &l->mv);
+        pthread_create(&l->sim_thread, NULL, acsim_run, &l->sim);
+        pthread_create(&l->control.control_loop_thread, NULL,
+            control_loop, &l->control);
+    }
+
+    double start = now_ms();
+    for(size_t i=0; i<lanes; i++)
+        pthread_create(&lane[i].thread, NULL, lane_run, &lane[i]);
+    for(size_t i=0; i<lanes; i++)
+        pthread_join(lane[i].thread, NULL);
+    double elapsed = now_ms() - start;
+
+    memset(&hist, 0, sizeof(hist));
+    for(size_t i=0; i<lanes; i++) {
+        struct lane_st * l = &lane[i];
+        for(size_t b=0; b<TRACE_BUCKETS; b++) hist.counts[b] += l->hist.counts[b];
+        hist.count += l->hist.count;
+        if(l->hist.max > hist.max) hist.max = l->hist.max;
+        passed += l->passed;
+        failed += l->failed;
+        presses += l->sim.presses;
+        dropped += l->sim.dropped;
+    }
+    printf("{\"scenarios\": %zu, \"passed\": %lu, \"failed\": %lu, "
+        "\"p50_ms\": %llu, \"p99_ms\": %llu, \"max_ms\": %llu, "
+        "\"presses\": %lu, \"dropped\": %lu, \"elapsed_s\": %.1f, "
+        "\"scenarios_per_min\": %.0f}\n", nscenarios, passed, failed,
+        (unsigned long long)trace_hist_percentile(&hist, 50),
+        (unsigned long long)trace_hist_percentile(&hist, 99),
+        (unsigned long long)hist.max, presses, dropped, elapsed / 1000,
+        nscenarios * 60000.0 / elapsed);
+
+    for(size_t i=0; i<lanes; i++) {
+        struct lane_st * l = &lane[i];
+        l->control.loop = false;
+        l->mv.receive = false;
+    }
+    irqueue_stop(&irq);
+    pthread_join(irqueue_thread, NULL);
+    for(size_t i=0; i<lanes; i++) {
+        struct lane_st * l = &lane[i];
+        pthread_join(l->control.control_loop_thread, NULL);
+        pthread_join(l->machvis_thread, NULL);  // the sim wakes it up
+        l->sim.run = false;
+        pthread_join(l->sim_thread, NULL);
+        acsim_finalize(&l->sim);
+        control_finalize(&l->control);
+        machvis_finalize(&l->mv);
+    }
+    irqueue_finalize(&irq);
+    infrared_finalize(&infra);
+    GPIO_finalize(&gpio);
+    mqtt_finalize(&load);
+    mqtt_finalize(&gateway);
+    mqtt_loopback_finalize(&broker);
+    free(scenarios);
+    return failed? 1 : 0;
+}
+
+static void *lane_run(void * args)
+{
+    struct lane_st * l = args;
+    struct panel_st shown = PANEL_INITIALIZER;
+
+    for(size_t k = l->index; k < nscenarios; k += lanes) {
+        struct scenario_st * s = &scenarios[k];
+
+        acsim_panel_set(&l->sim, &s->start);
+        if(lane_wait(l, &s->start, timeout_ms)) {
+            fprintf(stderr, "lane%d: the simulator never showed the start "
+                "of scenario %zu\n", l->index, k);
+            l->failed++;
+            continue;
+        }
+        // Let the controller stop trusting the presses it expects, and
+        // start from the panel. Commands are merged into the last one, so
+        // it has to want the start before it gets the command.
+        usleep(l->control.expected_ms * 1000);
+        if(s->misread) {
+            if(lane_misread(l, s) == 0) l->passed++;
+            else l->failed++;
+            continue;
+        }
+        double start = now_ms();
+        mqtt_publish_buffer(&load, l->control.listentopic, s->startcommand,
+            strlen(s->startcommand));
+        mqtt_publish_buffer(&load, l->control.listentopic, s->command,
+            strlen(s->command));
+        if(lane_wait(l, &s->target, timeout_ms) == 0) {
+            trace_hist_record(&l->hist, now_ms() - start);
+            l->passed++;
+            continue;
+        }
+
+        l->failed++;
+        acsim_panel_get(&l->sim, &shown);
+        pthread_mutex_lock(&printmutex);
+        printf("FAIL scenario %zu (line %d): %s => %s shows mode %d fan %d "
+            "temperature %d\n", k, s->line, s->startcommand, s->command,
+            shown.mode, shown.fan, shown.temperature);
+        pthread_mutex_unlock(&printmutex);
+    }
+    return NULL;
+}
+
+/* Wait for the control loop's view of the panel to reach @param target, and
+ * for the control loop to be done with the command. It may still be waiting
+ * for a partial command to show, and would carry on into the next scenario.
+ */
+static int lane_wait(
+    struct lane_st * l,
+    const struct panel_st * target,
+    long ms)
+{
+    struct panel_st actual = PANEL_INITIALIZER;
+    unsigned long generation = machvis_generation(&l->mv);
+    struct timespec deadline, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    for(;;) {
+        accpanel_atomic_load(l->control.actualpanel, &actual);
+        if(control_reached(&actual, target)) {
+            bool idle = accpanel_atomic_load(l->control.desiredpanel, NULL) ==
+                l->control.desiredplanned;
+            if(idle) return 0;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec
+                && now.tv_nsec >= deadline.tv_nsec)) return -ETIMEDOUT;
+            usleep(1000);   // the control loop doesn't signal, so poll
+            continue;
+        }
+        if(machvis_wait(&l->mv, &generation, &deadline)) return -ETIMEDOUT;
+    }
+}
+
+/* Run misread scenario @param s, which is at its start. @returns 0 if the
+ * misread was suppressed, or -EPROTO.
+ */
+static int lane_misread(struct lane_st * l, const struct scenario_st * s)
+{
+    struct panel_st shown = PANEL_INITIALIZER;
+    struct panel_st misread, actual = PANEL_INITIALIZER;
+    struct machvis_counters_st before, after;
+    unsigned long presses, misreads, generation;
+    uint32_t planned;
+    struct timespec deadline;
+    const char * failure = NULL;
+
+    // The controller has to want what the panel shows, or it would press.
+    mqtt_publish_buffer(&load, l->control.listentopic, s->startcommand,
+        strlen(s->startcommand));
+    if(lane_wait(l, &s->start, timeout_ms)) {
+        failure = "never settled on the start";
+        goto ret;
+    }
+    acsim_panel_get(&l->sim, &shown);
+    misread = shown;
+    accpanel_decode(&misread, s->command, strlen(s->command), NULL);
+    pthread_mutex_lock(&l->sim.mutex);
+    presses = l->sim.presses;
+    misreads = l->sim.misreads;
+    pthread_mutex_unlock(&l->sim.mutex);
+    machvis_counters_get(&l->mv, &before);
+    planned = l->control.actualplanned;
+    generation = machvis_generation(&l->mv);
+
+    acsim_misread(&l->sim, &misread, s->margin);
+    // Long enough for the misread to go out, and the window to forget it.
+    for(int i=0; i<2*MACHVIS_VOTE_WINDOW + 2 && !failure; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += 1;
+        if(machvis_wait(&l->mv, &generation, &deadline)) {
+            failure = "machvis stopped";
+            break;
+        }
+        accpanel_atomic_load(l->control.actualpanel, &actual);
+        if(!accpanel_equal(&actual, &shown)) failure = "showed the misread";
+    }
+    if(failure) goto ret;
+
+    machvis_counters_get(&l->mv, &after);
+    pthread_mutex_lock(&l->sim.mutex);
+    if(l->sim.misreads == misreads) failure = "never sent the misread";
+    else if(l->sim.presses != presses) failure = "pressed keys";
+    pthread_mutex_unlock(&l->sim.mutex);
+    if(!failure && l->control.actualplanned != planned) failure = "planned";
+    if(!failure && after.suppressed == before.suppressed) 
+        failure = "did not count it as suppressed";
+
+    ret:
+    if(!failure) return 0;
+    pthread_mutex_lock(&printmutex);
+    printf("FAIL scenario (line %d): %s ~> %s %s\n", s->line, 
+        s->startcommand, s->command, failure);
+    pthread_mutex_unlock(&printmutex);
+    return -EPROTO;
+}
+
+static int scenarios_load(const char * path)
+{
+    char line[SCENARIOS_LINE_SIZE];
+    int lineno = 0, errors = 0;
+    FILE * f = fopen(path, "r");
+    if(!f) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    while(fgets(line, sizeof(line), f)) {
+        lineno++;
+        char * comment = strchr(line, '#');
+        if(comment) *comment = '\0';
+        char * arrow = strstr(line, "=>");
+        bool misread = false;
+        if(!arrow) {
+            arrow = strstr(line, "~>");
+            misread = (arrow != NULL);
+        }
+        if(!arrow) {
+            if(strspn(line, " \t\r\n") != strlen(line)) {
+                fprintf(stderr, "%s:%d: no =>\n", path, lineno);
+                errors++;
+            }
+            continue;
+        }
+        *arrow = '\0';
+        arrow[strcspn(arrow + 2, "\r\n") + 2] = '\0';
+        if(scenarios_add(line, arrow + 2, lineno, misread)) {
+            fprintf(stderr, "%s:%d: bad scenario\n", path, lineno);
+            errors++;
+        }
+    }
+    fclose(f);
+    return errors? -EINVAL : 0;
+}
+
+static int scenarios_add(
+    const char * start, 
+    const char * command, 
+    int line, 
+    bool misread)
+{
+    struct scenario_st * s;
+    unsigned int present;
+    char * at;
+    long margin = UINT8_MAX;
+
+    if(nscenarios % 256 == 0) {
+        s = realloc(scenarios, (nscenarios + 256) * sizeof(*s));
+        if(!s) return -ENOMEM;
+        scenarios = s;
+    }
+    s = &scenarios[nscenarios];
+    memset(s, 0, sizeof(*s));
+    s->start = (struct panel_st)PANEL_INITIALIZER;
+    s->target = (struct panel_st)PANEL_INITIALIZER;
+    s->misread = misread;
+    at = misread? strchr(command, '@') : NULL;
+    if(at) {
+        margin = strtol(at + 1, NULL, 10);
+        if(margin < 0 || margin > UINT8_MAX) return -EINVAL;
+    }
+    s->margin = margin;
+    if(accpanel_decode(&s->start, start, strlen(start), &present) ||
+        !(present & PANEL_FIELD_MODE) || !(present & PANEL_FIELD_FAN))
+        return -EINVAL;
+    // Fields the command leaves out stay as they start.
+    accpanel_cpy(&s->target, &s->start);
+    if(accpanel_decode(&s->target, command, 
+        at? (size_t)(at - command) : strlen(command), &present) || !present)
+        return -EINVAL;
+    while(*start == ' ' || *start == '\t') start++;
+    while(*command == ' ' || *command == '\t') command++;
+    if(strlen(start) >= sizeof(s->startcommand) ||
+        strlen(command) >= sizeof(s->command)) return -EINVAL;
+    strcpy(s->startcommand, start);
+    strcpy(s->command, command);
+    if(at) s->command[strcspn(s->command, "@")] = '\0';
+    s->line = line;
+    nscenarios++;
+    return 0;
+}
+
+/* A state the unit can be in: off, or on with a fan it allows. */
+static void scenarios_panel(char * str, size_t n, uint32_t * rng)
+{
+    int mode = 0, fan = 0, temperature;
+    uint32_t x = *rng;
+    #define NEXT() (x ^= x << 13, x ^= x >> 17, x ^= x << 5, x)
+    temperature = TEMPERATURE_MINIMUM +
+        NEXT() % (TEMPERATURE_MAXIMUM - TEMPERATURE_MINIMUM + 1);
+    if(NEXT() % 5) {
+        mode = MODE_COOL + NEXT() % (MODE_LASTELEMENT - MODE_COOL);
+        if(mode == MODE_FAN)
+            fan = FAN_HIGH + NEXT() % (FAN_LASTELEMENT - FAN_HIGH);
+        else
+            fan = FAN_AUTO + NEXT() % (FAN_LASTELEMENT - FAN_AUTO);
+    }
+    #undef NEXT
+    *rng = x;
+    snprintf(str, n, "{\"mode\": %d, \"fan\": %d, \"temperature\": %d}",
+        mode, fan, temperature);
+}
+
+static void scenarios_random(unsigned long n, uint32_t seed)
+{
+    char start[ACCPANEL_JSON_SIZE], command[ACCPANEL_JSON_SIZE];
+    uint32_t rng = seed? seed : 1;
+    for(unsigned long i=0; i<n; i++) {
+        scenarios_panel(start, sizeof(start), &rng);
+        scenarios_panel(command, sizeof(command), &rng);
+        scenarios_add(start, command, 0, false);
+    }
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
@@ -6,21 +6,252 @@
 #include <errno.h>
 #include "accpanel.h"
 
-int accpanel_parse(struct panel_st * panel, const char * json)
+#define ACCPANEL_FRAME_MARGINS_OFFSET   (28)
+
+static size_t accpanel_frame_size(uint8_t version);
+static uint16_t accpanel_get16(const uint8_t * b);
+static uint32_t accpanel_get32(const uint8_t * b);
+static uint64_t accpanel_get64(const uint8_t * b);
+static void accpanel_put(uint8_t * b, uint64_t v, size_t size);
+static uint32_t accpanel_pack(const struct panel_st * panel);
+static void accpanel_unpack(struct panel_st * panel, uint32_t fields);
+
+/* Cursor over a JSON buffer that is not necessarily NUL terminated. */
+struct accpanel_json_st {
+    const char * p;
+    const char * end;
+};
+
+enum accpanel_json_key {
+    KEY_FAN = 0,
+    KEY_MODE,
+    KEY_DELAY,
+    KEY_MSDIGIT,
+    KEY_LSDIGIT,
+    KEY_TEMPERATURE,
+    KEY_FILTERBAD,
+    KEY_UNKNOWN
+};
+
+static const struct {
+    const char * name;
+    size_t len;
+} accpanel_json_keys[KEY_UNKNOWN] = {
+    [KEY_FAN]           = {"fan",           3},
+    [KEY_MODE]          = {"mode",          4},
+    [KEY_DELAY]         = {"delay",         5},
+    [KEY_MSDIGIT]       = {"msdigit",       7},
+    [KEY_LSDIGIT]       = {"lsdigit",       7},
+    [KEY_TEMPERATURE]   = {"temperature",  11},
+    [KEY_FILTERBAD]     = {"filterbad",     9},
+};
+
+static void accpanel_json_ws(struct accpanel_json_st * j)
 {
-    int r;
-    struct panel_st * p = panel;
-    int msdigit, lsdigit, fb;
-    r = sscanf(json, 
-        "{\"fan\": %i, \"mode\": %i, \"delay\": %i, \"msdigit\": %i, \"lsdigit\": %i, \"filterbad\": %i}", 
-        (int*)&p->fan, (int*)&p->mode, (int*)&p->delay, &msdigit, &lsdigit, &fb);
-    if(r != 6) {
-        return -EINVAL;
+    while(j->p < j->end && 
+        (*j->p == ' ' || *j->p == '\t' || *j->p == '\n' || *j->p == '\r')) 
+        j->p++;
+}
+
+static bool accpanel_json_eat(struct accpanel_json_st * j, char c)
+{
+    accpanel_json_ws(j);
+    if(j->p < j->end && *j->p == c) {
+        j->p++;
+        return true;
+    }
+    return false;
+}
+
+/* Skip a string, with the cursor on its opening quote. */
+static int accpanel_json_string(
+    struct accpanel_json_st * j, 
+    const char ** s, 
+    size_t * n)
+{
+    if(!accpanel_json_eat(j, '"')) return -EINVAL;
+    const char * start = j->p;
+    while(j->p < j->end && *j->p != '"') {
+        if(*j->p == '\\' && j->end - j->p > 1) j->p++;
+        j->p++;
+    }
+    if(j->p >= j->end) return -EINVAL;
+    if(s) *s = start;
+    if(n) *n = j->p - start;
+    j->p++;
+    return 0;
+}
+
+static enum accpanel_json_key accpanel_json_key(const char * s, size_t n)
+{
+    for(int k=0; k<KEY_UNKNOWN; k++) {
+        if( n == accpanel_json_keys[k].len && 
+            memcmp(s, accpanel_json_keys[k].name, n) == 0) 
+            return k;
+    }
+    return KEY_UNKNOWN;
+}
+
+/* Read a small integer. `true` and `false` read as 1 and 0. */
+static int accpanel_json_int(struct accpanel_json_st * j, int * v)
+{
+    bool negative = false;
+    int digits = 0, val = 0;
+
+    accpanel_json_ws(j);
+    if(j->end - j->p >= 4 && memcmp(j->p, "true", 4) == 0) {
+        j->p += 4;
+        *v = 1;
+        return 0;
+    }
+    if(j->end - j->p >= 5 && memcmp(j->p, "false", 5) == 0) {
+        j->p += 5;
+        *v = 0;
+        return 0;
+    }
+    if(j->p < j->end && *j->p == '-') {
+        negative = true;
+        j->p++;
+    }
+    while(j->p < j->end && *j->p >= '0' && *j->p <= '9') {
+        if(++digits > 4) return -EINVAL;    // nothing on the panel is this big
+        val = 10*val + (*j->p - '0');
+        j->p++;
+    }
+    if(digits == 0) return -EINVAL;
+    *v = negative? -val : val;
+    return 0;
+}
+
+/* Skip any value, including nested objects and arrays. Stops on the comma or
+ * brace that ends it.
+ */
+static int accpanel_json_skip(struct accpanel_json_st * j)
+{
+    int depth = 0;
+    accpanel_json_ws(j);
+    while(j->p < j->end) {
+        switch(*j->p) {
+            case '"':
+                if(accpanel_json_string(j, NULL, NULL)) return -EINVAL;
+                continue;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                if(depth == 0) return 0;
+                depth--;
+                break;
+            case ',':
+                if(depth == 0) return 0;
+                break;
+            default:
+                break;
+        }
+        j->p++;
+    }
+    return -EINVAL;
+}
+
+int accpanel_decode(
+    struct panel_st * panel, 
+    const char * json, 
+    size_t len, 
+    unsigned int * present)
+{
+    struct accpanel_json_st j = {.p = json, .end = json + len};
+    int vals[KEY_UNKNOWN];
+    unsigned int seen = 0, fields = 0;
+    enum accpanel_json_key k;
+    const char * key;
+    size_t keylen;
+
+    if(!panel || !json) return -EINVAL;
+
+    if(!accpanel_json_eat(&j, '{')) return -EINVAL;
+    if(!accpanel_json_eat(&j, '}')) {
+        do {
+            if(accpanel_json_string(&j, &key, &keylen)) return -EINVAL;
+            if(!accpanel_json_eat(&j, ':')) return -EINVAL;
+            k = accpanel_json_key(key, keylen);
+            if(k == KEY_UNKNOWN) {
+                if(accpanel_json_skip(&j)) return -EINVAL;
+                continue;
+            }
+            if(accpanel_json_int(&j, &vals[k])) return -EINVAL;
+            seen |= 1u << k;
+        } while(accpanel_json_eat(&j, ','));
+        if(!accpanel_json_eat(&j, '}')) return -EINVAL;
+    }
+    // acc-machvis terminates its datagrams, so allow trailing NULs.
+    accpanel_json_ws(&j);
+    while(j.p < j.end && *j.p == '\0') j.p++;
+    if(j.p != j.end) return -EINVAL;
+
+    /* Validate everything before touching the panel. */
+    if(seen & 1u << KEY_FAN) {
+        if(vals[KEY_FAN] < 0 || vals[KEY_FAN] >= FAN_LASTELEMENT) 
+            return -EINVAL;
+        fields |= PANEL_FIELD_FAN;
+    }
+    if(seen & 1u << KEY_MODE) {
+        if(vals[KEY_MODE] < 0 || vals[KEY_MODE] >= MODE_LASTELEMENT) 
+            return -EINVAL;
+        fields |= PANEL_FIELD_MODE;
+    }
+    if(seen & 1u << KEY_DELAY) {
+        if(vals[KEY_DELAY] < 0 || vals[KEY_DELAY] >= DELAY_LASTELEMENT) 
+            return -EINVAL;
+        fields |= PANEL_FIELD_DELAY;
+    }
+    if(seen & 1u << KEY_FILTERBAD) {
+        fields |= PANEL_FIELD_FILTERBAD;
     }
+    if((seen & 1u << KEY_MSDIGIT) && (seen & 1u << KEY_LSDIGIT)) {
+        int msd = vals[KEY_MSDIGIT], lsd = vals[KEY_LSDIGIT];
+        if(msd > 9 || lsd > 9) return -EINVAL;
+        vals[KEY_TEMPERATURE] = (msd<0 || lsd<0)? (-1) : (10*msd + lsd);
+        fields |= PANEL_FIELD_TEMPERATURE;
+    }
+    else if(seen & 1u << KEY_TEMPERATURE) {
+        int t = vals[KEY_TEMPERATURE];
+        if(t != -1 && (t < TEMPERATURE_MINIMUM || t > TEMPERATURE_MAXIMUM)) 
+            return -EINVAL;
+        fields |= PANEL_FIELD_TEMPERATURE;
+    }
+    else if(seen & (1u << KEY_MSDIGIT | 1u << KEY_LSDIGIT)) {
+        return -EINVAL;     // half a temperature
+    }
+
+    if(fields & PANEL_FIELD_FAN)    panel->fan = vals[KEY_FAN];
+    if(fields & PANEL_FIELD_MODE)   panel->mode = vals[KEY_MODE];
+    if(fields & PANEL_FIELD_DELAY)  panel->delay = vals[KEY_DELAY];
+    if(fields & PANEL_FIELD_TEMPERATURE) 
+        panel->temperature = vals[KEY_TEMPERATURE];
+    if(fields & PANEL_FIELD_FILTERBAD) 
+        panel->filterbad = (bool)vals[KEY_FILTERBAD];
+    if(present) *present = fields;
+    return 0;
+}
+
+int accpanel_parse(struct panel_st * panel, const char * json, size_t len)
+{
+    struct panel_st temp;
+    unsigned int present;
+    int r;
 
-    p->temperature = (msdigit<0 || lsdigit<0)? (-1) : (10*msdigit + lsdigit);
-    p->filterbad = (bool)fb;
+    if(!panel) return -EINVAL;
+    r = accpanel_decode(&temp, json, len, &present);
+    if(r) return r;
+    if(present != PANEL_FIELD_ALL) return -EINVAL;
 
+    panel->fan = temp.fan;
+    panel->mode = temp.mode;
+    panel->delay = temp.delay;
+    panel->temperature = temp.temperature;
+    panel->filterbad = temp.filterbad;
     return 0; 
 }
 
@@ -42,25 +273,252 @@ struct panel_st * accpanel_sub(struct panel_st * a, struct panel_st * b)
     return r;
 }
 
-int accpanel_cpy(struct panel_st * dest, struct panel_st * src, bool lock)
+bool accpanel_equal(const struct panel_st * a, const struct panel_st * b)
 {
-    // This function is meant to be generic, so we shouldn't lock both source
-    // and destination at the same time. It's a risk of deadlock.
-    
-    struct panel_st temp;
+    return  a->fan == b->fan &&
+            a->mode == b->mode &&
+            a->delay == b->delay &&
+            a->temperature == b->temperature &&
+            a->filterbad == b->filterbad;
+}
 
-    if(lock) pthread_mutex_lock(&src->mutex);
-    memcpy(&temp, src, sizeof(struct panel_st));
-    if(lock) pthread_mutex_unlock(&src->mutex);
-
-    if(lock) pthread_mutex_lock(&dest->mutex);
-    dest->fan = temp.fan;
-    dest->mode = temp.mode;
-    dest->delay = temp.delay;
-    dest->temperature = temp.temperature;
-    dest->filterbad = temp.filterbad;
-    dest->consumed = temp.consumed;
-    if(lock) pthread_mutex_unlock(&dest->mutex);
-    
+int accpanel_snprint(char * str, size_t n, const struct panel_st * panel)
+{
+    const struct panel_st * p = panel;
+    int t = p->temperature;
+    return snprintf(str, n, 
+        "{\"fan\": %i, \"mode\": %i, \"delay\": %i, \"msdigit\": %i, \"lsdigit\": %i, \"filterbad\": %i}", 
+        p->fan, p->mode, p->delay, (t < 0)? -1 : t / 10, (t < 0)? -1 : t % 10,
+        p->filterbad? 1:0);
+}
+
+int accpanel_cpy(struct panel_st * dest, const struct panel_st * src)
+{
+    if(!dest || !src) return -EINVAL;
+    dest->fan = src->fan;
+    dest->mode = src->mode;
+    dest->delay = src->delay;
+    dest->temperature = src->temperature;
+    dest->filterbad = src->filterbad;
+    return 0;
+}
+
+void accpanel_atomic_init(
+    struct panel_atomic_st * shared, 
+    const struct panel_st * panel)
+{
+    atomic_init(&shared->word, accpanel_pack(panel));
+}
+
+uint32_t accpanel_atomic_load(
+    struct panel_atomic_st * shared, 
+    struct panel_st * panel)
+{
+    uint64_t word = atomic_load_explicit(&shared->word, memory_order_acquire);
+    if(panel) accpanel_unpack(panel, (uint32_t)word);
+    return word >> 32;
+}
+
+uint32_t accpanel_atomic_store(
+    struct panel_atomic_st * shared, 
+    const struct panel_st * panel)
+{
+    uint64_t fields = accpanel_pack(panel);
+    uint64_t old = atomic_load_explicit(&shared->word, memory_order_relaxed);
+    uint64_t word;
+    // A loop rather than a plain store, in case two threads store at once:
+    // each one still gets a generation of its own.
+    do {
+        word = (((old >> 32) + 1) << 32) | fields;
+    } while(!atomic_compare_exchange_weak_explicit(&shared->word, &old, word,
+        memory_order_release, memory_order_relaxed));
+    return word >> 32;
+}
+
+/* The panel fields in the low half of a panel_atomic_st word */
+static uint32_t accpanel_pack(const struct panel_st * panel)
+{
+    return  ((uint32_t)panel->fan & 0xF) |
+            ((uint32_t)panel->mode & 0xF) << 4 |
+            ((uint32_t)panel->delay & 0xF) << 8 |
+            (uint32_t)(panel->filterbad? 1 : 0) << 12 |
+            (uint32_t)(uint16_t)(int16_t)panel->temperature << 16;
+}
+
+static void accpanel_unpack(struct panel_st * panel, uint32_t fields)
+{
+    panel->fan = fields & 0xF;
+    panel->mode = (fields >> 4) & 0xF;
+    panel->delay = (fields >> 8) & 0xF;
+    panel->filterbad = (fields >> 12) & 1;
+    panel->temperature = (int16_t)(uint16_t)(fields >> 16);
+}
+
+bool accpanel_frame_is(const void * buf, size_t len)
+{
+    if(!buf || len < sizeof(uint32_t)) return false;
+    return accpanel_get32(buf) == ACCPANEL_FRAME_MAGIC;
+}
+
+int accpanel_frame_decode(
+    struct accpanel_frame_st * frame, 
+    const void * buf, 
+    size_t len)
+{
+    const uint8_t * b = buf;
+    size_t size;
+
+    if(!frame || !accpanel_frame_is(buf, len)) return -EINVAL;
+    if(len < 8) return -EINVAL;
+    size = accpanel_frame_size(b[4]);
+    if(size == 0) return -EPROTONOSUPPORT;
+    if(len != size || accpanel_get16(&b[6]) != len) 
+        return -EINVAL;
+    if(accpanel_crc32(b, size - 4) != accpanel_get32(&b[size - 4])) 
+        return -EBADMSG;
+
+    frame->version = b[4];
+    frame->flags = b[5];
+    frame->seq = accpanel_get32(&b[8]);
+    frame->timestamp = accpanel_get64(&b[12]);
+    frame->fan = b[20];
+    frame->mode = b[21];
+    frame->delay = b[22];
+    frame->msdigit = (int8_t)b[23];
+    frame->lsdigit = (int8_t)b[24];
+    frame->filterbad = b[25];
+    if(frame->version >= 2)
+        memcpy(frame->margins, &b[ACCPANEL_FRAME_MARGINS_OFFSET], 
+            ACCPANEL_MARGINS);
+    else
+        memset(frame->margins, 0, ACCPANEL_MARGINS);
     return 0;
 }
+
+int accpanel_frame_topanel(
+    struct panel_st * panel, 
+    const struct accpanel_frame_st * frame)
+{
+    const struct accpanel_frame_st * f = frame;
+    if(!panel || !f) return -EINVAL;
+    if( f->fan >= FAN_LASTELEMENT ||
+        f->mode >= MODE_LASTELEMENT ||
+        f->delay >= DELAY_LASTELEMENT ||
+        f->msdigit > 9 || f->lsdigit > 9
+    ) {
+        return -EINVAL;
+    }
+
+    panel->fan = f->fan;
+    panel->mode = f->mode;
+    panel->delay = f->delay;
+    panel->temperature = (f->msdigit<0 || f->lsdigit<0)? 
+        (-1) : (10*f->msdigit + f->lsdigit);
+    panel->filterbad = (bool)f->filterbad;
+    return 0;
+}
+
+int accpanel_frame_snprint(
+    char * str, 
+    size_t n, 
+    const struct accpanel_frame_st * frame)
+{
+    const struct accpanel_frame_st * f = frame;
+    return snprintf(str, n, 
+        "{\"fan\": %i, \"mode\": %i, \"delay\": %i, \"msdigit\": %i, \"lsdigit\": %i, \"filterbad\": %i}", 
+        f->fan, f->mode, f->delay, f->msdigit, f->lsdigit, f->filterbad? 1:0);
+}
+
+size_t accpanel_frame_encode(
+    void * buf, 
+    size_t n, 
+    const struct accpanel_frame_st * frame)
+{
+    uint8_t * b = buf;
+    size_t size;
+    if(!b || !frame) return 0;
+    size = accpanel_frame_size(frame->version);
+    if(size == 0 || n < size) return 0;
+
+    memset(b, 0, size);
+    accpanel_put(&b[0], ACCPANEL_FRAME_MAGIC, 4);
+    b[4] = frame->version;
+    b[5] = frame->flags;
+    accpanel_put(&b[6], size, 2);
+    accpanel_put(&b[8], frame->seq, 4);
+    accpanel_put(&b[12], frame->timestamp, 8);
+    b[20] = frame->fan;
+    b[21] = frame->mode;
+    b[22] = frame->delay;
+    b[23] = (uint8_t)frame->msdigit;
+    b[24] = (uint8_t)frame->lsdigit;
+    b[25] = frame->filterbad;
+    if(frame->version >= 2)
+        memcpy(&b[ACCPANEL_FRAME_MARGINS_OFFSET], frame->margins, 
+            ACCPANEL_MARGINS);
+    accpanel_put(&b[size - 4], accpanel_crc32(b, size - 4), 4);
+    return size;
+}
+
+/* @returns the size of a frame of @param version, or 0 if it is unknown. */
+static size_t accpanel_frame_size(uint8_t version)
+{
+    switch(version) {
+        case 1: return ACCPANEL_FRAME_V1_SIZE;
+        case 2: return ACCPANEL_FRAME_SIZE;
+        default: return 0;
+    }
+}
+
+size_t accpanel_caps_encode(void * buf, size_t n)
+{
+    uint8_t * b = buf;
+    uint32_t magic = ACCPANEL_CAPS_MAGIC;
+
+    if(!b || n < ACCPANEL_CAPS_SIZE) return 0;
+    memset(b, 0, ACCPANEL_CAPS_SIZE);
+    for(int i=0; i<4; i++) b[i] = (magic >> (8*i)) & 0xFF;
+    b[4] = ACCPANEL_FRAME_VERSION;
+    return ACCPANEL_CAPS_SIZE;
+}
+
+/* Standard CRC-32 (as in zlib), four bits at a time to keep the table small. */
+uint32_t accpanel_crc32(const void * buf, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    const uint8_t * b = buf;
+    uint32_t crc = 0xFFFFFFFF;
+
+    for(size_t i=0; i<len; i++) {
+        crc ^= b[i];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+static uint16_t accpanel_get16(const uint8_t * b)
+{
+    return (uint16_t)b[0] | (uint16_t)b[1] << 8;
+}
+
+static uint32_t accpanel_get32(const uint8_t * b)
+{
+    return (uint32_t)accpanel_get16(b) | (uint32_t)accpanel_get16(&b[2]) << 16;
+}
+
+static uint64_t accpanel_get64(const uint8_t * b)
+{
+    return (uint64_t)accpanel_get32(b) | (uint64_t)accpanel_get32(&b[4]) << 32;
+}
+
+/* Little-endian, @param size bytes. */
+static void accpanel_put(uint8_t * b, uint64_t v, size_t size)
+{
+    for(size_t i=0; i<size; i++) b[i] = (v >> (8*i)) & 0xFF;
+}
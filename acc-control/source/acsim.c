@@ -0,0 +1,304 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "accpanel.h"
+#include "infrared.h"
+#include "machvis.h"
+#include "acsim.h"
+
+static void acsim_apply(struct acsim_st * sim, enum InfraCodes code);
+static void acsim_show(struct acsim_st * sim, struct accpanel_frame_st * f);
+static void acsim_send(struct acsim_st * sim);
+static uint32_t acsim_random(struct acsim_st * sim);
+static bool acsim_due(const struct timespec * due, const struct timespec * now);
+static void acsim_add_ms(struct timespec * ts, long ms);
+
+void acsim_config_default(struct acsim_config_st * config)
+{
+    config->latency_ms = ACSIM_LATENCY_MS;
+    config->drop_percent = 0;
+    config->frame_ms = ACSIM_FRAME_MS;
+    config->room = ACSIM_ROOM;
+    config->seed = 1;
+}
+
+int acsim_initialize(
+    struct acsim_st * sim,
+    int port,
+    const struct acsim_config_st * config)
+{
+    if(!sim || !config || port <= 0 || port > 65535) return -EINVAL;
+    if(config->frame_ms <= 0 || config->drop_percent < 0 ||
+        config->drop_percent > 100) return -EINVAL;
+
+    sim = memset(sim, 0, sizeof(*sim));
+    sim->config = *config;
+    sim->mode = MODE_COOL;
+    sim->fan = FAN_AUTO;
+    sim->setpoint = 72;
+    sim->delay = DELAY_NONE;
+    sim->rng = config->seed? config->seed : 1;     // xorshift can't take 0
+    pthread_mutex_init(&sim->mutex, NULL);
+
+    sim->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sim->fd < 0) {
+        int r = -errno;
+        pthread_mutex_destroy(&sim->mutex);
+        return r;
+    }
+    sim->addr.sin_family = AF_INET;
+    sim->addr.sin_port = htons(port);
+    sim->addr.sin_addr.s_addr = inet_addr(MACHVIS_SOCKET_PATH);
+    sim->run = true;
+    return 0;
+}
+
+int acsim_finalize(struct acsim_st * sim)
+{
+    if(!sim) return -EINVAL;
+    syslog(LOG_INFO, "acsim on port %d: %lu presses, %lu dropped, %lu frames, "
+        "%lu misread", ntohs(sim->addr.sin_port), sim->presses, sim->dropped, 
+        sim->frames, sim->misreads);
+    close(sim->fd);
+    pthread_mutex_destroy(&sim->mutex);
+    return 0;
+}
+
+void acsim_press(struct acsim_st * sim, enum InfraCodes code)
+{
+    struct acsim_press_st * p;
+
+    pthread_mutex_lock(&sim->mutex);
+    sim->presses++;
+    if(acsim_random(sim) % 100 < (uint32_t)sim->config.drop_percent ||
+        sim->length >= ACSIM_QUEUE_MAX) {
+        sim->dropped++;
+        pthread_mutex_unlock(&sim->mutex);
+        return;
+    }
+    if(sim->config.latency_ms <= 0) {
+        acsim_apply(sim, code);
+        pthread_mutex_unlock(&sim->mutex);
+        return;
+    }
+    p = &sim->queue[(sim->head + sim->length++) % ACSIM_QUEUE_MAX];
+    p->code = code;
+    clock_gettime(CLOCK_MONOTONIC, &p->due);
+    acsim_add_ms(&p->due, sim->config.latency_ms);
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+void acsim_panel_set(struct acsim_st * sim, const struct panel_st * panel)
+{
+    pthread_mutex_lock(&sim->mutex);
+    sim->length = 0;        // whatever was on its way is overtaken
+    sim->on = panel->mode != MODE_NONE;
+    if(sim->on) {
+        sim->mode = panel->mode;
+        sim->fan = panel->fan;
+        if(sim->mode == MODE_FAN && sim->fan == FAN_AUTO) 
+            sim->fan = FAN_HIGH;
+        if(panel->mode != MODE_FAN &&
+            panel->temperature >= TEMPERATURE_MINIMUM &&
+            panel->temperature <= TEMPERATURE_MAXIMUM)
+            sim->setpoint = panel->temperature;
+    }
+    sim->delay = panel->delay;
+    sim->filterbad = panel->filterbad;
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+void acsim_panel_get(struct acsim_st * sim, struct panel_st * panel)
+{
+    struct accpanel_frame_st f;
+    pthread_mutex_lock(&sim->mutex);
+    acsim_show(sim, &f);
+    pthread_mutex_unlock(&sim->mutex);
+    accpanel_frame_topanel(panel, &f);
+}
+
+void acsim_misread(
+    struct acsim_st * sim, 
+    const struct panel_st * panel, 
+    uint8_t margin)
+{
+    pthread_mutex_lock(&sim->mutex);
+    sim->misread = true;
+    accpanel_cpy(&sim->misreadpanel, panel);
+    sim->misreadmargin = margin;
+    pthread_mutex_unlock(&sim->mutex);
+}
+
+void *acsim_run(void * args)
+{
+    struct acsim_st * sim = args;
+    struct timespec next, now;
+    if(!sim) return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while(sim->run) {
+        acsim_add_ms(&next, sim->config.frame_ms);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pthread_mutex_lock(&sim->mutex);
+        while(sim->length && acsim_due(&sim->queue[sim->head].due, &now)) {
+            acsim_apply(sim, sim->queue[sim->head].code);
+            sim->head = (sim->head + 1) % ACSIM_QUEUE_MAX;
+            sim->length--;
+        }
+        pthread_mutex_unlock(&sim->mutex);
+        acsim_send(sim);
+    }
+    return NULL;
+}
+
+/* One key press on the unit. Must hold the mutex. */
+static void acsim_apply(struct acsim_st * sim, enum InfraCodes code)
+{
+    if(code == infra_power) {
+        sim->on = !sim->on;
+        return;
+    }
+    if(code == infra_delay) {
+        enum panel_delay led = sim->on? DELAY_OFF : DELAY_ON;
+        sim->delay = (sim->delay == led)? DELAY_NONE : led;
+        return;
+    }
+    if(!sim->on) return;
+
+    switch(code) {
+        case infra_mode:
+            sim->mode = (sim->mode == MODE_COOL)?
+                MODE_LASTELEMENT - 1 : sim->mode - 1;
+            if(sim->mode == MODE_FAN && sim->fan == FAN_AUTO)
+                sim->fan = FAN_HIGH;
+            break;
+        case infra_eco:
+            sim->mode = MODE_ECO;
+            break;
+        case infra_speed:
+            if(sim->mode == MODE_FAN)
+                sim->fan = (sim->fan <= FAN_HIGH)?
+                    FAN_LASTELEMENT - 1 : sim->fan - 1;
+            else
+                sim->fan = (sim->fan == FAN_AUTO)?
+                    FAN_LASTELEMENT - 1 : sim->fan - 1;
+            break;
+        case infra_plus:
+            if(sim->mode != MODE_FAN && sim->setpoint < TEMPERATURE_MAXIMUM)
+                sim->setpoint++;
+            break;
+        case infra_minus:
+            if(sim->mode != MODE_FAN && sim->setpoint > TEMPERATURE_MINIMUM)
+                sim->setpoint--;
+            break;
+        default:
+            break;
+    }
+}
+
+/* What machvis would read off the panel. Must hold the mutex. */
+static void acsim_show(struct acsim_st * sim, struct accpanel_frame_st * f)
+{
+    int shown = (sim->mode == MODE_FAN)? sim->config.room : sim->setpoint;
+
+    memset(f, 0, sizeof(*f));
+    f->version = ACCPANEL_FRAME_VERSION;
+    f->seq = sim->seq;
+    f->delay = sim->delay;
+    f->filterbad = sim->filterbad;
+    memset(f->margins, UINT8_MAX, sizeof(f->margins));   // never misread
+    if(sim->on) {
+        f->fan = sim->fan;
+        f->mode = sim->mode;
+        f->msdigit = shown / 10;
+        f->lsdigit = shown % 10;
+    }
+    else {
+        f->fan = FAN_NONE;
+        f->mode = MODE_NONE;
+        f->msdigit = -1;
+        f->lsdigit = -1;
+    }
+}
+
+static void acsim_send(struct acsim_st * sim)
+{
+    char buf[ACCPANEL_JSON_SIZE];
+    struct accpanel_frame_st f;
+    struct timespec ts;
+    size_t len;
+    ssize_t r;
+
+    // machvis answers JSON with its capabilities. Switch to frames then.
+    r = recv(sim->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if(r >= ACCPANEL_CAPS_SIZE && memcmp(buf, "ACCC", 4) == 0) {
+        sim->binary = true;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    pthread_mutex_lock(&sim->mutex);
+    acsim_show(sim, &f);
+    if(sim->misread) {
+        const struct panel_st * p = &sim->misreadpanel;
+        f.fan = p->fan;
+        f.mode = p->mode;
+        f.delay = p->delay;
+        f.msdigit = (p->temperature < 0)? -1 : p->temperature / 10;
+        f.lsdigit = (p->temperature < 0)? -1 : p->temperature % 10;
+        f.filterbad = p->filterbad;
+        memset(f.margins, sim->misreadmargin, sizeof(f.margins));
+        sim->misread = false;
+        sim->misreads++;
+    }
+    f.timestamp = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    sim->seq++;
+    sim->frames++;
+    pthread_mutex_unlock(&sim->mutex);
+
+    if(sim->binary) {
+        len = accpanel_frame_encode(buf, sizeof(buf), &f);
+    }
+    else {
+        len = accpanel_frame_snprint(buf, sizeof(buf), &f) + 1;
+    }
+    if(sendto(sim->fd, buf, len, 0,
+        (struct sockaddr *)&sim->addr, sizeof(sim->addr)) < 0) {
+        syslog(LOG_DEBUG, "acsim could not send: %s", strerror(errno));
+    }
+}
+
+/* xorshift32, so runs with the same seed drop the same presses. */
+static uint32_t acsim_random(struct acsim_st * sim)
+{
+    uint32_t x = sim->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return sim->rng = x;
+}
+
+static bool acsim_due(const struct timespec * due, const struct timespec * now)
+{
+    return now->tv_sec > due->tv_sec ||
+        (now->tv_sec == due->tv_sec && now->tv_nsec >= due->tv_nsec);
+}
+
+static void acsim_add_ms(struct timespec * ts, long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if(ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
@@ -10,37 +10,14 @@
 #include "accpanel.h"
 #include "mqtt.h"
 #include "machvis.h"
+#include "history.h"
+#include "trace.h"
 #include "control.h"
 
-/* *** buttonclick data structures ***
- * Always update together the buttonclick_enum, buttonclick_st and the 
- * buttonclick_to_infracodes_binding.
- * 
- * The button clicks will be sent out in the order they appear in the data
- * structures. For example, if power is at the top of the list, and then fan, 
- * the power button is the first to be pressed, then the fan, and so on.
- * 
+/* The buttonclick data structures are in control.h. Always update them
+ * together with buttonclick_to_infracodes_binding.
  */
 
-enum buttonclick_enum {
-    BUTTON_POWER = 0,
-    BUTTON_MODE,
-    BUTTON_FAN,
-    BUTTON_DELAY,
-    BUTTON_PLUS,
-    BUTTON_MINUS,
-    BUTTON_ENUMSIZE          // always keep last
-};
-
-struct buttonclick_st {
-    int power;
-    int mode;
-    int fan;
-    int delay;
-    int plus;
-    int minus;
-};
-
 union buttonclick_un {
     struct buttonclick_st st;
     int arry[BUTTON_ENUMSIZE];    
@@ -55,47 +32,153 @@ union buttonclick_un buttonclick_to_infracodes_binding = {
     .st.minus = infra_minus
 };
 
-int control_getclicks(
-    struct buttonclick_st * clicks,
-    struct panel_st * desired, 
-    struct panel_st * actual);
-int control_sendclicks(struct buttonclick_st * clicks, struct infra_st * infra);
+int control_sendclicks(
+    struct buttonclick_st * clicks, 
+    struct irqueue_client_st * ir,
+    unsigned long ticket,
+    struct panel_st * expected);
 int control_buttonclick_snprint(char *str, size_t n, struct buttonclick_st * b);
+static void control_history(struct control_st * control);
+static void control_stats(struct control_st * control);
+static void control_confirm(struct control_st * control);
+static int control_press(struct panel_st * panel, enum buttonclick_enum btn);
+static void control_planfrom(
+    struct control_st * control, 
+    const struct panel_st * actual);
+static int control_converge(
+    struct control_st * control, 
+    const struct panel_st * target, 
+    bool poweron);
+static void control_deadline(struct timespec * ts, long ms);
 
 
 int control_initialize(
     struct control_st * control, 
     struct mqtt_st * mqtt, 
-    struct infra_st * infra,
-    struct machvis_st * mv)
+    struct irqueue_client_st * ir,
+    struct machvis_st * mv,
+    const char * name)
 {
-    if(!mqtt || !mv || !infra) return -EINVAL;
-
-    control->desiredpanel = malloc(sizeof(struct panel_st));
+    int r;
+    char topic[MQTT_TOPIC_SIZE];
+    if(!mv || !ir) return -EINVAL;
+
+    if(name && name[0]) {
+        r = snprintf(topic, sizeof(topic), "%s/%s", MQTT_TOPIC, name);
+        if(r < 0 || (size_t)r >= sizeof(topic)) return -ENAMETOOLONG;
+        r = snprintf(control->listentopic, sizeof(control->listentopic), 
+            "%s/%s", MQTT_LISTEN_TOPIC, name);
+        if(r < 0 || (size_t)r >= sizeof(control->listentopic)) 
+            return -ENAMETOOLONG;
+        r = snprintf(control->historytopic, sizeof(control->historytopic), 
+            "%s/%s", HISTORY_TOPIC, name);
+        if(r < 0 || (size_t)r >= sizeof(control->historytopic)) 
+            return -ENAMETOOLONG;
+        r = snprintf(control->statstopic, sizeof(control->statstopic), 
+            "%s/%s", TRACE_TOPIC, name);
+        if(r < 0 || (size_t)r >= sizeof(control->statstopic)) 
+            return -ENAMETOOLONG;
+    }
+    else {
+        strcpy(topic, MQTT_TOPIC);
+        strcpy(control->listentopic, MQTT_LISTEN_TOPIC);
+        strcpy(control->historytopic, HISTORY_TOPIC);
+        strcpy(control->statstopic, TRACE_TOPIC);
+    }
+    trace_initialize(&control->trace);
+    control->tracegeneration = 0;
+    ir->trace = &control->trace;
+    history_initialize(&control->history);
+    control->historyreceived = 0;
+    control->expected = (struct panel_st)PANEL_INITIALIZER;
+    control->expectedvalid = false;
+    control->preempted = 0;
+    control->expected_ms = CONTROL_EXPECTED_MS;
+    control->deadline_ms = CONTROL_CONVERGE_DEADLINE_MS;
+    control->settle_ms = CONTROL_CONVERGE_SETTLE_MS;
+    mqtt_publisher_initialize(&control->publisher, topic);
+
+    control->desiredpanel = malloc(sizeof(struct panel_atomic_st));
     if(!control->desiredpanel) return -errno;
-    control->actualpanel = malloc(sizeof(struct panel_st));
+    control->actualpanel = malloc(sizeof(struct panel_atomic_st));
     if(!control->actualpanel) return -errno;
 
     control->mqtt = mqtt;
     control->mv = mv;
-    control->infra = infra;
-    *control->desiredpanel = (struct panel_st)PANEL_INITIALIZER;
-    *control->actualpanel = (struct panel_st)PANEL_INITIALIZER;
+    control->ir = ir;
+    // Both start at generation 0, as if planned already: nothing to do
+    // until a command arrives, and then not before machvis sends a panel.
+    accpanel_atomic_init(control->desiredpanel, 
+        &(struct panel_st)PANEL_INITIALIZER);
+    accpanel_atomic_init(control->actualpanel, 
+        &(struct panel_st)PANEL_INITIALIZER);
+    control->desiredplanned = 0;
+    control->actualplanned = 0;
     
     machvis_machvispanel_set(mv, control->actualpanel);
-    mqtt_listen_callback_set(control->mqtt, control);
+    if(control->mqtt) {
+        r = mqtt_listen_add(control->mqtt, control->listentopic, control);
+        if(r) return r;
+    }
 
     return 0;
 }
 int control_finalize(struct control_st * control)
 {
+    // The MQTT connection may be shared with other units, so it is left alone.
+    if(control->mqtt) mqtt_listen_remove(control->mqtt, control);
+    syslog(LOG_INFO, "%s: published %lu, suppressed %lu, debounced %lu", 
+        control->publisher.topic, 
+        control->publisher.published, 
+        control->publisher.suppressed,
+        control->publisher.debounced);
+    syslog(LOG_INFO, "%s: preempted %lu bursts", 
+        control->listentopic, control->preempted);
+    control->ir->trace = NULL;
+    trace_finalize(&control->trace);
     free(control->desiredpanel);
     free(control->actualpanel);
-    mqtt_disconnect(control->mqtt);
     machvis_close(control->mv);
     return 0;
 }
 
+int control_command(
+    struct control_st * control, 
+    const void * payload, 
+    size_t len)
+{
+    int r;
+    unsigned int present = 0;
+    uint64_t id;
+    struct panel_st panel = PANEL_INITIALIZER;
+    struct panel_st previous = PANEL_INITIALIZER;
+
+    /* The fields left out are kept from the last command or, if there has
+     * not been one, from what the panel shows.
+     */
+    accpanel_atomic_load(control->desiredpanel, &panel);
+    if(panel.temperature == -1) 
+        accpanel_atomic_load(control->actualpanel, &panel);
+
+    accpanel_cpy(&previous, &panel);
+    r = accpanel_decode(&panel, payload, len, &present);
+    if(r || !present) return -EINVAL;
+
+    // A new generation, even if it is the same panel, so that it is planned.
+    accpanel_atomic_store(control->desiredpanel, &panel);
+    id = trace_received(&control->trace);
+    syslog(LOG_DEBUG, "Command %016llx for %s", 
+        (unsigned long long)id, control->listentopic);
+    // Latest wins: the burst for the previous command is not wanted anymore.
+    if(!accpanel_equal(&previous, &panel)) control_preempt(control);
+    return 0;
+}
+
+void control_preempt(struct control_st * control)
+{
+    irqueue_cancel(control->ir);
+}
+
 void *control_publish(void *args)
 {
     int r;
@@ -105,7 +188,10 @@ void *control_publish(void *args)
     control->publish = true;
     do {
         pthread_testcancel();
-        r = mqtt_publish_panel_state(control->mqtt, control->mv);
+        control_history(control);
+        control_stats(control);
+        r = mqtt_publish_panel_state(control->mqtt, control->mv, 
+            &control->publisher);
         if(r == -EALREADY) {
             usleep(100000);
         }
@@ -117,12 +203,81 @@ void *control_publish(void *args)
     return NULL;
 }
 
+/* Sample the actual panel for the history topic, as long as machvis is
+ * still sending, and publish a batch when one is due.
+ */
+static void control_history(struct control_st * control)
+{
+    struct machvis_counters_st counters;
+    struct panel_st panel = PANEL_INITIALIZER;
+    uint64_t now = history_now();
+    size_t n;
+
+    machvis_counters_get(control->mv, &counters);
+    if(counters.received != control->historyreceived) {
+        accpanel_atomic_load(control->actualpanel, &panel);
+        if(history_sample(&control->history, &panel, now))
+            control->historyreceived = counters.received;
+    }
+    else {
+        history_skip(&control->history, now);
+    }
+
+    n = history_batch(&control->history, now);
+    if(n) {
+        mqtt_publish_buffer(control->mqtt, control->historytopic, 
+            control->history.buffer, n);
+    }
+}
+
+/* Publish the trace histograms when a window is over. */
+static void control_stats(struct control_st * control)
+{
+    char json[TRACE_JSON_SIZE];
+    size_t n = trace_window(&control->trace, json, sizeof(json));
+    if(n) mqtt_publish_buffer(control->mqtt, control->statstopic, json, n);
+}
+
+/* Close the trace of the current command on the first new panel from
+ * machvis that shows it.
+ */
+static void control_confirm(struct control_st * control)
+{
+    unsigned long generation;
+    struct panel_st desired = PANEL_INITIALIZER;
+    struct panel_st actual = PANEL_INITIALIZER;
+
+    if(!trace_pending(&control->trace)) return;
+    generation = machvis_generation(control->mv);
+    if(generation == control->tracegeneration) return;
+    control->tracegeneration = generation;
+
+    accpanel_atomic_load(control->desiredpanel, &desired);
+    accpanel_atomic_load(control->actualpanel, &actual);
+    if(control_reached(&actual, &desired)) trace_confirmed(&control->trace);
+}
+
+bool control_reached(
+    const struct panel_st * actual, 
+    const struct panel_st * desired)
+{
+    if(actual->mode != desired->mode || actual->fan != desired->fan)
+        return false;
+    if(desired->mode == MODE_NONE || desired->mode == MODE_FAN) 
+        return true;
+    return actual->temperature == desired->temperature;
+}
+
 void *control_loop(void * args)
 {
     int r;
     struct control_st * control = args;
     struct buttonclick_st clicks;
-    struct panel_st temppanel;
+    struct panel_st desired = PANEL_INITIALIZER;
+    struct panel_st actual = PANEL_INITIALIZER;
+    struct panel_st from;
+    uint32_t desiredgen, actualgen;
+    unsigned long ticket;
 
     if(!control) return NULL;
 
@@ -131,73 +286,65 @@ void *control_loop(void * args)
 
         pthread_testcancel();
 
-        pthread_mutex_lock(&control->desiredpanel->mutex);
-        if(control->desiredpanel->consumed) {
-            pthread_mutex_unlock(&control->desiredpanel->mutex);
+        // Before the command is read, so that a newer one cancels the burst
+        // even if it comes before the burst is queued.
+        ticket = irqueue_ticket(control->ir);
+        // Nothing new since the last plan
+        desiredgen = accpanel_atomic_load(control->desiredpanel, &desired);
+        if(desiredgen == control->desiredplanned) {
+            control_confirm(control);
             usleep(5000);     // relatively fast, for lower latency
             continue;
         }
 
-        pthread_mutex_lock(&control->actualpanel->mutex);
-        if(control->actualpanel->consumed) {
-            pthread_mutex_unlock(&control->actualpanel->mutex);
-            pthread_mutex_unlock(&control->desiredpanel->mutex);
+        actualgen = accpanel_atomic_load(control->actualpanel, &actual);
+        control_planfrom(control, &actual);
+        // Right after a burst the panel is stale, but the presses sent say
+        // where it is headed, so there is no need to wait for machvis.
+        if(actualgen == control->actualplanned && !control->expectedvalid) {
             usleep(100000);       // relatively fast, for lower latency
             continue;
         }
+        accpanel_cpy(&from, control->expectedvalid? 
+            &control->expected : &actual);
         
         r = control_getclicks( 
             &clicks,
-            control->desiredpanel, 
-            control->actualpanel);
+            &desired, 
+            &from);
+        if(r >= 0 || r == -EAGAIN) trace_planned(&control->trace);
         
         if(r >= 0) {
-            control->desiredpanel->consumed = true;
-            control->actualpanel->consumed = true;
-            pthread_mutex_unlock(&control->actualpanel->mutex);
-            pthread_mutex_unlock(&control->desiredpanel->mutex);
-            control_sendclicks(&clicks, control->infra);    // complete command
+            control->desiredplanned = desiredgen;
+            control->actualplanned = actualgen;
+            r = control_sendclicks(&clicks, control->ir, ticket, &from);
+            // Whatever was sent, the next plan starts from there. If a
+            // newer command cut the burst short, it is planned right away.
+            if(r >= 0) {
+                if(r > 0) control->preempted++;
+                accpanel_cpy(&control->expected, &from);
+                control->expectedvalid = true;
+                clock_gettime(CLOCK_MONOTONIC, &control->expectedsince);
+            }
+            else {
+                control->expectedvalid = false;
+            }
         }
         else if(r == -EAGAIN) {
-            accpanel_cpy(&temppanel, control->desiredpanel, false);
-            control->desiredpanel->consumed = false;
-            control->actualpanel->consumed = false;
-            // `= false` will make the loop send clicks again next time 
-            // (it calculates what is missing).
-            pthread_mutex_unlock(&control->actualpanel->mutex);
-            pthread_mutex_unlock(&control->desiredpanel->mutex);
-            control_sendclicks(&clicks, control->infra);    // partial command
-            // Wait n seconds for the AC to respond to the partial command.
-            int i, n;
-            for(i=0, n=10; i<n; i++) {
-                sleep(1);
-                pthread_mutex_lock(&control->actualpanel->mutex);
-                bool reacheddesired =
-                    control->actualpanel->mode == temppanel.mode &&
-                    control->actualpanel->fan  == temppanel.fan;
-                bool reachedpoweron =
-                    control->actualpanel->mode != MODE_NONE &&
-                    control->actualpanel->fan  != FAN_NONE;
-                if((clicks.power == 1 && reachedpoweron) ||
-                   (clicks.power == 0 && reacheddesired)) {
-                    pthread_mutex_unlock(&control->actualpanel->mutex);
-                    sleep(1); // for good measure
-                    break;
-                }
-                else {
-                    pthread_mutex_unlock(&control->actualpanel->mutex);
-                }
-            }
-            if(i == n) {
+            // The planned generations are left alone, so that the loop sends
+            // clicks again next time (it calculates what is missing).
+            control->expectedvalid = false;
+            control_sendclicks(&clicks, control->ir, ticket, NULL); // partial
+            // Carry on with the rest as soon as the AC shows it responded.
+            r = control_converge(control, &desired, clicks.power == 1);
+            if(r == -ETIMEDOUT) {
                 syslog(LOG_NOTICE,"Gave up waiting for AC to respond to partial command.");
             }
         }
         else{
-            control->desiredpanel->consumed = false;
-            control->actualpanel->consumed = false;
+            // Try again with the next panel from machvis
+            control->actualplanned = actualgen;
             syslog(LOG_NOTICE, "getclicks: %s", strerror(-r));
-            pthread_mutex_unlock(&control->actualpanel->mutex);
-            pthread_mutex_unlock(&control->desiredpanel->mutex);
         }
     } while(control->loop);
 
@@ -211,6 +358,7 @@ int control_getclicks(
 {
     int r = 0;
     struct panel_st * diff = NULL;
+    struct panel_st via;
 
     if(!desired || !actual) {
         r = -EINVAL;
@@ -308,7 +456,6 @@ int control_getclicks(
         // Don't send temperature clicks because this mode doesn't use them.
         diff->temperature = 0;
         fan_wraparound--;   // AC skips FAN_AUTO in MODE_FAN, fix wraparound
-        if(desired->fan == FAN_AUTO) diff->fan = 0; // ignore FAN_AUTO request
     }
     /* End of handle fan edge cases */
 
@@ -318,6 +465,13 @@ int control_getclicks(
 
     clicks->mode = 
         ((int)diff->mode > 0)?    mode_wraparound - diff->mode  : -diff->mode;
+    // The fan is pressed after the mode, so count from the fan the mode
+    // presses leave it on. The AC moves FAN_AUTO to FAN_HIGH in MODE_FAN.
+    accpanel_cpy(&via, actual);
+    for(int i = 0; i < clicks->mode; i++) control_press(&via, BUTTON_MODE);
+    diff->fan = desired->fan - via.fan;
+    if(desired->mode == MODE_FAN && desired->fan == FAN_AUTO) 
+        diff->fan = 0;  // ignore FAN_AUTO request
     clicks->fan = 
         ((int)diff->fan > 0)?      fan_wraparound - diff->fan   : -diff->fan;
     clicks->plus = 
@@ -331,9 +485,22 @@ int control_getclicks(
 
 }
 
-int control_sendclicks(struct buttonclick_st * clicks, struct infra_st * infra)
+/* Send @param clicks through @param ir, planned with irqueue ticket @param
+ * ticket. If @param expected is not NULL, the
+ * presses that were sent are applied to it, and it is left invalid (@returns
+ * -EAGAIN) if the outcome of a press can't be predicted. @returns the number
+ * of presses that were not sent, or a negative errno.
+ */
+int control_sendclicks(
+    struct buttonclick_st * clicks, 
+    struct irqueue_client_st * ir,
+    unsigned long ticket,
+    struct panel_st * expected)
 {
     int r;
+    enum InfraCodes codes[IRQUEUE_BURST_MAX];
+    enum buttonclick_enum buttons[IRQUEUE_BURST_MAX];
+    size_t n = 0;
 
     size_t dstrs = 200;
     char * dstr = malloc(dstrs);
@@ -349,12 +516,141 @@ int control_sendclicks(struct buttonclick_st * clicks, struct infra_st * infra)
     
     // For every button on the buttonclick_enum list
     for(enum buttonclick_enum btn = 0; btn < BUTTON_ENUMSIZE; btn++) {
-        for(int i = 0; i < cl->arry[btn]; i++){
-            infrared_send(infra, buttonclick_to_infracodes_binding.arry[btn]);
+        for(int i = 0; i < cl->arry[btn] && n < IRQUEUE_BURST_MAX; i++){
+            buttons[n] = btn;
+            codes[n++] = buttonclick_to_infracodes_binding.arry[btn];
         }
     }
 
-    return 0;
+    r = irqueue_send(ir, codes, n, ticket);
+    if(r < 0) {
+        syslog(LOG_ERR, "Failed to queue IR presses: %s", strerror(-r));
+        return r;
+    }
+    if((size_t)r < n) {
+        syslog(LOG_INFO, "Sent %d of %zu IR presses", r, n);
+    }
+    if(expected) {
+        for(int i = 0; i < r; i++) {
+            if(control_press(expected, buttons[i])) return -EAGAIN;
+        }
+    }
+    return n - r;
+}
+
+/* What one press of @param btn does to @param panel, following the same
+ * rules as control_getclicks. @returns -EAGAIN if it can't be told from the
+ * panel alone, like what the unit comes back to after a power-on.
+ */
+static int control_press(struct panel_st * panel, enum buttonclick_enum btn)
+{
+    int lowest;
+    switch(btn) {
+        case BUTTON_POWER:
+            if(panel->mode == MODE_NONE) return -EAGAIN;
+            panel->mode = MODE_NONE;
+            panel->fan = FAN_NONE;
+            return 0;
+        case BUTTON_MODE:
+            if(panel->mode == MODE_NONE) return -EAGAIN;
+            panel->mode = (panel->mode == MODE_COOL)? 
+                MODE_LASTELEMENT - 1 : panel->mode - 1;
+            if(panel->mode == MODE_FAN && panel->fan == FAN_AUTO)
+                panel->fan = FAN_HIGH;
+            return 0;
+        case BUTTON_FAN:
+            if(panel->fan == FAN_NONE) return -EAGAIN;
+            // The AC skips FAN_AUTO in MODE_FAN
+            lowest = (panel->mode == MODE_FAN)? FAN_HIGH : FAN_AUTO;
+            panel->fan = ((int)panel->fan <= lowest)? 
+                FAN_LASTELEMENT - 1 : panel->fan - 1;
+            return 0;
+        case BUTTON_PLUS:
+            if(panel->mode != MODE_FAN && 
+                panel->temperature < TEMPERATURE_MAXIMUM) 
+                panel->temperature++;
+            return 0;
+        case BUTTON_MINUS:
+            if(panel->mode != MODE_FAN && 
+                panel->temperature > TEMPERATURE_MINIMUM) 
+                panel->temperature--;
+            return 0;
+        default:
+            return -EAGAIN;
+    }
+}
+
+/* Wait for machvis to show that the AC responded to a partial command: it
+ * is on, if @param poweron, or else it is in the mode and fan of @param
+ * target. The panel must keep showing it for settle_ms, in case machvis
+ * caught it mid-change. @returns 0, or -ETIMEDOUT after deadline_ms.
+ */
+static int control_converge(
+    struct control_st * control, 
+    const struct panel_st * target, 
+    bool poweron)
+{
+    int r;
+    bool reached, matched = false;
+    struct timespec deadline, settled;
+    struct panel_st actual = PANEL_INITIALIZER;
+    unsigned long generation = machvis_generation(control->mv);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    control_deadline(&deadline, control->deadline_ms);
+    while(control->loop) {
+        r = machvis_wait(control->mv, &generation, 
+            matched? &settled : &deadline);
+        if(r == -ETIMEDOUT) return matched? 0 : r;
+
+        accpanel_atomic_load(control->actualpanel, &actual);
+        if(poweron)
+            reached = actual.mode != MODE_NONE && actual.fan != FAN_NONE;
+        else
+            reached = actual.mode == target->mode && 
+                actual.fan == target->fan;
+
+        if(reached && !matched) {
+            if(control->settle_ms <= 0) return 0;
+            matched = true;
+            clock_gettime(CLOCK_MONOTONIC, &settled);
+            control_deadline(&settled, control->settle_ms);
+        }
+        else if(!reached) {
+            matched = false;
+        }
+    }
+    return -ECANCELED;
+}
+
+static void control_deadline(struct timespec * ts, long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if(ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Stop planning from the presses sent once machvis shows them in @param
+ * actual, or once it is clear that it never will.
+ */
+static void control_planfrom(
+    struct control_st * control, 
+    const struct panel_st * actual)
+{
+    struct timespec now;
+    long elapsed;
+
+    if(!control->expectedvalid) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - control->expectedsince.tv_sec) * 1000 + 
+        (now.tv_nsec - control->expectedsince.tv_nsec) / 1000000;
+    if(accpanel_equal(actual, &control->expected) || 
+        elapsed > control->expected_ms) {
+        control->expectedvalid = false;
+    }
 }
 
 int control_buttonclick_snprint(char *str, size_t n, struct buttonclick_st * b)
@@ -0,0 +1,373 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "gpio.h"
+#include "infrared.h"
+#include "irqueue.h"
+#include "machvis.h"
+#include "mqtt.h"
+#include "control.h"
+#include "acsim.h"
+#include "gateway.h"
+
+#define GATEWAY_LINE_SIZE   (512)
+
+static int gateway_parse_line(
+    struct gateway_st * gw,
+    char * line,
+    const char * path,
+    int lineno);
+static int gateway_parse_int(const char * s, int min, int max, int * val);
+static bool gateway_name_valid(const char * name);
+
+int gateway_default(struct gateway_st * gw)
+{
+    if(!gw) return -EINVAL;
+    gw = memset(gw, 0, sizeof(*gw));
+    gw->nemitters = 1;
+    gw->nunits = 1;
+    gw->units[0].port = MACHVIS_SOCKET_PORT;
+    gw->units[0].debounce_ms = -1;
+    gw->units[0].heartbeat_s = -1;
+    gw->units[0].deadline_ms = -1;
+    gw->units[0].settle_ms = -1;
+    gw->units[0].interval_ms = -1;
+    return 0;
+}
+
+int gateway_load(struct gateway_st * gw, const char * path)
+{
+    int r = 0, errors = 0, lineno = 0;
+    char line[GATEWAY_LINE_SIZE];
+
+    if(!gw || !path) return -EINVAL;
+    gw = memset(gw, 0, sizeof(*gw));
+
+    FILE * f = fopen(path, "r");
+    if(!f) {
+        r = -errno;
+        syslog(LOG_ERR, "Can't open %s: %s", path, strerror(errno));
+        return r;
+    }
+    while(fgets(line, sizeof(line), f)) {
+        lineno++;
+        if(gateway_parse_line(gw, line, path, lineno)) errors++;
+    }
+    fclose(f);
+
+    if(gw->nemitters == 0) gw->nemitters = 1;  // the default lircd socket
+    size_t waves = 0;
+    for(size_t i=0; i<gw->nemitters; i++) if(gw->emitters[i].wave[0]) waves++;
+    if(waves > 1) {
+        // pigpio has a single waveform transmitter, and a single LED pin
+        syslog(LOG_ERR, "%s: only one emitter can be a wave", path);
+        errors++;
+    }
+    for(size_t i=0; i<gw->nunits; i++) {
+        if(gw->units[i].emitter >= gw->nemitters) {
+            syslog(LOG_ERR, "%s: unit %s uses undeclared emitter %u",
+                path, gw->units[i].name, gw->units[i].emitter);
+            errors++;
+        }
+        else if(gw->emitters[gw->units[i].emitter].wave[0] &&
+            gw->units[i].transmitter > 1) {
+            syslog(LOG_ERR, "%s: unit %s uses transmitter %d of a wave emitter",
+                path, gw->units[i].name, gw->units[i].transmitter);
+            errors++;
+        }
+    }
+    if(gw->nunits == 0) {
+        syslog(LOG_ERR, "%s: no units declared", path);
+        errors++;
+    }
+    return errors? -EINVAL : 0;
+}
+
+int gateway_start(
+    struct gateway_st * gw,
+    struct GPIO * gpio,
+    struct mqtt_st * mqtt)
+{
+    int r;
+    if(!gw || !gpio || !mqtt) return -EINVAL;
+
+    r = irqueue_initialize(&gw->irq);
+    if(r) return r;
+    for(size_t i=0; i<gw->nemitters; i++) {
+        struct gateway_emitter_st * e = &gw->emitters[i];
+        if(e->wave[0])
+            r = infrared_initialize_wave(&e->infra, gpio, e->wave);
+        else
+            r = infrared_initialize(&e->infra, gpio, 
+                e->lircd[0]? e->lircd : NULL);
+        if(r) return r;
+        r = irqueue_emitter_add(&gw->irq, &e->infra);
+        if(r < 0) return r;
+    }
+    pthread_create(&gw->irqueue_thread, NULL, irqueue_run, &gw->irq);
+
+    for(size_t i=0; i<gw->nunits; i++) {
+        struct gateway_unit_st * u = &gw->units[i];
+        r = machvis_initialize(&u->mv, u->port);
+        if(r) return r;
+        pthread_create(&u->machvis_thread, NULL, machvis_receive, &u->mv);
+
+        if(gw->simulate) {
+            struct acsim_config_st config = gw->simconfig;
+            config.seed += i;       // the same run every time, but not in step
+            r = acsim_initialize(&u->sim, u->port, &config);
+            if(r) return r;
+            r = infrared_simulator_add(&gw->emitters[u->emitter].infra,
+                &u->sim, u->transmitter);
+            if(r) return r;
+            pthread_create(&u->sim_thread, NULL, acsim_run, &u->sim);
+        }
+
+        r = irqueue_client_initialize(&gw->irq, &u->ir,
+            u->emitter, u->transmitter);
+        if(r) return r;
+        if(u->interval_ms >= 0) 
+            u->ir.interval_ms = u->interval_ms;
+
+        r = control_initialize(&u->control, mqtt, &u->ir, &u->mv, u->name);
+        if(r) return r;
+        if(u->debounce_ms >= 0) 
+            u->control.publisher.debounce_ms = u->debounce_ms;
+        if(u->heartbeat_s > 0) 
+            u->control.publisher.heartbeat_s = u->heartbeat_s;
+        if(u->deadline_ms > 0) 
+            u->control.deadline_ms = u->deadline_ms;
+        if(u->settle_ms >= 0) 
+            u->control.settle_ms = u->settle_ms;
+        pthread_create(&u->control.control_publish_thread, NULL,
+            control_publish, &u->control);
+        pthread_create(&u->control.control_loop_thread, NULL,
+            control_loop, &u->control);
+        syslog(LOG_INFO, "Started unit '%s' on port %d, emitter %u",
+            u->name, u->port, u->emitter);
+    }
+    return 0;
+}
+
+int gateway_stop(struct gateway_st * gw)
+{
+    if(!gw) return -EINVAL;
+
+    for(size_t i=0; i<gw->nunits; i++) {
+        gw->units[i].mv.receive = false;
+        gw->units[i].control.publish = false;
+        gw->units[i].control.loop = false;
+    }
+    // Let any control loop that is waiting on a burst go.
+    irqueue_stop(&gw->irq);
+    pthread_join(gw->irqueue_thread, NULL);
+
+    for(size_t i=0; i<gw->nunits; i++) {
+        struct gateway_unit_st * u = &gw->units[i];
+        pthread_join(u->control.control_loop_thread, NULL);
+        pthread_join(u->control.control_publish_thread, NULL);
+        pthread_join(u->machvis_thread, NULL);
+        if(gw->simulate) {
+            u->sim.run = false;
+            pthread_join(u->sim_thread, NULL);
+            acsim_finalize(&u->sim);
+        }
+        control_finalize(&u->control);
+        machvis_finalize(&u->mv);
+    }
+    irqueue_finalize(&gw->irq);
+
+    for(size_t i=0; i<gw->nemitters; i++) {
+        infrared_finalize(&gw->emitters[i].infra);
+    }
+    return 0;
+}
+
+static int gateway_parse_line(
+    struct gateway_st * gw,
+    char * line,
+    const char * path,
+    int lineno)
+{
+    char * save = NULL;
+    char * comment = strchr(line, '#');
+    if(comment) *comment = '\0';
+
+    char * kind = strtok_r(line, " \t\r\n", &save);
+    if(!kind) return 0;     // blank line
+
+    if(strcmp(kind, "emitter") == 0) {
+        int index;
+        char * indexstr = strtok_r(NULL, " \t\r\n", &save);
+        char * lircd = strtok_r(NULL, " \t\r\n", &save);
+        char * conf = NULL;
+        if(!indexstr || gateway_parse_int(indexstr, 0,
+            GATEWAY_EMITTERS_MAX - 1, &index)) {
+            syslog(LOG_ERR, "%s:%d: bad emitter index", path, lineno);
+            return -EINVAL;
+        }
+        if((size_t)index != gw->nemitters) {
+            syslog(LOG_ERR, "%s:%d: emitters must be declared in order",
+                path, lineno);
+            return -EINVAL;
+        }
+        if(lircd && strcmp(lircd, "wave") == 0) {
+            conf = strtok_r(NULL, " \t\r\n", &save);
+            lircd = NULL;
+            if(!conf || strlen(conf) >= GATEWAY_PATH_SIZE) {
+                syslog(LOG_ERR, "%s:%d: bad lircd.conf path", path, lineno);
+                return -EINVAL;
+            }
+            strcpy(gw->emitters[index].wave, conf);
+        }
+        if(lircd && strlen(lircd) >= GATEWAY_PATH_SIZE) {
+            syslog(LOG_ERR, "%s:%d: lircd path is too long", path, lineno);
+            return -EINVAL;
+        }
+        if(lircd) strcpy(gw->emitters[index].lircd, lircd);
+        gw->nemitters++;
+        return 0;
+    }
+
+    if(strcmp(kind, "unit") == 0) {
+        if(gw->nunits >= GATEWAY_UNITS_MAX) {
+            syslog(LOG_ERR, "%s:%d: too many units, the most is %d",
+                path, lineno, GATEWAY_UNITS_MAX);
+            return -ENOSPC;
+        }
+        struct gateway_unit_st * u = &gw->units[gw->nunits];
+        char * name = strtok_r(NULL, " \t\r\n", &save);
+        if(!name || !gateway_name_valid(name)) {
+            syslog(LOG_ERR, "%s:%d: bad unit name", path, lineno);
+            return -EINVAL;
+        }
+        strcpy(u->name, name);
+        u->debounce_ms = -1;
+        u->heartbeat_s = -1;
+        u->deadline_ms = -1;
+        u->settle_ms = -1;
+        u->interval_ms = -1;
+
+        char * key, * val;
+        int v;
+        while((key = strtok_r(NULL, " \t\r\n", &save))) {
+            val = strtok_r(NULL, " \t\r\n", &save);
+            if(!val) {
+                syslog(LOG_ERR, "%s:%d: %s needs a value", path, lineno, key);
+                return -EINVAL;
+            }
+            if(strcmp(key, "port") == 0 && !gateway_parse_int(val, 1, 65535, &v))
+                u->port = v;
+            else if(strcmp(key, "emitter") == 0 &&
+                !gateway_parse_int(val, 0, GATEWAY_EMITTERS_MAX - 1, &v))
+                u->emitter = v;
+            else if(strcmp(key, "transmitter") == 0 &&
+                !gateway_parse_int(val, 1, 32, &v))
+                u->transmitter = v;
+            else if(strcmp(key, "debounce") == 0 &&
+                !gateway_parse_int(val, 0, 60000, &v))
+                u->debounce_ms = v;
+            else if(strcmp(key, "heartbeat") == 0 &&
+                !gateway_parse_int(val, 1, 86400, &v))
+                u->heartbeat_s = v;
+            else if(strcmp(key, "deadline") == 0 &&
+                !gateway_parse_int(val, 1, 60000, &v))
+                u->deadline_ms = v;
+            else if(strcmp(key, "settle") == 0 &&
+                !gateway_parse_int(val, 0, 10000, &v))
+                u->settle_ms = v;
+            else if(strcmp(key, "interval") == 0 &&
+                !gateway_parse_int(val, 0, 10000, &v))
+                u->interval_ms = v;
+            else {
+                syslog(LOG_ERR, "%s:%d: bad %s '%s'", path, lineno, key, val);
+                return -EINVAL;
+            }
+        }
+        if(u->port == 0) {
+            syslog(LOG_ERR, "%s:%d: unit %s has no port", path, lineno, name);
+            return -EINVAL;
+        }
+        for(size_t i=0; i<gw->nunits; i++) {
+            if(strcmp(gw->units[i].name, u->name) == 0 ||
+                gw->units[i].port == u->port) {
+                syslog(LOG_ERR, "%s:%d: unit %s clashes with unit %s",
+                    path, lineno, name, gw->units[i].name);
+                return -EINVAL;
+            }
+        }
+        gw->nunits++;
+        return 0;
+    }
+
+    if(strcmp(kind, "simulator") == 0) {
+        #ifndef _DESKTOP_BUILD_
+        syslog(LOG_ERR, "%s:%d: the simulator needs a desktop build", 
+            path, lineno);
+        return -ENOTSUP;
+        #else
+        struct acsim_config_st * c = &gw->simconfig;
+        char * key, * val;
+        int v;
+        acsim_config_default(c);
+        while((key = strtok_r(NULL, " \t\r\n", &save))) {
+            val = strtok_r(NULL, " \t\r\n", &save);
+            if(!val) {
+                syslog(LOG_ERR, "%s:%d: %s needs a value", path, lineno, key);
+                return -EINVAL;
+            }
+            if(strcmp(key, "latency") == 0 && 
+                !gateway_parse_int(val, 0, 60000, &v))
+                c->latency_ms = v;
+            else if(strcmp(key, "drop") == 0 && 
+                !gateway_parse_int(val, 0, 100, &v))
+                c->drop_percent = v;
+            else if(strcmp(key, "frame") == 0 && 
+                !gateway_parse_int(val, 1, 10000, &v))
+                c->frame_ms = v;
+            else if(strcmp(key, "room") == 0 && 
+                !gateway_parse_int(val, 0, 99, &v))
+                c->room = v;
+            else if(strcmp(key, "seed") == 0 && 
+                !gateway_parse_int(val, 0, 0x7FFFFFFF, &v))
+                c->seed = v;
+            else {
+                syslog(LOG_ERR, "%s:%d: bad %s '%s'", path, lineno, key, val);
+                return -EINVAL;
+            }
+        }
+        gw->simulate = true;
+        return 0;
+        #endif
+    }
+
+    syslog(LOG_ERR, "%s:%d: unknown declaration '%s'", path, lineno, kind);
+    return -EINVAL;
+}
+
+static int gateway_parse_int(const char * s, int min, int max, int * val)
+{
+    char * end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if(errno || *end != '\0' || v < min || v > max) return -EINVAL;
+    *val = v;
+    return 0;
+}
+
+/* Names end up in MQTT topics, so keep them to a safe set of characters. */
+static bool gateway_name_valid(const char * name)
+{
+    size_t n = strlen(name);
+    if(n == 0 || n >= GATEWAY_NAME_SIZE) return false;
+    for(size_t i=0; i<n; i++) {
+        if(!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_')
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,160 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include "accpanel.h"
+#include "history.h"
+
+static size_t history_varint(uint8_t * buf, uint64_t v);
+static uint8_t history_diff(
+    const struct history_sample_st * a,
+    const struct history_sample_st * b);
+static uint64_t history_grid(const struct history_st * h, uint64_t now);
+
+int history_initialize(struct history_st * h)
+{
+    if(!h) return -EINVAL;
+    h = memset(h, 0, sizeof(*h));
+    h->sample_ms = HISTORY_SAMPLE_MS;
+    h->batch_s = HISTORY_BATCH_S;
+    return 0;
+}
+
+uint64_t history_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool history_sample(
+    struct history_st * h,
+    const struct panel_st * panel,
+    uint64_t now)
+{
+    if(h->nextsample == 0) h->nextsample = now;
+    if(h->nextbatch == 0) h->nextbatch = now + h->batch_s * 1000;
+    if(now < h->nextsample) return false;
+
+    if(h->nsamples >= HISTORY_SAMPLES_MAX) {
+        h->dropped++;
+    }
+    else {
+        struct history_sample_st * s = &h->samples[h->nsamples++];
+        s->timestamp = h->nextsample;
+        s->fan = panel->fan;
+        s->mode = panel->mode;
+        s->delay = panel->delay;
+        s->temperature = panel->temperature;
+        s->filterbad = panel->filterbad;
+    }
+    h->nextsample = history_grid(h, now);
+    return true;
+}
+
+void history_skip(struct history_st * h, uint64_t now)
+{
+    if(h->nextsample && now >= h->nextsample)
+        h->nextsample = history_grid(h, now);
+}
+
+size_t history_batch(struct history_st * h, uint64_t now)
+{
+    size_t n;
+    if(h->nsamples == 0 || now < h->nextbatch) return 0;
+    n = history_encode(h->samples, h->nsamples, h->buffer, sizeof(h->buffer));
+    h->nsamples = 0;
+    h->nextbatch = now + h->batch_s * 1000;
+    return n;
+}
+
+size_t history_encode(
+    const struct history_sample_st * samples,
+    size_t n,
+    uint8_t * buf,
+    size_t size)
+{
+    size_t o = 0, i, j;
+    uint8_t mask;
+    uint64_t delta;
+
+    if(n == 0 || n > UINT16_MAX) return 0;
+    if(size < HISTORY_HEADER_SIZE + n * HISTORY_RECORD_MAX) return 0;
+
+    buf[o++] = HISTORY_VERSION;
+    buf[o++] = 0;
+    buf[o++] = n & 0xFF;
+    buf[o++] = n >> 8;
+    for(i=0; i<8; i++) buf[o++] = (samples[0].timestamp >> (8*i)) & 0xFF;
+
+    for(i=0; i<n; ) {
+        const struct history_sample_st * s = &samples[i];
+        if(i == 0) {
+            mask = PANEL_FIELD_ALL;
+            delta = 0;
+        }
+        else {
+            mask = history_diff(&samples[i-1], s);
+            delta = s->timestamp - samples[i-1].timestamp;
+        }
+
+        if(mask == 0) {
+            // Count how many unchanged samples follow at the same interval.
+            for(j=i+1; j<n; j++) {
+                if(history_diff(&samples[j-1], &samples[j]) ||
+                    samples[j].timestamp - samples[j-1].timestamp != delta)
+                    break;
+            }
+            if(j - i > 1) {
+                buf[o++] = HISTORY_TAG_RUN;
+                o += history_varint(&buf[o], delta);
+                o += history_varint(&buf[o], j - i);
+                i = j;
+                continue;
+            }
+        }
+
+        buf[o++] = mask;
+        o += history_varint(&buf[o], delta);
+        if(mask & PANEL_FIELD_FAN)          buf[o++] = s->fan;
+        if(mask & PANEL_FIELD_MODE)         buf[o++] = s->mode;
+        if(mask & PANEL_FIELD_DELAY)        buf[o++] = s->delay;
+        if(mask & PANEL_FIELD_TEMPERATURE)  buf[o++] = (uint8_t)s->temperature;
+        if(mask & PANEL_FIELD_FILTERBAD)    buf[o++] = s->filterbad;
+        i++;
+    }
+    return o;
+}
+
+static size_t history_varint(uint8_t * buf, uint64_t v)
+{
+    size_t n = 0;
+    do {
+        buf[n] = v & 0x7F;
+        v >>= 7;
+        if(v) buf[n] |= 0x80;
+        n++;
+    } while(v);
+    return n;
+}
+
+static uint8_t history_diff(
+    const struct history_sample_st * a,
+    const struct history_sample_st * b)
+{
+    uint8_t mask = 0;
+    if(a->fan != b->fan)                    mask |= PANEL_FIELD_FAN;
+    if(a->mode != b->mode)                  mask |= PANEL_FIELD_MODE;
+    if(a->delay != b->delay)                mask |= PANEL_FIELD_DELAY;
+    if(a->temperature != b->temperature)    mask |= PANEL_FIELD_TEMPERATURE;
+    if(a->filterbad != b->filterbad)        mask |= PANEL_FIELD_FILTERBAD;
+    return mask;
+}
+
+/* The first point of the sampling grid after @param now. */
+static uint64_t history_grid(const struct history_st * h, uint64_t now)
+{
+    uint64_t behind = now - h->nextsample;
+    return h->nextsample + (behind / h->sample_ms + 1) * h->sample_ms;
+}
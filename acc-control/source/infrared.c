@@ -1,13 +1,23 @@
 #include <string.h>
+#include <stdlib.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
 #ifndef _DESKTOP_BUILD_
+#include <unistd.h>
 #include <lirc_client.h>
 #else
 #include <stdio.h>
 #endif
 #include "infrared.h"
+#include "irwave.h"
 #include "gpio.h"
+#include "acsim.h"
+
+static int infrared_send_wave(struct infra_st * infra, enum InfraCodes code);
+#ifdef _DESKTOP_BUILD_
+static void infrared_simulate(struct infra_st * infra, enum InfraCodes code);
+#endif
 
 /* Default device for the infra_dev_st class. This matches what we need
  * for the project. These came from `GE-AHP05LZQ2.lircd.conf`.
@@ -26,19 +36,23 @@ static struct infra_dev_st infra_default_dev = {
     }
 };
 
-int infrared_initialize(struct infra_st * infra, struct GPIO * gpio)
+int infrared_initialize(
+    struct infra_st * infra, 
+    struct GPIO * gpio, 
+    const char * lircd)
 {
     if(!infra || !gpio) return -EINVAL;
 
     infra = memset(infra, 0, sizeof(*infra));
 
     #ifndef _DESKTOP_BUILD_
-    infra->_fd = lirc_get_local_socket(NULL, 0);
+    infra->_fd = lirc_get_local_socket(lircd, 0);
     if(infra->_fd < 0) {
         syslog(LOG_ERR, "Failed to open LIRC interface.");
         return infra->_fd;
     }
     #else
+    (void)lircd;
     infra->_fd = 1;
     infra->dev = NULL;
     #endif
@@ -50,10 +64,50 @@ int infrared_initialize(struct infra_st * infra, struct GPIO * gpio)
     return 0;
 }
 
+int infrared_initialize_wave(
+    struct infra_st * infra, 
+    struct GPIO * gpio, 
+    const char * conf)
+{
+    int r;
+    if(!infra || !gpio || !conf) return -EINVAL;
+
+    infra = memset(infra, 0, sizeof(*infra));
+    infra->_fd = -1;
+    infra->dev = &infra_default_dev;
+    infra->gpio = gpio;
+
+    infra->wave = malloc(sizeof(struct irwave_st));
+    if(!infra->wave) return -errno;
+    r = irwave_initialize(infra->wave, gpio->_fd, _GPIO_H_LED_IR, conf);
+    if(r) {
+        free(infra->wave);
+        infra->wave = NULL;
+        return r;
+    }
+    // Better now than at the first press that needs it
+    for(int c = infra_power; c <= infra_eco; c++) {
+        if(irwave_key(infra->wave, infra->dev->InfraStrings[c])) continue;
+        syslog(LOG_ERR, "%s has no %s", conf, infra->dev->InfraStrings[c]);
+        infrared_finalize(infra);
+        return -EINVAL;
+    }
+    // The LED is the waveform's, so it is not turned on like with lircd.
+    return 0;
+}
+
 int infrared_finalize(struct infra_st * infra)
 {
     int r = 0;
 
+    if(infra->wave) {
+        irwave_finalize(infra->wave);
+        free(infra->wave);
+        infra->wave = NULL;
+        infra->dev = NULL;
+        return 0;
+    }
+
     #ifndef _DESKTOP_BUILD_
     r = close(infra->_fd);
     if(r) return r;
@@ -70,16 +124,140 @@ int infrared_send(struct infra_st * infra, enum InfraCodes code)
 {
     int r = 0;
     if(!infra) return -EINVAL;
+    if(infra->wave) return infrared_send_wave(infra, code);
     infra->dev->code = code;
     #ifndef _DESKTOP_BUILD_
     r = lirc_send_one(  infra->_fd, 
                         infra->dev->InfraRemote,
                         infra->dev->InfraStrings[infra->dev->code]);
     #else
-    printf("infrared_send code %s\n", infra->dev->InfraStrings[infra->dev->code]);
+    if(infra->nsims == 0)
+        printf("infrared_send code %s\n", infra->dev->InfraStrings[infra->dev->code]);
+    infrared_simulate(infra, code);
     #endif
 
     GPIO_set_InfraLED(infra->gpio, ir_on);
 
     return r;
 }
+
+int infrared_send_burst(
+    struct infra_st * infra, 
+    const enum InfraCodes * codes, 
+    size_t n,
+    long interval_ms,
+    infrared_stop_fn stop,
+    void * arg)
+{
+    int r = 0;
+    size_t sent;
+    struct timespec next;
+
+    if(!infra || (!codes && n) || interval_ms < 0) return -EINVAL;
+    if(n > INFRARED_BURST_MAX) return -E2BIG;
+
+    #ifndef _DESKTOP_BUILD_
+    if(infra->wave) {
+        const struct irwave_key_st * keys[INFRARED_BURST_MAX];
+        for(size_t i=0; i<n; i++) {
+            keys[i] = irwave_key(infra->wave, infra->dev->InfraStrings[codes[i]]);
+            if(!keys[i]) return -EINVAL;
+        }
+        return irwave_burst(infra->wave, keys, n, interval_ms * 1000, 
+            stop, arg);
+    }
+    #endif
+
+    // lircd can only take one key at a time (and desktop builds hand them to
+    // the simulators one at a time).
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for(sent = 0; sent < n; sent++) {
+        if(sent && stop && stop(arg)) break;
+        if(sent && interval_ms) {
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+                == EINTR);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        next.tv_sec += interval_ms / 1000;
+        next.tv_nsec += (interval_ms % 1000) * 1000000;
+        if(next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        r = infrared_send(infra, codes[sent]);
+        if(r) break;
+    }
+    if(sent == 0 && r) return -EIO;
+    return sent;
+}
+
+int infrared_transmitter_set(struct infra_st * infra, int transmitter)
+{
+    int r = 0;
+    if(!infra || transmitter < 1) return -EINVAL;
+    #ifndef _DESKTOP_BUILD_
+    if(infra->wave) return (transmitter == 1)? 0 : -ENOTSUP;
+    lirc_cmd_ctx ctx;
+    r = lirc_command_init(&ctx, "SET_TRANSMITTERS %d\n", transmitter);
+    if(r) return -r;
+    r = lirc_command_run(&ctx, infra->_fd);
+    if(r) syslog(LOG_ERR, "Failed to set LIRC transmitter %d", transmitter);
+    #else
+    if(infra->nsims == 0)
+        printf("infrared_transmitter_set %d\n", transmitter);
+    infra->transmitter = transmitter;
+    #endif
+    return r;
+}
+
+int infrared_simulator_add(
+    struct infra_st * infra, 
+    struct acsim_st * sim, 
+    int transmitter)
+{
+    #ifdef _DESKTOP_BUILD_
+    if(!infra || !sim) return -EINVAL;
+    if(infra->nsims >= INFRARED_SIMULATORS_MAX) return -ENOSPC;
+    infra->sims[infra->nsims] = sim;
+    infra->simtransmitters[infra->nsims] = transmitter;
+    infra->nsims++;
+    return 0;
+    #else
+    (void)infra;
+    (void)sim;
+    (void)transmitter;
+    return -ENOTSUP;
+    #endif
+}
+
+static int infrared_send_wave(struct infra_st * infra, enum InfraCodes code)
+{
+    int r;
+    const char * name = infra->dev->InfraStrings[code];
+    const struct irwave_key_st * key = irwave_key(infra->wave, name);
+    if(!key) return -EINVAL;
+
+    infra->dev->code = code;
+    r = irwave_send(infra->wave, key);
+    #ifdef _DESKTOP_BUILD_
+    if(infra->nsims == 0) {
+        char timings[IRWAVE_TIMINGS_MAX * 7];
+        irwave_format(key, timings, sizeof(timings));
+        printf("infrared_send wave %s %s\n", name, timings);
+    }
+    infrared_simulate(infra, code);
+    #endif
+    return r;
+}
+
+#ifdef _DESKTOP_BUILD_
+static void infrared_simulate(struct infra_st * infra, enum InfraCodes code)
+{
+    // IR is a broadcast: every unit that can see the transmitter gets it.
+    for(size_t i=0; i<infra->nsims; i++) {
+        if(!infra->transmitter || !infra->simtransmitters[i] ||
+            infra->transmitter == infra->simtransmitters[i])
+            acsim_press(infra->sims[i], code);
+    }
+}
+#endif
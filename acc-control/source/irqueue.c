@@ -0,0 +1,290 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include "infrared.h"
+#include "trace.h"
+#include "irqueue.h"
+
+/* What irqueue_stopped needs to know */
+struct irqueue_burst_st {
+    struct irqueue_st * queue;
+    struct irqueue_client_st * client;
+};
+
+static struct irqueue_client_st * irqueue_next(struct irqueue_st * queue);
+static bool irqueue_alone(
+    struct irqueue_st * queue, 
+    struct irqueue_client_st * client);
+static bool irqueue_stopped(void * arg);
+static void irqueue_trace(
+    struct trace_st * trace,
+    const struct timespec * start,
+    const struct timespec * end,
+    int presses);
+
+int irqueue_initialize(struct irqueue_st * queue)
+{
+    if(!queue) return -EINVAL;
+    queue = memset(queue, 0, sizeof(*queue));
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->work, NULL);
+    queue->run = true;
+    return 0;
+}
+
+int irqueue_finalize(struct irqueue_st * queue)
+{
+    if(!queue) return -EINVAL;
+    irqueue_stop(queue);
+    for(size_t i=0; i<queue->nclients; i++) {
+        pthread_cond_destroy(&queue->clients[i]->done);
+    }
+    pthread_cond_destroy(&queue->work);
+    pthread_mutex_destroy(&queue->mutex);
+    return 0;
+}
+
+int irqueue_emitter_add(struct irqueue_st * queue, struct infra_st * infra)
+{
+    int r;
+    if(!queue || !infra) return -EINVAL;
+    pthread_mutex_lock(&queue->mutex);
+    if(queue->nemitters >= IRQUEUE_EMITTERS_MAX) {
+        r = -ENOSPC;
+    }
+    else {
+        r = queue->nemitters++;
+        queue->emitters[r] = infra;
+        queue->transmitters[r] = 0;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return r;
+}
+
+int irqueue_client_initialize(
+    struct irqueue_st * queue,
+    struct irqueue_client_st * client,
+    unsigned int emitter,
+    int transmitter)
+{
+    int r = 0;
+    if(!queue || !client) return -EINVAL;
+
+    client = memset(client, 0, sizeof(*client));
+    client->queue = queue;
+    client->emitter = emitter;
+    client->transmitter = transmitter;
+    client->interval_ms = IRQUEUE_INTERVAL_MS;
+    pthread_cond_init(&client->done, NULL);
+
+    pthread_mutex_lock(&queue->mutex);
+    if(emitter >= queue->nemitters) {
+        r = -ENODEV;
+    }
+    else if(queue->nclients >= IRQUEUE_CLIENTS_MAX) {
+        r = -ENOSPC;
+    }
+    else {
+        queue->clients[queue->nclients++] = client;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    if(r) pthread_cond_destroy(&client->done);
+    return r;
+}
+
+unsigned long irqueue_ticket(struct irqueue_client_st * client)
+{
+    unsigned long ticket;
+    pthread_mutex_lock(&client->queue->mutex);
+    ticket = client->cancels;
+    pthread_mutex_unlock(&client->queue->mutex);
+    return ticket;
+}
+
+int irqueue_send(
+    struct irqueue_client_st * client,
+    const enum InfraCodes * codes,
+    size_t n,
+    unsigned long ticket)
+{
+    int r;
+    if(!client || !client->queue || (!codes && n)) return -EINVAL;
+    if(n > IRQUEUE_BURST_MAX) return -E2BIG;
+    if(n == 0) return 0;
+
+    struct irqueue_st * q = client->queue;
+    pthread_mutex_lock(&q->mutex);
+    if(!q->run) {
+        pthread_mutex_unlock(&q->mutex);
+        return -ESHUTDOWN;
+    }
+    memcpy(client->burst, codes, n * sizeof(*codes));
+    client->length = n;
+    client->sent = 0;
+    client->pending = true;
+    client->ticket = ticket;
+    pthread_cond_signal(&q->work);
+    while(client->pending) {
+        pthread_cond_wait(&client->done, &q->mutex);
+    }
+    r = client->sent;
+    pthread_mutex_unlock(&q->mutex);
+    return r;
+}
+
+void *irqueue_run(void *args)
+{
+    int r;
+    struct irqueue_st * q = args;
+    struct irqueue_client_st * c;
+    struct infra_st * infra;
+    enum InfraCodes codes[IRQUEUE_BURST_MAX];
+    size_t n;
+    int transmitter;
+    long interval_ms;
+    unsigned int emitter;
+    struct trace_st * trace;
+    struct timespec start, end;
+    struct irqueue_burst_st burst = { .queue = q };
+
+    if(!q) return NULL;
+
+    pthread_mutex_lock(&q->mutex);
+    while(q->run) {
+        c = irqueue_next(q);
+        if(!c) {
+            pthread_cond_wait(&q->work, &q->mutex);
+            continue;
+        }
+        if(c->cancels != c->ticket) {
+            c->pending = false;
+            pthread_cond_broadcast(&c->done);
+            continue;
+        }
+        emitter = c->emitter;
+        infra = q->emitters[emitter];
+        transmitter = c->transmitter;
+        interval_ms = c->interval_ms;
+        trace = c->trace;
+        // The rest of the burst in one go, unless the units have to take
+        // turns. irqueue_stopped ends it early if that changes.
+        n = irqueue_alone(q, c)? c->length - c->sent : 1;
+        memcpy(codes, c->burst + c->sent, n * sizeof(*codes));
+        burst.client = c;
+        pthread_mutex_unlock(&q->mutex);
+
+        // Only this thread touches `transmitters`, so no lock is needed.
+        if(transmitter && transmitter != q->transmitters[emitter]) {
+            r = infrared_transmitter_set(infra, transmitter);
+            q->transmitters[emitter] = r? 0 : transmitter;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        r = infrared_send_burst(infra, codes, n, interval_ms, 
+            irqueue_stopped, &burst);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if(r > 0 && trace) irqueue_trace(trace, &start, &end, r);
+
+        pthread_mutex_lock(&q->mutex);
+        if(r < 0) {
+            syslog(LOG_ERR, "Failed to send IR press, dropping the burst");
+        }
+        else {
+            c->sent += r;
+        }
+        if(r < 0 || c->sent >= c->length) {
+            c->pending = false;
+            pthread_cond_broadcast(&c->done);
+        }
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
+
+void irqueue_cancel(struct irqueue_client_st * client)
+{
+    if(!client || !client->queue) return;
+    pthread_mutex_lock(&client->queue->mutex);
+    client->cancels++;
+    pthread_mutex_unlock(&client->queue->mutex);
+}
+
+void irqueue_stop(struct irqueue_st * queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->run = false;
+    // Nobody will send these now. Release whoever is waiting on them.
+    for(size_t i=0; i<queue->nclients; i++) {
+        queue->clients[i]->pending = false;
+        pthread_cond_broadcast(&queue->clients[i]->done);
+    }
+    pthread_cond_broadcast(&queue->work);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/* Round-robin over the clients with presses left. Must hold the mutex. */
+static struct irqueue_client_st * irqueue_next(struct irqueue_st * queue)
+{
+    for(size_t i=0; i<queue->nclients; i++) {
+        size_t k = (queue->next + i) % queue->nclients;
+        if(queue->clients[k]->pending) {
+            queue->next = (k + 1) % queue->nclients;
+            return queue->clients[k];
+        }
+    }
+    return NULL;
+}
+
+/* @returns true if no other client than @param client has presses left.
+ * Must hold the mutex.
+ */
+static bool irqueue_alone(
+    struct irqueue_st * queue, 
+    struct irqueue_client_st * client)
+{
+    for(size_t i=0; i<queue->nclients; i++) {
+        if(queue->clients[i] != client && queue->clients[i]->pending) 
+            return false;
+    }
+    return true;
+}
+
+/* Between the presses of a burst: stop if it was cancelled, the queue is
+ * stopping, or another unit is waiting for its turn.
+ */
+static bool irqueue_stopped(void * arg)
+{
+    struct irqueue_burst_st * burst = arg;
+    struct irqueue_st * q = burst->queue;
+    bool stop;
+    pthread_mutex_lock(&q->mutex);
+    stop = burst->client->cancels != burst->client->ticket || !q->run || 
+        !irqueue_alone(q, burst->client);
+    pthread_mutex_unlock(&q->mutex);
+    return stop;
+}
+
+/* A burst of @param presses went out from @param start to @param end. They
+ * are evenly spaced, so each one gets its share.
+ */
+static void irqueue_trace(
+    struct trace_st * trace,
+    const struct timespec * start,
+    const struct timespec * end,
+    int presses)
+{
+    int64_t total = (int64_t)(end->tv_sec - start->tv_sec) * 1000000000 +
+        (end->tv_nsec - start->tv_nsec);
+    struct timespec from = *start, to;
+    for(int i=1; i<=presses; i++) {
+        int64_t at = start->tv_nsec + total * i / presses;
+        to.tv_sec = start->tv_sec + at / 1000000000;
+        to.tv_nsec = at % 1000000000;
+        trace_press(trace, &from, &to);
+        from = to;
+    }
+}
@@ -0,0 +1,647 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef _DESKTOP_BUILD_
+#include <pigpiod_if2.h>
+#endif
+#include "irwave.h"
+
+#define IRWAVE_LINE_SIZE    (256)
+#define IRWAVE_FREQUENCY    (38000)     /* lircd's defaults */
+#define IRWAVE_DUTY_CYCLE   (50)
+
+enum irwave_section {
+    IRWAVE_OUTSIDE,
+    IRWAVE_REMOTE,
+    IRWAVE_CODES,
+    IRWAVE_DONE
+};
+
+static int irwave_parse(struct irwave_st * wave, FILE * f, const char * path);
+static int irwave_parse_remote(
+    struct irwave_remote_st * remote,
+    const char * key,
+    char * value,
+    const char * second);
+static int irwave_parse_number(const char * s, uint64_t * val);
+static int irwave_compile(
+    const struct irwave_remote_st * remote,
+    unsigned int gpio,
+    struct irwave_key_st * key);
+static void irwave_bits(
+    const struct irwave_remote_st * remote,
+    struct irwave_key_st * key,
+    uint64_t data,
+    int bits);
+static int irwave_carrier(
+    const struct irwave_remote_st * remote,
+    unsigned int gpio,
+    struct irwave_key_st * key);
+static uint32_t irwave_period(
+    const struct irwave_key_st * key, 
+    uint32_t interval_us);
+static int irwave_chain(
+    struct irwave_st * wave,
+    const struct irwave_key_st * const * keys,
+    size_t n,
+    uint32_t interval_us,
+    irwave_stop_fn stop,
+    void * arg,
+    bool * stopped);
+#ifndef _DESKTOP_BUILD_
+static size_t irwave_waveforms(
+    struct irwave_st * wave,
+    const struct irwave_key_st * const * keys,
+    size_t n);
+static int irwave_waveform(
+    struct irwave_st * wave, 
+    const struct irwave_key_st * key);
+static void irwave_sleep_until(const struct timespec * start, uint64_t us);
+#endif
+
+int irwave_initialize(
+    struct irwave_st * wave,
+    int pi,
+    unsigned int gpio,
+    const char * path)
+{
+    int r;
+    FILE * f;
+
+    if(!wave || !path || gpio > 31) return -EINVAL;
+    wave = memset(wave, 0, sizeof(*wave));
+    wave->pi = pi;
+    wave->gpio = gpio;
+    for(size_t i=0; i<IRWAVE_KEYS_MAX; i++) wave->waveids[i] = -1;
+    wave->remote.frequency = IRWAVE_FREQUENCY;
+    wave->remote.duty_cycle = IRWAVE_DUTY_CYCLE;
+
+    f = fopen(path, "r");
+    if(!f) {
+        r = -errno;
+        syslog(LOG_ERR, "Can't open %s: %s", path, strerror(errno));
+        return r;
+    }
+    r = irwave_parse(wave, f, path);
+    fclose(f);
+    if(r) return r;
+
+    if(!(wave->remote.flags & IRWAVE_FLAG_SPACE_ENC)) {
+        syslog(LOG_ERR, "%s: only SPACE_ENC remotes are supported", path);
+        return -ENOTSUP;
+    }
+    if(wave->remote.bits < 1 || !wave->remote.one[0] || !wave->remote.zero[0]
+        || wave->remote.duty_cycle < 1 || wave->remote.duty_cycle > 100) {
+        syslog(LOG_ERR, "%s: remote %s is incomplete", path, wave->remote.name);
+        return -EINVAL;
+    }
+
+    for(size_t i=0; i<wave->nkeys; i++) {
+        r = irwave_compile(&wave->remote, gpio, &wave->keys[i]);
+        if(r) {
+            irwave_finalize(wave);
+            return r;
+        }
+    }
+
+    #ifndef _DESKTOP_BUILD_
+    r = set_mode(pi, gpio, PI_OUTPUT);
+    if(r == 0) r = gpio_write(pi, gpio, PI_LOW);
+    if(r) {
+        syslog(LOG_ERR, "Got %s setting up GPIO %u for infrared",
+            pigpio_error(r), gpio);
+        irwave_finalize(wave);
+        return -EIO;
+    }
+    #endif
+
+    syslog(LOG_INFO, "Loaded %zu keys of remote %s from %s",
+        wave->nkeys, wave->remote.name, path);
+    return 0;
+}
+
+int irwave_finalize(struct irwave_st * wave)
+{
+    if(!wave) return -EINVAL;
+    for(size_t i=0; i<IRWAVE_KEYS_MAX; i++) {
+        #ifndef _DESKTOP_BUILD_
+        if(wave->waveids[i] >= 0) wave_delete(wave->pi, wave->waveids[i]);
+        #endif
+        wave->waveids[i] = -1;
+    }
+    #ifndef _DESKTOP_BUILD_
+    gpio_write(wave->pi, wave->gpio, PI_LOW);
+    #endif
+    for(size_t i=0; i<wave->nkeys; i++) {
+        free(wave->keys[i].pulses);
+        wave->keys[i].pulses = NULL;
+        wave->keys[i].npulses = 0;
+    }
+    return 0;
+}
+
+const struct irwave_key_st * irwave_key(
+    const struct irwave_st * wave,
+    const char * name)
+{
+    if(!wave || !name) return NULL;
+    for(size_t i=0; i<wave->nkeys; i++) {
+        if(strcmp(wave->keys[i].name, name) == 0) return &wave->keys[i];
+    }
+    return NULL;
+}
+
+int irwave_send(struct irwave_st * wave, const struct irwave_key_st * key)
+{
+    int r = irwave_burst(wave, &key, 1, 0, NULL, NULL);
+    return (r < 0)? r : 0;
+}
+
+int irwave_burst(
+    struct irwave_st * wave,
+    const struct irwave_key_st * const * keys,
+    size_t n,
+    uint32_t interval_us,
+    irwave_stop_fn stop,
+    void * arg)
+{
+    struct timespec start, end;
+    size_t sent = 0;
+    bool stopped = false;
+    int r;
+
+    if(!wave || (!keys && n)) return -EINVAL;
+    for(size_t i=0; i<n; i++) {
+        if(keys[i] < wave->keys || keys[i] >= wave->keys + wave->nkeys) 
+            return -EINVAL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // More than one chain only if the burst doesn't fit in IRWAVE_CHAIN_MAX
+    while(sent < n && !stopped) {
+        if(sent && stop && stop(arg)) break;
+        r = irwave_chain(wave, keys + sent, n - sent, interval_us, 
+            stop, arg, &stopped);
+        if(r < 0) {
+            if(sent) break;
+            return r;
+        }
+        sent += r;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    wave->presses += sent;
+    wave->last_us = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000 +
+        (end.tv_nsec - start.tv_nsec) / 1000;
+    #ifdef _DESKTOP_BUILD_
+    wave->last_us = 0;      // what the LED would have taken
+    for(size_t i=0; i<sent; i++) 
+        wave->last_us += irwave_period(keys[i], interval_us);
+    #endif
+    return sent;
+}
+
+int irwave_format(const struct irwave_key_st * key, char * buf, size_t size)
+{
+    int n = 0, r;
+    if(!key || (!buf && size)) return -EINVAL;
+    if(size) buf[0] = '\0';
+    for(size_t i=0; i<key->ntimings; i++) {
+        bool fits = (size_t)n < size;
+        r = snprintf(fits? buf + n : NULL, fits? size - n : 0,
+            i? " %u" : "%u", key->timings[i]);
+        if(r < 0) return r;
+        n += r;
+    }
+    return n;
+}
+
+static int irwave_parse(struct irwave_st * wave, FILE * f, const char * path)
+{
+    char line[IRWAVE_LINE_SIZE];
+    enum irwave_section section = IRWAVE_OUTSIDE;
+    int lineno = 0, errors = 0;
+
+    while(section != IRWAVE_DONE && fgets(line, sizeof(line), f)) {
+        char * save = NULL;
+        char * comment = strchr(line, '#');
+        lineno++;
+        if(comment) *comment = '\0';
+
+        char * key = strtok_r(line, " \t\r\n", &save);
+        if(!key) continue;      // blank line
+        char * value = strtok_r(NULL, " \t\r\n", &save);
+        char * second = strtok_r(NULL, " \t\r\n", &save);
+
+        if(strcmp(key, "begin") == 0 || strcmp(key, "end") == 0) {
+            bool begin = key[0] == 'b';
+            if(value && strcmp(value, "remote") == 0 &&
+                section == (begin? IRWAVE_OUTSIDE : IRWAVE_REMOTE))
+                section = begin? IRWAVE_REMOTE : IRWAVE_DONE;
+            else if(value && strcmp(value, "codes") == 0 &&
+                section == (begin? IRWAVE_REMOTE : IRWAVE_CODES))
+                section = begin? IRWAVE_CODES : IRWAVE_REMOTE;
+            else {
+                syslog(LOG_ERR, "%s:%d: unexpected %s %s", path, lineno,
+                    key, value? value : "");
+                return -EINVAL;
+            }
+            continue;
+        }
+
+        if(section == IRWAVE_CODES) {
+            if(wave->nkeys >= IRWAVE_KEYS_MAX) {
+                syslog(LOG_ERR, "%s:%d: too many keys, the most is %d",
+                    path, lineno, IRWAVE_KEYS_MAX);
+                return -ENOSPC;
+            }
+            struct irwave_key_st * k = &wave->keys[wave->nkeys];
+            if(strlen(key) >= IRWAVE_NAME_SIZE || !value ||
+                irwave_parse_number(value, &k->code)) {
+                syslog(LOG_ERR, "%s:%d: bad code %s", path, lineno, key);
+                errors++;
+                continue;
+            }
+            strcpy(k->name, key);
+            wave->nkeys++;
+        }
+        else if(section == IRWAVE_REMOTE) {
+            int r = value? 
+                irwave_parse_remote(&wave->remote, key, value, second) :
+                -EINVAL;
+            if(r == -ENOTSUP)
+                syslog(LOG_ERR, "%s:%d: %s is not supported", path, lineno, key);
+            else if(r)
+                syslog(LOG_ERR, "%s:%d: bad %s", path, lineno, key);
+            if(r) errors++;
+        }
+        else {
+            syslog(LOG_ERR, "%s:%d: %s outside of a remote", path, lineno, key);
+            errors++;
+        }
+    }
+
+    if(section != IRWAVE_DONE) {
+        syslog(LOG_ERR, "%s: no complete remote", path);
+        errors++;
+    }
+    return errors? -EINVAL : 0;
+}
+
+/* Take the line `@param key @param value [@param second]` of the remote.
+ * @returns 0, -ENOTSUP for the parameters that change the signal and are
+ * not supported, or -EINVAL.
+ */
+static int irwave_parse_remote(
+    struct irwave_remote_st * remote,
+    const char * key,
+    char * value,
+    const char * second)
+{
+    uint64_t v[2] = {0, 0};
+    int n = 1;
+    char * save = NULL;
+
+    if(strcmp(key, "name") == 0) {
+        if(strlen(value) >= IRWAVE_NAME_SIZE) return -EINVAL;
+        strcpy(remote->name, value);
+        return 0;
+    }
+    if(strcmp(key, "flags") == 0) {
+        for(char * flag = strtok_r(value, "|", &save); flag;
+            flag = strtok_r(NULL, "|", &save)) {
+            if(strcmp(flag, "SPACE_ENC") == 0)
+                remote->flags |= IRWAVE_FLAG_SPACE_ENC;
+            else if(strcmp(flag, "CONST_LENGTH") == 0)
+                remote->flags |= IRWAVE_FLAG_CONST_LENGTH;
+            else return -ENOTSUP;
+        }
+        return 0;
+    }
+    // Only matter to receivers, or to keys held down
+    if(strcmp(key, "eps") == 0 || strcmp(key, "aeps") == 0 ||
+        strcmp(key, "repeat") == 0) return 0;
+
+    if(irwave_parse_number(value, &v[0])) return -EINVAL;
+    if(second) {
+        if(irwave_parse_number(second, &v[1])) return -EINVAL;
+        n = 2;
+    }
+
+    if(strcmp(key, "bits") == 0 && v[0] <= IRWAVE_BITS_MAX)
+        remote->bits = v[0];
+    else if(strcmp(key, "header") == 0 && n == 2) {
+        remote->header[0] = v[0];
+        remote->header[1] = v[1];
+    }
+    else if(strcmp(key, "one") == 0 && n == 2) {
+        remote->one[0] = v[0];
+        remote->one[1] = v[1];
+    }
+    else if(strcmp(key, "zero") == 0 && n == 2) {
+        remote->zero[0] = v[0];
+        remote->zero[1] = v[1];
+    }
+    else if(strcmp(key, "ptrail") == 0)
+        remote->ptrail = v[0];
+    else if(strcmp(key, "pre_data_bits") == 0 && v[0] <= IRWAVE_BITS_MAX)
+        remote->pre_data_bits = v[0];
+    else if(strcmp(key, "pre_data") == 0)
+        remote->pre_data = v[0];
+    else if(strcmp(key, "post_data_bits") == 0 && v[0] <= IRWAVE_BITS_MAX)
+        remote->post_data_bits = v[0];
+    else if(strcmp(key, "post_data") == 0)
+        remote->post_data = v[0];
+    else if(strcmp(key, "gap") == 0)
+        remote->gap = v[0];     // the longer one of two, if any, is ignored
+    else if(strcmp(key, "frequency") == 0 && v[0] > 0)
+        remote->frequency = v[0];
+    else if(strcmp(key, "duty_cycle") == 0)
+        remote->duty_cycle = v[0];
+    else if(strcmp(key, "bits") == 0 || strcmp(key, "pre_data_bits") == 0 ||
+        strcmp(key, "post_data_bits") == 0 || strcmp(key, "header") == 0 ||
+        strcmp(key, "one") == 0 || strcmp(key, "zero") == 0 ||
+        strcmp(key, "frequency") == 0)
+        return -EINVAL;
+    else
+        return -ENOTSUP;
+    return 0;
+}
+
+/* Decimal, or hexadecimal with 0x, like lircd. */
+static int irwave_parse_number(const char * s, uint64_t * val)
+{
+    char * end;
+    if(!s || !*s || *s == '-') return -EINVAL;
+    errno = 0;
+    *val = strtoull(s, &end, 0);
+    if(errno || *end) return -EINVAL;
+    return 0;
+}
+
+/* Work out the timings of @param key, and its pulses for pigpio. */
+static int irwave_compile(
+    const struct irwave_remote_st * remote,
+    unsigned int gpio,
+    struct irwave_key_st * key)
+{
+    uint32_t signal = 0;
+
+    key->ntimings = 0;
+    if(remote->header[0]) {
+        key->timings[key->ntimings++] = remote->header[0];
+        key->timings[key->ntimings++] = remote->header[1];
+    }
+    irwave_bits(remote, key, remote->pre_data, remote->pre_data_bits);
+    irwave_bits(remote, key, key->code, remote->bits);
+    irwave_bits(remote, key, remote->post_data, remote->post_data_bits);
+    // There must be a mark after the last space, or it would not end.
+    key->timings[key->ntimings++] = remote->ptrail?
+        remote->ptrail : remote->one[0];
+
+    for(size_t i=0; i<key->ntimings; i++) signal += key->timings[i];
+    if((remote->flags & IRWAVE_FLAG_CONST_LENGTH) && remote->gap > signal)
+        key->timings[key->ntimings++] = remote->gap - signal;
+    else
+        key->timings[key->ntimings++] = remote->gap;
+    key->length_us = signal + key->timings[key->ntimings - 1];
+
+    return irwave_carrier(remote, gpio, key);
+}
+
+static void irwave_bits(
+    const struct irwave_remote_st * remote,
+    struct irwave_key_st * key,
+    uint64_t data,
+    int bits)
+{
+    for(int b = bits - 1; b >= 0; b--) {
+        const uint32_t * t = ((data >> b) & 1)? remote->one : remote->zero;
+        key->timings[key->ntimings++] = t[0];
+        key->timings[key->ntimings++] = t[1];
+    }
+}
+
+/* Modulate the marks of @param key with the carrier. The cycles are rounded
+ * to whole microseconds as they go, not one by one, so that the carrier
+ * stays on frequency.
+ */
+static int irwave_carrier(
+    const struct irwave_remote_st * remote,
+    unsigned int gpio,
+    struct irwave_key_st * key)
+{
+    const uint64_t f = remote->frequency;
+    const uint32_t on = (remote->duty_cycle * 10000ULL + f / 2) / f;
+    const uint32_t mask = 1u << gpio;
+    size_t n = 0;
+
+    for(size_t i=0; i<key->ntimings; i++) {
+        if(i & 1) n++;
+        else n += 2 * ((key->timings[i] * f + 500000) / 1000000);
+    }
+    key->pulses = malloc(n * sizeof(*key->pulses));
+    if(!key->pulses) return -ENOMEM;
+
+    key->npulses = 0;
+    for(size_t i=0; i<key->ntimings; i++) {
+        if(i & 1) {
+            key->pulses[key->npulses++] =
+                (gpioPulse_t){ .gpioOn = 0, .gpioOff = 0,
+                    .usDelay = key->timings[i] };
+            continue;
+        }
+        uint64_t cycles = (key->timings[i] * f + 500000) / 1000000;
+        uint64_t sofar = 0;
+        for(uint64_t c=0; c<cycles; c++) {
+            uint64_t target = ((c + 1) * 1000000 + f / 2) / f;
+            uint32_t span = target - sofar;
+            uint32_t high = on < span? on : span;
+            key->pulses[key->npulses++] =
+                (gpioPulse_t){ .gpioOn = mask, .gpioOff = 0, .usDelay = high };
+            key->pulses[key->npulses++] =
+                (gpioPulse_t){ .gpioOn = 0, .gpioOff = mask,
+                    .usDelay = span - high };
+            sofar = target;
+        }
+    }
+    return 0;
+}
+
+/* From the start of a press of @param key to the start of the next one. */
+static uint32_t irwave_period(
+    const struct irwave_key_st * key, 
+    uint32_t interval_us)
+{
+    return (interval_us > key->length_us)? interval_us : key->length_us;
+}
+
+#ifdef _DESKTOP_BUILD_
+/* Nothing goes out, but the presses are counted and stop is asked as it
+ * would be.
+ */
+static int irwave_chain(
+    struct irwave_st * wave,
+    const struct irwave_key_st * const * keys,
+    size_t n,
+    uint32_t interval_us,
+    irwave_stop_fn stop,
+    void * arg,
+    bool * stopped)
+{
+    (void)wave;
+    (void)keys;
+    (void)interval_us;
+    for(size_t i=1; i<n; i++) {
+        if(stop && stop(arg)) {
+            *stopped = true;
+            return i;
+        }
+    }
+    return n;
+}
+#else
+/* Send as many of the @param n presses in @param keys as fit in one wave
+ * chain. Runs of the same key are a loop in the chain. @returns how many
+ * were sent, and sets @param stopped if @param stop cut the chain short.
+ */
+static int irwave_chain(
+    struct irwave_st * wave,
+    const struct irwave_key_st * const * keys,
+    size_t n,
+    uint32_t interval_us,
+    irwave_stop_fn stop,
+    void * arg,
+    bool * stopped)
+{
+    uint8_t buf[IRWAVE_CHAIN_MAX];
+    size_t len = 0, m = 0;
+    uint64_t at = 0;
+    struct timespec start;
+    int r;
+
+    n = irwave_waveforms(wave, keys, n);
+    if(n == 0) return -EIO;
+
+    while(m < n) {
+        const struct irwave_key_st * key = keys[m];
+        size_t run = 1, need;
+        uint32_t extra = irwave_period(key, interval_us) - key->length_us;
+        while(m + run < n && keys[m + run] == key && run < 0xFFFF) run++;
+
+        need = 1 + 4 * ((extra + 0xFFFE) / 0xFFFF) + ((run > 1)? 6 : 0);
+        if(len + need > sizeof(buf)) break;
+        if(run > 1) {
+            buf[len++] = 255;       // loop start
+            buf[len++] = 0;
+        }
+        buf[len++] = wave->waveids[key - wave->keys];
+        while(extra) {
+            uint32_t delay = (extra > 0xFFFF)? 0xFFFF : extra;
+            buf[len++] = 255;       // delay, in us
+            buf[len++] = 2;
+            buf[len++] = delay & 0xFF;
+            buf[len++] = delay >> 8;
+            extra -= delay;
+        }
+        if(run > 1) {
+            buf[len++] = 255;       // loop, run times
+            buf[len++] = 1;
+            buf[len++] = run & 0xFF;
+            buf[len++] = run >> 8;
+        }
+        m += run;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    r = wave_chain(wave->pi, (char *)buf, len);
+    if(r < 0) {
+        syslog(LOG_ERR, "Got %s sending a chain of %zu presses", 
+            pigpio_error(r), m);
+        return -EIO;
+    }
+
+    // The chain runs by itself. Wake up in the gap before every press, in
+    // case it should stop there, and at the end.
+    for(size_t i=1; i<m; i++) {
+        const struct irwave_key_st * last = keys[i - 1];
+        uint32_t period = irwave_period(last, interval_us);
+        uint32_t gap = last->timings[last->ntimings - 1] + 
+            (period - last->length_us);
+        uint32_t margin = (gap / 2 < IRWAVE_STOP_MARGIN_US)? 
+            gap / 2 : IRWAVE_STOP_MARGIN_US;
+        at += period;
+        if(!stop) continue;
+        irwave_sleep_until(&start, at - margin);
+        if(stop(arg)) {
+            wave_tx_stop(wave->pi);
+            *stopped = true;
+            return i;
+        }
+    }
+    at += irwave_period(keys[m - 1], interval_us);
+    if(at > 1000) irwave_sleep_until(&start, at - 1000);
+    while(wave_tx_busy(wave->pi) == 1) usleep(200);
+    return m;
+}
+
+/* Make sure every key in @param keys has its waveform. @returns how many of
+ * them, from the first, have one.
+ */
+static size_t irwave_waveforms(
+    struct irwave_st * wave,
+    const struct irwave_key_st * const * keys,
+    size_t n)
+{
+    size_t i = 0;
+    for(int attempt = 0; attempt < 2; attempt++) {
+        for(i = 0; i < n; i++) {
+            if(irwave_waveform(wave, keys[i]) < 0) break;
+        }
+        if(i == n || attempt) break;
+        // pigpio ran out of room for waveforms. Start over with only the
+        // keys of this burst.
+        wave_clear(wave->pi);
+        for(size_t k=0; k<IRWAVE_KEYS_MAX; k++) wave->waveids[k] = -1;
+    }
+    if(i < n) {
+        syslog(LOG_ERR, "pigpio has no room for the waveform of %s", 
+            keys[i]->name);
+    }
+    return i;
+}
+
+/* @returns the pigpio waveform of @param key, made the first time. */
+static int irwave_waveform(
+    struct irwave_st * wave, 
+    const struct irwave_key_st * key)
+{
+    int r;
+    size_t k = key - wave->keys;
+    if(wave->waveids[k] >= 0) return wave->waveids[k];
+
+    wave_add_new(wave->pi);
+    r = wave_add_generic(wave->pi, key->npulses, key->pulses);
+    if(r >= 0) r = wave_create(wave->pi);
+    if(r < 0) return r;
+    wave->waveids[k] = r;
+    return r;
+}
+
+static void irwave_sleep_until(const struct timespec * start, uint64_t us)
+{
+    struct timespec ts = *start;
+    ts.tv_sec += us / 1000000;
+    ts.tv_nsec += (us % 1000000) * 1000;
+    if(ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // recvmmsg
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,36 +8,71 @@
 #include <syslog.h>
 #include <arpa/inet.h> 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h> 
 #include <unistd.h> 
 #include <pthread.h>
 #include "accpanel.h"
 #include "machvis.h"
 
+#define MACHVIS_BATCH_SIZE  (MACHVIS_RING_SLOTS - 1)
 
-int machvis_initialize(struct machvis_st * mv)
+#ifndef __linux__
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+static int machvis_recv_batch(int fd, struct mmsghdr * msgs, unsigned int n);
+static bool machvis_slot_accept(struct machvis_slot_st * slot);
+static void machvis_caps_send(
+    struct machvis_st * mv, 
+    int fd, 
+    struct sockaddr_in * peer);
+static void machvis_panel_vote(
+    struct machvis_st * mv, 
+    struct panel_st * panel, 
+    const uint8_t * margins);
+static int machvis_vote(
+    struct machvis_st * mv, 
+    struct machvis_vote_st * vote, 
+    int value, 
+    unsigned int margin);
+
+int machvis_initialize(struct machvis_st * mv, int port)
 {
+    if(port <= 0 || port > 65535) return -EINVAL;
     mv = memset(mv, 0, sizeof(*mv));
+    mv->port = port;
     mv->machvispanelparsed = true;
     mv->machvispanelpublished = true;
     pthread_mutex_init(&mv->socketmutex,NULL);
     pthread_mutex_init(&mv->machvismutex,NULL);
-    mv->machvistransmissionsize = 128;
-    mv->machvistransmission = NULL;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mv->machvischanged, &attr);
+    pthread_condattr_destroy(&attr);
+    mv->mailbox = 0;
+    mv->machvistransmissionsize = 0;
+    mv->machvistransmission = mv->ring[mv->mailbox].buffer;
     mv->machvispanel = NULL;                        // assigned externally
-    if(!mv->machvistransmission) {
-        syslog(LOG_ERR, "failed to initialize machvis: %s", strerror(errno));
-    }
     return 0;
 }
 
 int machvis_finalize(struct machvis_st *mv)
 {
     pthread_mutex_lock(&mv->machvismutex);
-    free(mv->machvistransmission);
+    syslog(LOG_INFO, 
+        "machvis received %lu, coalesced %lu, dropped %lu, unchanged %lu, "
+        "suppressed %lu",
+        mv->counters.received, mv->counters.coalesced, mv->counters.dropped,
+        mv->counters.unchanged, mv->counters.suppressed);
     //Mutex must be unlocked for destruction
     pthread_mutex_unlock(&mv->machvismutex);
     pthread_mutex_destroy(&mv->machvismutex);
+    pthread_cond_destroy(&mv->machvischanged);
 
     machvis_close(mv);
     pthread_mutex_destroy(&mv->socketmutex);
@@ -53,7 +89,7 @@ int machvis_open(struct machvis_st * mv)
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_addr.s_addr = inet_addr(MACHVIS_SOCKET_PATH); 
-    addr.sin_port = htons(MACHVIS_SOCKET_PORT); 
+    addr.sin_port = htons(mv->port); 
     addr.sin_family = MACHVIS_SOCKET_FAM;
 
     pthread_mutex_lock(&mv->socketmutex);
@@ -95,37 +131,106 @@ void *machvis_receive(void *args)
 {
     int r = 0;
     struct machvis_st * mv = (struct machvis_st *)args;
-    const size_t buffersize = 1024;
-    char * buffer;
+    struct mmsghdr msgs[MACHVIS_BATCH_SIZE];
+    struct iovec iovs[MACHVIS_BATCH_SIZE];
+    struct sockaddr_in peers[MACHVIS_BATCH_SIZE];
+    unsigned int slots[MACHVIS_BATCH_SIZE];
     
     r = machvis_open(mv);
     assert(r == 0);
   
-    size_t n;
+    int fd, n, latest;
+    unsigned int i, j;
+    unsigned long dropped, coalesced;
     mv->receive = true;
     do {
         pthread_testcancel();
-        buffer = malloc(buffersize);
+
+        /* Every slot except the mailbox can be received into. Only this 
+         * thread moves the mailbox, so the publisher can keep reading it
+         * while we block on the socket.
+         */
+        for(i=0, j=0; i<MACHVIS_RING_SLOTS; i++) {
+            if(i == mv->mailbox) continue;
+            slots[j] = i;
+            iovs[j].iov_base = mv->ring[i].buffer;
+            iovs[j].iov_len = MACHVIS_SLOT_SIZE;
+            memset(&msgs[j], 0, sizeof(msgs[j]));
+            msgs[j].msg_hdr.msg_iov = &iovs[j];
+            msgs[j].msg_hdr.msg_iovlen = 1;
+            msgs[j].msg_hdr.msg_name = &peers[j];
+            msgs[j].msg_hdr.msg_namelen = sizeof(peers[j]);
+            j++;
+        }
+
         pthread_mutex_lock(&mv->socketmutex);
-        n = recvfrom(mv->socketfd, buffer, buffersize, 0, 
-            (struct sockaddr*)NULL, NULL);
+        fd = mv->socketfd;
         pthread_mutex_unlock(&mv->socketmutex);
-        
-        if(n<=0) continue;
-        syslog(LOG_DEBUG,"Got %lu bytes:\t",n);
-        syslog(LOG_DEBUG,"%s\n", buffer);
+
+        n = machvis_recv_batch(fd, msgs, j);
+        if(n <= 0) continue;
+
+        /* Latest-value mailbox: only the newest good datagram of the batch is
+         * kept, the rest are counted as coalesced.
+         */
+        latest = -1;
+        dropped = 0;
+        coalesced = 0;
+        for(i=n; i-- > 0; ) {
+            struct machvis_slot_st * slot = &mv->ring[slots[i]];
+            slot->length = msgs[i].msg_len;
+            slot->buffer[slot->length] = '\0';
+            if(latest >= 0) {
+                coalesced++;
+            }
+            else if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC ||
+                    !machvis_slot_accept(slot)) {
+                dropped++;
+                syslog(LOG_DEBUG, "Dropped a %lu byte datagram", slot->length);
+            }
+            else {
+                latest = i;
+            }
+        }
 
         pthread_mutex_lock(&mv->machvismutex);
-        free(mv->machvistransmission);
-        mv->machvistransmissionsize = buffersize;
-        mv->machvistransmission = buffer;
+        mv->counters.received += n;
+        mv->counters.dropped += dropped;
+        mv->counters.coalesced += coalesced;
+        pthread_mutex_unlock(&mv->machvismutex);
+        if(latest < 0) continue;
+
+        struct machvis_slot_st * slot = &mv->ring[slots[latest]];
+        syslog(LOG_DEBUG,"Got %lu bytes:\t",slot->length);
+        syslog(LOG_DEBUG,"%s\n", slot->binary? slot->text : slot->buffer);
+
+        // A JSON sender may not know we can take frames. Tell it.
+        if(!slot->binary) machvis_caps_send(mv, fd, &peers[latest]);
+
+        pthread_mutex_lock(&mv->machvismutex);
+        if(!mv->machvispanelparsed) mv->counters.coalesced++;
+        mv->mailbox = slots[latest];
+        if(slot->binary) {
+            // MQTT subscribers keep getting JSON, whatever the wire format.
+            mv->machvistransmissionsize = strlen(slot->text);
+            mv->machvistransmission = slot->text;
+            mv->machvisseq = slot->frame.seq;
+            mv->machvistimestamp = slot->frame.timestamp;
+            if(slot->frame.flags & ACCPANEL_FRAME_FLAG_UNCHANGED) 
+                mv->counters.unchanged++;
+        }
+        else {
+            mv->machvistransmissionsize = slot->length;
+            mv->machvistransmission = slot->buffer;
+        }
         mv->machvispanelparsed = false;
         mv->machvispanelpublished = false;
         pthread_mutex_unlock(&mv->machvismutex);
 
         pthread_mutex_lock(&mv->machvismutex);
         if(mv->machvispanel != NULL) {
-            struct panel_st * p = mv->machvispanel; // fixes a concurrency bug
+            // fixes a concurrency bug
+            struct panel_atomic_st * p = mv->machvispanel;
             pthread_mutex_unlock(&mv->machvismutex);
             r = machvis_parse(mv, p);
             if(r != 0 && r!= -EALREADY) 
@@ -140,9 +245,79 @@ void *machvis_receive(void *args)
     return NULL;    
 }
 
-int machvis_parse(struct machvis_st *mv, struct panel_st *panel)
+/* Check that @param slot holds something worth parsing. Binary frames are
+ * decoded and rendered to JSON here, so that the rest of machvis does not
+ * need to care about the wire format. @returns true if the slot is good.
+ */
+static bool machvis_slot_accept(struct machvis_slot_st * slot)
 {
     int r;
+    slot->binary = accpanel_frame_is(slot->buffer, slot->length);
+    if(!slot->binary) return slot->length > 0;
+
+    r = accpanel_frame_decode(&slot->frame, slot->buffer, slot->length);
+    if(r) {
+        syslog(LOG_DEBUG, "Bad panel frame: %s", strerror(-r));
+        return false;
+    }
+    accpanel_frame_snprint(slot->text, sizeof(slot->text), &slot->frame);
+    return true;
+}
+
+/* Send the capabilities to @param peer, unless it was the last one told, less
+ * than MACHVIS_CAPS_INTERVAL_MS ago. Only the receive thread calls this.
+ */
+static void machvis_caps_send(
+    struct machvis_st * mv, 
+    int fd, 
+    struct sockaddr_in * peer)
+{
+    char caps[ACCPANEL_CAPS_SIZE];
+    struct timespec now;
+    long elapsed;
+    size_t n;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - mv->capssent.tv_sec) * 1000 + 
+        (now.tv_nsec - mv->capssent.tv_nsec) / 1000000;
+    if(mv->capspeer.sin_addr.s_addr == peer->sin_addr.s_addr &&
+        mv->capspeer.sin_port == peer->sin_port &&
+        elapsed < MACHVIS_CAPS_INTERVAL_MS) {
+        return;
+    }
+    mv->capspeer = *peer;
+    mv->capssent = now;
+
+    n = accpanel_caps_encode(caps, sizeof(caps));
+    if(sendto(fd, caps, n, MSG_DONTWAIT, 
+        (struct sockaddr *)peer, sizeof(*peer)) < 0) {
+        syslog(LOG_DEBUG, "Could not send capabilities: %s", strerror(errno));
+    }
+}
+
+/* Receive up to @param n datagrams into @param msgs, blocking only until the
+ * first one arrives. @returns the number of datagrams received, or -1.
+ */
+static int machvis_recv_batch(int fd, struct mmsghdr * msgs, unsigned int n)
+{
+    #ifdef __linux__
+    return recvmmsg(fd, msgs, n, MSG_WAITFORONE, NULL);
+    #else
+    // No recvmmsg here, so fall back to one datagram per call.
+    ssize_t r;
+    if(n == 0) return 0;
+    r = recvmsg(fd, &msgs[0].msg_hdr, 0);
+    if(r < 0) return -1;
+    msgs[0].msg_len = r;
+    return 1;
+    #endif
+}
+
+int machvis_parse(struct machvis_st *mv, struct panel_atomic_st *panel)
+{
+    int r;
+    struct panel_st p = PANEL_INITIALIZER;
+    static const uint8_t nomargins[ACCPANEL_MARGINS];
     if(!mv || !panel) return -EINVAL;
     pthread_mutex_lock(&mv->machvismutex);
     if(mv->machvispanelparsed) {
@@ -150,29 +325,141 @@ int machvis_parse(struct machvis_st *mv, struct panel_st *panel)
         return -EALREADY;
     }
 
-    struct panel_st * p = panel;
-    pthread_mutex_lock(&p->mutex);
-    r = accpanel_parse(p, mv->machvistransmission);
+    struct machvis_slot_st * slot = &mv->ring[mv->mailbox];
+    if(slot->binary)
+        r = accpanel_frame_topanel(&p, &slot->frame);
+    else
+        r = accpanel_parse(&p, mv->machvistransmission, 
+            mv->machvistransmissionsize);
     if(r) goto ret;
+    machvis_panel_vote(mv, &p, slot->binary? slot->frame.margins : nomargins);
 
+    // The readers look at the panel's generation to see that it is new.
+    accpanel_atomic_store(panel, &p);
     mv->machvispanelparsed = true;
-    p->consumed = false;
+    mv->machvisgeneration++;
+    pthread_cond_broadcast(&mv->machvischanged);
     r = 0;
 
     ret:
-    pthread_mutex_unlock(&p->mutex);
     pthread_mutex_unlock(&mv->machvismutex);
     return r; 
 }
 
-void machvis_machvispanel_set(struct machvis_st *mv, struct panel_st *panel) 
+/* Replace every field of @param panel with the one its votes publish, given
+ * the @param margins it was read with. Must hold machvismutex.
+ */
+static void machvis_panel_vote(
+    struct machvis_st * mv, 
+    struct panel_st * panel, 
+    const uint8_t * margins)
+{
+    struct machvis_vote_st * v = mv->votes;
+    const uint8_t * m = margins;
+
+    panel->fan = machvis_vote(mv, &v[ACCPANEL_MARGIN_FAN], 
+        panel->fan, m[ACCPANEL_MARGIN_FAN]);
+    panel->mode = machvis_vote(mv, &v[ACCPANEL_MARGIN_MODE], 
+        panel->mode, m[ACCPANEL_MARGIN_MODE]);
+    panel->delay = machvis_vote(mv, &v[ACCPANEL_MARGIN_DELAY], 
+        panel->delay, m[ACCPANEL_MARGIN_DELAY]);
+    panel->temperature = machvis_vote(mv, &v[ACCPANEL_MARGIN_TEMPERATURE], 
+        panel->temperature, m[ACCPANEL_MARGIN_TEMPERATURE]);
+    panel->filterbad = machvis_vote(mv, &v[ACCPANEL_MARGIN_FILTERBAD], 
+        panel->filterbad, m[ACCPANEL_MARGIN_FILTERBAD]);
+}
+
+/* Add @param value, read with @param margin, to the window of @param vote.
+ * @returns the value to publish: the one published so far, unless a quorum of
+ * readings agrees with @param value and they have more than half the weight
+ * of the window. A differing reading that is outvoted until the field reads
+ * as before counts as suppressed.
+ */
+static int machvis_vote(
+    struct machvis_st * mv, 
+    struct machvis_vote_st * vote, 
+    int value, 
+    unsigned int margin)
+{
+    unsigned int i, total = 0, agree = 0, agreeing = 0;
+
+    vote->value[vote->next] = value;
+    vote->weight[vote->next] = margin + 1;
+    vote->next = (vote->next + 1) % MACHVIS_VOTE_WINDOW;
+    if(vote->count < MACHVIS_VOTE_WINDOW) vote->count++;
+
+    // There is nothing to outvote the very first reading with.
+    if(vote->count == 1 || value == vote->committed) {
+        if(vote->count > 1 && vote->pending) mv->counters.suppressed++;
+        vote->committed = value;
+        vote->pending = false;
+        return value;
+    }
+
+    for(i=0; i<vote->count; i++) {
+        total += vote->weight[i];
+        if(vote->value[i] == value) {
+            agree += vote->weight[i];
+            agreeing++;
+        }
+    }
+    if(agreeing >= MACHVIS_VOTE_QUORUM && 2 * agree > total) {
+        vote->committed = value;
+        vote->pending = false;
+    }
+    else {
+        vote->pending = true;
+    }
+    return vote->committed;
+}
+
+void machvis_machvispanel_set(
+    struct machvis_st *mv, 
+    struct panel_atomic_st *panel) 
 {
     pthread_mutex_lock(&mv->machvismutex);
     mv->machvispanel = panel;
     pthread_mutex_unlock(&mv->machvismutex);
 }
 
-struct panel_st * machvis_machvispanel_get(struct machvis_st *mv) 
+struct panel_atomic_st * machvis_machvispanel_get(struct machvis_st *mv) 
 {
     return mv->machvispanel;
 }
+
+unsigned long machvis_generation(struct machvis_st *mv)
+{
+    unsigned long generation;
+    pthread_mutex_lock(&mv->machvismutex);
+    generation = mv->machvisgeneration;
+    pthread_mutex_unlock(&mv->machvismutex);
+    return generation;
+}
+
+int machvis_wait(
+    struct machvis_st *mv, 
+    unsigned long *generation, 
+    const struct timespec *deadline)
+{
+    int r = 0;
+    pthread_mutex_lock(&mv->machvismutex);
+    while(mv->machvisgeneration == *generation && r == 0) {
+        r = pthread_cond_timedwait(&mv->machvischanged, &mv->machvismutex, 
+            deadline);
+    }
+    if(mv->machvisgeneration != *generation) {
+        *generation = mv->machvisgeneration;
+        r = 0;
+    }
+    pthread_mutex_unlock(&mv->machvismutex);
+    return -r;
+}
+
+void machvis_counters_get(
+    struct machvis_st *mv, 
+    struct machvis_counters_st *counters)
+{
+    pthread_mutex_lock(&mv->machvismutex);
+    *counters = mv->counters;
+    pthread_mutex_unlock(&mv->machvismutex);
+}
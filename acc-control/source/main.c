@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
@@ -7,77 +8,76 @@
 #include "mqtt.h"
 #include "machvis.h"
 #include "control.h"
+#include "gateway.h"
 
 #define LEDSLEEP    500000
 
-struct mainthreads_st {
-    pthread_t machvis;
-    pthread_t control_publish;
-    pthread_t control_loop;
-};
+static void usage(const char * name)
+{
+    fprintf(stderr, "Usage: %s [-c gateway.conf]\n", name);
+    fprintf(stderr, "  -c  drive the AC units listed in gateway.conf\n");
+}
 
-int main() {
+int main(int argc, char * argv[]) {
 
-    int r = 0;
+    int r = 0, opt;
+    const char * config = NULL;
     struct GPIO gpio;
-    struct infra_st infra;
     struct mqtt_st mqtt;
-    struct machvis_st mv;
-    struct mainthreads_st mt;
-    struct control_st control;
+    static struct gateway_st gw;    // too big for the stack with many units
+
+    while((opt = getopt(argc, argv, "c:h")) != -1) {
+        switch(opt) {
+            case 'c':
+                config = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h')? 0 : 1;
+        }
+    }
+
+    if(config) {
+        r = gateway_load(&gw, config);
+        if(r) {
+            fprintf(stderr, "Bad configuration in %s, see syslog\n", config);
+            return 1;
+        }
+    }
+    else {
+        r = gateway_default(&gw);
+        assert(r == 0);
+    }
 
     r = GPIO_initialize(&gpio);
     assert(r >= 0);
 
-    r = infrared_initialize(&infra, &gpio);
-    assert(r == 0);
-
-    r = machvis_initialize(&mv);
-    assert(r == 0);
-    pthread_create(&mt.machvis, NULL, machvis_receive, &mv);
-
-    r = mqtt_initialize(&mqtt, &mv);
+    r = mqtt_initialize(&mqtt, NULL);
     assert(r == 0);
     r = mqtt_publish_unit_ping(&mqtt);
     assert(r == 0);
 
-    r = control_initialize(&control, &mqtt, &infra, &mv);
+    r = gateway_start(&gw, &gpio, &mqtt);
     assert(r == 0);
-    pthread_create(&mt.control_publish, NULL, control_publish, &control);
-    pthread_create(&mt.control_loop, NULL, control_loop, &control);
 
     // This pause could be a loop that watches over the threads instead
     GPIO_set_StatusLED(&gpio, stat_off);
     pause();
     printf("Exiting main thread");
     mqtt.publish = false;
-    mv.receive = false;
-    control.publish = false;
 
-    pthread_join(mt.control_loop, NULL);
-    pthread_join(mt.control_publish, NULL);
-    pthread_join(mt.machvis, NULL);
+    r = gateway_stop(&gw);
+    assert(r == 0);
 
     GPIO_set_StatusLED(&gpio, stat_red);
 
-    r = control_finalize(&control);
-    assert (r == 0);
-
     r = mqtt_disconnect(&mqtt);
     assert(r == 0);
     r = mqtt_finalize(&mqtt);
     assert(r == 0);
-    
-    r = machvis_close(&mv);
-    assert(r == 0 || errno == EBADF);
-    r = machvis_finalize(&mv);
-    assert(r == 0);
 
-    infrared_finalize(&infra);
     GPIO_finalize(&gpio);
 
     return 0;
 
 }
-
-
@@ -7,6 +7,7 @@
 #include <syslog.h>
 #include <mosquitto.h>
 #include "mqtt.h"
+#include "mqttloopback.h"
 #include "machvis.h"
 #include "control.h"
 #include "accpanel.h"
@@ -19,102 +20,190 @@
  * on error. 
  */
 static int mqtt_autoconnect(struct mqtt_st * mqtt);
+static long mqtt_elapsed_ms(
+    const struct timespec * since, 
+    const struct timespec * now);
+static void mqtt_setup(struct mqtt_st * mqtt, struct machvis_st * mv);
+static int mqtt_mosquitto_open(struct mqtt_st * mqtt);
+static void mqtt_mosquitto_close(struct mqtt_st * mqtt);
+static int mqtt_mosquitto_connect(struct mqtt_st * mqtt);
+static int mqtt_mosquitto_disconnect(struct mqtt_st * mqtt);
+static int mqtt_mosquitto_publish(
+    struct mqtt_st * mqtt, 
+    const char * topic, 
+    const void * payload, 
+    size_t len, 
+    int qos, 
+    bool retain);
+static int mqtt_mosquitto_subscribe(
+    struct mqtt_st * mqtt, 
+    const char * topic, 
+    int qos);
+static int mqtt_mosquitto_errno(int r);
 void mqtt_listen_callback(
     struct mosquitto *mosq, 
     void *obj, 
     const struct mosquitto_message * msg);
 
+const struct mqtt_transport_st mqtt_transport_mosquitto = {
+    .name = "mosquitto",
+    .open = mqtt_mosquitto_open,
+    .close = mqtt_mosquitto_close,
+    .connect = mqtt_mosquitto_connect,
+    .disconnect = mqtt_mosquitto_disconnect,
+    .publish = mqtt_mosquitto_publish,
+    .subscribe = mqtt_mosquitto_subscribe
+};
+
 int mqtt_initialize(struct mqtt_st * mqtt, struct machvis_st * mv)
 {
     int r;
-    bool machineid = false;
 
     assert(mqtt != NULL);
+    mqtt_setup(mqtt, mv);
+    mqtt->transport = &mqtt_transport_mosquitto;
+
+    r = mqtt->transport->open(mqtt);
+    if(r) return r;
+
+    r = mqtt_autoconnect(mqtt);
+    if(r) {
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+int mqtt_initialize_loopback(
+    struct mqtt_st * mqtt, 
+    struct machvis_st * mv,
+    struct mqtt_loopback_st * broker)
+{
+    int r;
+
+    assert(mqtt != NULL);
+    if(!broker) return -EINVAL;
+    mqtt_setup(mqtt, mv);
+    mqtt->transport = &mqtt_transport_loopback;
+    mqtt->loopback = broker;
+
+    r = mqtt->transport->open(mqtt);
+    if(r) return r;
+    return mqtt_autoconnect(mqtt);
+}
+
+int mqtt_finalize(struct mqtt_st * mqtt)
+{
+    assert(mqtt != NULL);
+    if(!mqtt->transport) return -EINVAL;    // There is nothing to finalize
+
+    mqtt->transport->close(mqtt);
+    pthread_mutex_destroy(&mqtt->listenmutex);
+    mqtt->transport = NULL;
+
+    return 0;
+}
+
+int mqtt_connect(struct mqtt_st * mqtt)
+{
+    int r;
+
+    assert(mqtt != NULL);
+    r = mqtt->transport->connect(mqtt);
+    if(r) return r;
+    mqtt->connected = true;
+    return 0;
+}
+
+int mqtt_disconnect(struct mqtt_st * mqtt)
+{
+    int r;
+
+    assert(mqtt != NULL);
+    r = mqtt->transport->disconnect(mqtt);
+    if(r) return -1;
+    mqtt->connected = false;
+    return 0;
+}
+
+static void mqtt_setup(struct mqtt_st * mqtt, struct machvis_st * mv)
+{
     mqtt = memset(mqtt, 0, sizeof(*mqtt));
 
     mqtt->mv = mv;
+    pthread_mutex_init(&mqtt->listenmutex, NULL);
+
+    FILE *machid = fopen(MQTT_MACHINEID_PATH, "r");
+    if(machid) {
+        if(!fgets(mqtt->uuid, sizeof(mqtt->uuid), machid))
+            mqtt->uuid[0] = '\0';
+        for(size_t i=0; i<sizeof(mqtt->uuid); i++) {
+            if(mqtt->uuid[i] == '\n') mqtt->uuid[i] = '\0';
+        }
+        fclose(machid);
+    }
+}
+
+static int mqtt_mosquitto_open(struct mqtt_st * mqtt)
+{
+    int r;
 
     int maj,min,rev;
     mosquitto_lib_version(&maj,&min,&rev);
     syslog(LOG_DEBUG,"Mosquitto version %d.%d.%d",maj,min,rev);
 
-    FILE *machid = fopen(MQTT_MACHINEID_PATH, "r");
-    if(!machid) 
-        r = 0;
-    else if(fgets(mqtt->uuid, sizeof(mqtt->uuid), machid)) {
-            machineid = true;
-            for(size_t i=0; i<sizeof(mqtt->uuid); i++) {
-                if(mqtt->uuid[i] == '\n') mqtt->uuid[i] = '\0';
-            }
-        }
-    
     r = mosquitto_lib_init();
     if(r != MOSQ_ERR_SUCCESS) {
         syslog(LOG_CRIT, "Failed to mosquitto_lib_init");
         return -EAGAIN;
     }
-    const char * uuid = (machineid)? mqtt->uuid:NULL;
+    const char * uuid = (mqtt->uuid[0] != '\0')? mqtt->uuid:NULL;
     mqtt->mosq = mosquitto_new(uuid, true, NULL);
     if(mqtt->mosq == NULL) {
         syslog(LOG_CRIT, "Failed to instantiate mosquitto client");
         return -errno;
     }
 
+    mosquitto_user_data_set(mqtt->mosq, mqtt);
+    mosquitto_message_callback_set(mqtt->mosq, mqtt_listen_callback);
+
     r = mosquitto_loop_start(mqtt->mosq);
     if(r != MOSQ_ERR_SUCCESS) {
         syslog(LOG_CRIT, "Failed to start mosquitto loop");
         return -EAGAIN;
     }
-
-    r = mqtt_autoconnect(mqtt);
-    if(r) {
-        return -EAGAIN;
-    }
-
-    r = mosquitto_subscribe(mqtt->mosq, NULL, 
-        MQTT_LISTEN_TOPIC, MQTT_LISTEN_QOS);
-    if(r != MOSQ_ERR_SUCCESS) {
-        syslog(LOG_CRIT, "Failed to subscribe to %s", MQTT_LISTEN_TOPIC);
-        /* TODO: undo the rest of the initialization */
-        return -EAGAIN;
-    }
-
     return 0;
 }
 
-int mqtt_finalize(struct mqtt_st * mqtt)
+static void mqtt_mosquitto_close(struct mqtt_st * mqtt)
 {
     int r;
-    assert(mqtt != NULL);
-    if(!mqtt->mosq) return -EINVAL;     // There is nothing to finalize
+    if(!mqtt->mosq) return;
 
     r = mosquitto_loop_stop(mqtt->mosq, true);
     if(r != MOSQ_ERR_SUCCESS) {
         syslog(LOG_CRIT, "Failed to stop mosquitto loop");
-        return -EAGAIN;
     }
 
     // It's okay if mqtt_disconnect fails due to no connection
     mqtt_disconnect(mqtt);
     mosquitto_destroy(mqtt->mosq);
+    mqtt->mosq = NULL;
 
     r = mosquitto_lib_cleanup();
     if(r != MOSQ_ERR_SUCCESS) {
         syslog(LOG_CRIT, "Failed to mosquitto_lib_cleanup");
-        return -EAGAIN;
     }
-
-    return 0;
 }
 
-int mqtt_connect(struct mqtt_st * mqtt)
+static int mqtt_mosquitto_connect(struct mqtt_st * mqtt)
 {
     int r;
     char * host = MQTT_BROKER_HOSTNAME;
     int  port = MQTT_BROKER_PORT;
     int  ka = MQTT_BROKER_KEEPALIVE_S;
 
-    assert(mqtt != NULL);
+    if(!mqtt->mosq) return -EINVAL;
     r = mosquitto_connect(mqtt->mosq, host, port, ka);
     if(r != MOSQ_ERR_SUCCESS) {
         syslog(LOG_WARNING, "Failed to connect to %s:%i",host,port);
@@ -126,15 +215,13 @@ int mqtt_connect(struct mqtt_st * mqtt)
             return -errno;
         }
     }
-    mqtt->connected = true;
     return 0;
 }
 
-int mqtt_disconnect(struct mqtt_st * mqtt)
+static int mqtt_mosquitto_disconnect(struct mqtt_st * mqtt)
 {
     int r;
 
-    assert(mqtt != NULL);
     r = mosquitto_disconnect(mqtt->mosq);
     if(r != MOSQ_ERR_SUCCESS) {
         syslog(LOG_WARNING, "Failed to close connection");
@@ -142,22 +229,57 @@ int mqtt_disconnect(struct mqtt_st * mqtt)
             syslog(LOG_WARNING, "...because the parameters are invalid");
         else if(r == MOSQ_ERR_NO_CONN)
             syslog(LOG_WARNING, "...because no connection was open");
-        return -1;
+        return mqtt_mosquitto_errno(r);
     }
-    mqtt->connected = false;
     return 0;
 }
 
+static int mqtt_mosquitto_publish(
+    struct mqtt_st * mqtt, 
+    const char * topic, 
+    const void * payload, 
+    size_t len, 
+    int qos, 
+    bool retain)
+{
+    int r = mosquitto_publish(mqtt->mosq, NULL, topic, len, payload, 
+        qos, retain);
+    return mqtt_mosquitto_errno(r);
+}
+
+static int mqtt_mosquitto_subscribe(
+    struct mqtt_st * mqtt, 
+    const char * topic, 
+    int qos)
+{
+    int r = mosquitto_subscribe(mqtt->mosq, NULL, topic, qos);
+    return mqtt_mosquitto_errno(r);
+}
+
+/* libmosquitto has its own error codes. */
+static int mqtt_mosquitto_errno(int r)
+{
+    switch(r) {
+        case MOSQ_ERR_SUCCESS:      return 0;
+        case MOSQ_ERR_INVAL:        return -EINVAL;
+        case MOSQ_ERR_NOMEM:        return -ENOMEM;
+        case MOSQ_ERR_NO_CONN:      return -ENOTCONN;
+        case MOSQ_ERR_PAYLOAD_SIZE: return -EMSGSIZE;
+        case MOSQ_ERR_ERRNO:        return errno? -errno : -EIO;
+        default:                    return -EIO;
+    }
+}
+
 static int mqtt_autoconnect(struct mqtt_st *mqtt)
 {
     int r = 0;
 
-    if(!mqtt->mosq) return -1;
+    if(!mqtt->transport) return -1;
 
     if(!mqtt->connected) {
         for(int retry=0; retry<5; retry++) {
             r = mqtt_connect(mqtt);
-            if(r) syslog(LOG_WARNING,"...%s",strerror(errno));
+            if(r) syslog(LOG_WARNING,"...%s",strerror(-r));
             else break;
         }
     }
@@ -168,10 +290,11 @@ void *mqtt_publish(void *args)
 {
     int r = 0;
     struct mqtt_st * mqtt = (struct mqtt_st *)args;
+    if(!mqtt->mv) return NULL;
 
     for(int i=0; i<5; i++) {
         r = mqtt_autoconnect(mqtt);
-        if(r != 0) syslog(LOG_ERR, "Can't open MQTT: %s", mosquitto_strerror(r));
+        if(r != 0) syslog(LOG_ERR, "Can't open MQTT: %s", strerror(-r));
         else break;
         sleep(1);
     }
@@ -185,12 +308,11 @@ void *mqtt_publish(void *args)
             pthread_mutex_unlock(&mqtt->mv->machvismutex);
             continue;
         }
-        r = mosquitto_publish(
-            mqtt->mosq,
-            NULL,
+        r = mqtt->transport->publish(
+            mqtt,
             MQTT_TOPIC,
-            mqtt->mv->machvistransmissionsize,
             mqtt->mv->machvistransmission,
+            mqtt->mv->machvistransmissionsize,
             0,
             true
         );
@@ -198,7 +320,7 @@ void *mqtt_publish(void *args)
         syslog(LOG_DEBUG, "Published: %s\n", mqtt->mv->machvistransmission);
         if(r) {
             pthread_mutex_unlock(&mqtt->mv->machvismutex);
-            syslog(LOG_ERR, "Couldn't publish: %s", mosquitto_strerror(r));
+            syslog(LOG_ERR, "Couldn't publish: %s", strerror(-r));
             usleep(300000);
             continue;
         }
@@ -208,33 +330,89 @@ void *mqtt_publish(void *args)
     return NULL;
 }
 
-int mqtt_publish_panel_state(struct mqtt_st * mqtt, struct machvis_st * mv)
+void mqtt_publisher_initialize(
+    struct mqtt_publisher_st * pub, 
+    const char * topic)
 {
-    int r;
-    if(!mqtt || !mv) return -EINVAL;
+    pub = memset(pub, 0, sizeof(*pub));
+    strncpy(pub->topic, topic, sizeof(pub->topic) - 1);
+    pub->debounce_ms = MQTT_PUBLISH_DEBOUNCE_MS;
+    pub->heartbeat_s = MQTT_PUBLISH_HEARTBEAT_S;
+    pub->last = (struct panel_st)PANEL_INITIALIZER;
+    pub->pendingpanel = (struct panel_st)PANEL_INITIALIZER;
+}
+
+int mqtt_publish_panel_state(
+    struct mqtt_st * mqtt, 
+    struct machvis_st * mv, 
+    struct mqtt_publisher_st * pub)
+{
+    int r, len;
+    struct timespec now;
+    struct panel_st panel = PANEL_INITIALIZER;
+    char json[ACCPANEL_JSON_SIZE];
+    if(!mqtt || !mv || !pub) return -EINVAL;
 
     pthread_mutex_lock(&mv->machvismutex);
-    if(mv->machvispanelpublished){
+    // Wait until machvis has decoded the transmission, so it can be compared.
+    if(mv->machvispanelpublished || !mv->machvispanelparsed || 
+        !mv->machvispanel) {
         pthread_mutex_unlock(&mv->machvismutex);
         return -EALREADY;
     }
-    r = mosquitto_publish(
-        mqtt->mosq,
-        NULL,
-        MQTT_TOPIC,
-        mv->machvistransmissionsize,
-        mv->machvistransmission,
-        0,
+    accpanel_atomic_load(mv->machvispanel, &panel);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if(!pub->haslast || !accpanel_equal(&panel, &pub->last)) {
+        if(!pub->pending || !accpanel_equal(&panel, &pub->pendingpanel)) {
+            pub->pending = true;
+            accpanel_cpy(&pub->pendingpanel, &panel);
+            pub->pendingsince = now;
+        }
+        if(mqtt_elapsed_ms(&pub->pendingsince, &now) < pub->debounce_ms) {
+            // Leave it unpublished, so it is looked at again.
+            if(pub->heldgeneration != mv->machvisgeneration) {
+                pub->heldgeneration = mv->machvisgeneration;
+                pub->debounced++;
+            }
+            pthread_mutex_unlock(&mv->machvismutex);
+            return -EALREADY;
+        }
+    }
+    else {
+        pub->pending = false;
+        if(mqtt_elapsed_ms(&pub->lastsent, &now) < pub->heartbeat_s * 1000) {
+            mv->machvispanelpublished = true;
+            pub->suppressed++;
+            pthread_mutex_unlock(&mv->machvismutex);
+            return -EALREADY;
+        }
+    }
+
+    // The panel that won the machvis vote, not the datagram it came in.
+    len = accpanel_snprint(json, sizeof(json), &panel);
+    r = mqtt->transport->publish(
+        mqtt,
+        pub->topic,
+        json,
+        len,
+        MQTT_QOS,
         true
     );
     if(r) {
         pthread_mutex_unlock(&mv->machvismutex);
-        syslog(LOG_ERR, "Couldn't publish: %s", mosquitto_strerror(r));
+        syslog(LOG_ERR, "Couldn't publish: %s", strerror(-r));
         return -EAGAIN;
     }
-    printf("Published: %s\n", mv->machvistransmission);
+    syslog(LOG_DEBUG, "Published to %s", pub->topic);
     mv->machvispanelpublished = true;
     pthread_mutex_unlock(&mv->machvismutex);
+
+    accpanel_cpy(&pub->last, &panel);
+    pub->haslast = true;
+    pub->pending = false;
+    pub->lastsent = now;
+    pub->published++;
     return 0;
 }
 
@@ -242,24 +420,42 @@ int mqtt_publish_unit_ping(struct mqtt_st * mqtt)
 {
     int r;
     r = mqtt_autoconnect(mqtt);
-    if(r != 0) syslog(LOG_ERR, "Couldn't open MQTT: %s", mosquitto_strerror(r));
-    r = mosquitto_publish(
-        mqtt->mosq,
-        NULL,
+    if(r != 0) syslog(LOG_ERR, "Couldn't open MQTT: %s", strerror(-r));
+    r = mqtt->transport->publish(
+        mqtt,
         MQTT_TOPIC,
-        sizeof(mqtt->uuid),
         mqtt->uuid,
+        sizeof(mqtt->uuid),
         1,
         true
     );
-    if(r) syslog(LOG_ERR, "Couldn't ping: %s", mosquitto_strerror(r));
+    if(r) syslog(LOG_ERR, "Couldn't ping: %s", strerror(-r));
     return r;
 }
 
+int mqtt_publish_buffer(
+    struct mqtt_st * mqtt, 
+    const char * topic, 
+    const void * payload, 
+    size_t len)
+{
+    int r;
+    if(!mqtt || !topic || (!payload && len)) return -EINVAL;
+    r = mqtt->transport->publish(mqtt, topic, payload, len, 1, false);
+    if(r) {
+        syslog(LOG_ERR, "Couldn't publish to %s: %s", topic, strerror(-r));
+        return -EAGAIN;
+    }
+    return 0;
+}
+
 char * mqtt_listen_command(struct mqtt_st *mqtt)
 {
     int r;
 
+    // This one goes straight to the broker, so only with libmosquitto.
+    if(mqtt->transport != &mqtt_transport_mosquitto) return NULL;
+
     size_t msgsn = 1;
     struct mosquitto_message ** msgs = 
         calloc(msgsn, sizeof(struct mosquitto_message));
@@ -296,30 +492,98 @@ char * mqtt_listen_command(struct mqtt_st *mqtt)
     return cmd;
 }
 
-void mqtt_listen_callback_set(struct mqtt_st *mqtt, struct control_st *control)
+int mqtt_listen_add(
+    struct mqtt_st *mqtt, 
+    const char *topic, 
+    struct control_st *control)
 {
-    mosquitto_user_data_set(mqtt->mosq, control);
-    mosquitto_message_callback_set(mqtt->mosq, mqtt_listen_callback);
+    int r = 0;
+    if(!mqtt || !topic || !control) return -EINVAL;
+    if(strlen(topic) >= MQTT_TOPIC_SIZE) return -ENAMETOOLONG;
+
+    pthread_mutex_lock(&mqtt->listenmutex);
+    if(mqtt->nlisteners >= MQTT_LISTENERS_MAX) {
+        pthread_mutex_unlock(&mqtt->listenmutex);
+        return -ENOSPC;
+    }
+    struct mqtt_listener_st * l = &mqtt->listeners[mqtt->nlisteners++];
+    strcpy(l->topic, topic);
+    l->control = control;
+    pthread_mutex_unlock(&mqtt->listenmutex);
+
+    r = mqtt->transport->subscribe(mqtt, topic, MQTT_LISTEN_QOS);
+    if(r) {
+        syslog(LOG_CRIT, "Failed to subscribe to %s: %s", topic, strerror(-r));
+        mqtt_listen_remove(mqtt, control);
+        return -EAGAIN;
+    }
+    return 0;
 }
+
+void mqtt_listen_remove(struct mqtt_st *mqtt, struct control_st *control)
+{
+    pthread_mutex_lock(&mqtt->listenmutex);
+    for(size_t i=0; i<mqtt->nlisteners; i++) {
+        if(mqtt->listeners[i].control != control) continue;
+        mqtt->listeners[i] = mqtt->listeners[--mqtt->nlisteners];
+        break;
+    }
+    pthread_mutex_unlock(&mqtt->listenmutex);
+}
+
+int mqtt_subscribe(struct mqtt_st * mqtt, const char * topic)
+{
+    int r;
+    if(!mqtt || !topic) return -EINVAL;
+    r = mqtt->transport->subscribe(mqtt, topic, MQTT_LISTEN_QOS);
+    if(r) syslog(LOG_ERR, "Failed to subscribe to %s: %s", topic, strerror(-r));
+    return r;
+}
+
 void mqtt_listen_callback(
     struct mosquitto *mosq, 
     void *obj, 
     const struct mosquitto_message * msg)
 {
-    int r;
-    struct control_st * control = (struct control_st *)obj;
-    struct panel_st panel = PANEL_INITIALIZER;
+    struct mqtt_st * mqtt = (struct mqtt_st *)obj;
 
     //syslog(LOG_DEBUG,"This is the callback of Esther Píscore\n");
 
-    r = accpanel_parse(&panel, msg->payload);
+    mqtt_deliver(mqtt, msg->topic, msg->payload, msg->payloadlen);
+}
 
-    if(r) {
+void mqtt_deliver(
+    struct mqtt_st * mqtt, 
+    const char * topic, 
+    const void * payload, 
+    size_t len)
+{
+    struct control_st * control = NULL;
+
+    pthread_mutex_lock(&mqtt->listenmutex);
+    for(size_t i=0; i<mqtt->nlisteners; i++) {
+        if(strcmp(mqtt->listeners[i].topic, topic) == 0) {
+            control = mqtt->listeners[i].control;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mqtt->listenmutex);
+    if(!control) {
+        if(mqtt->message) mqtt->message(mqtt, topic, payload, len);
+        return;
+    }
+
+    if(control_command(control, payload, len)) {
         syslog(LOG_NOTICE, "Failed to parse MQTT command");
         return;
     }
+    syslog(LOG_DEBUG, "Received a command on %s", topic);
+}
 
-    panel.consumed = false;
-    accpanel_cpy(control->desiredpanel, &panel, true);
-    printf("Received a command!\n");
+static long mqtt_elapsed_ms(
+    const struct timespec * since, 
+    const struct timespec * now)
+{
+    return (now->tv_sec - since->tv_sec) * 1000 + 
+        (now->tv_nsec - since->tv_nsec) / 1000000;
 }
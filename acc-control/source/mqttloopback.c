@@ -0,0 +1,229 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "mqtt.h"
+#include "mqttloopback.h"
+
+static int mqtt_loopback_open(struct mqtt_st * mqtt);
+static void mqtt_loopback_close(struct mqtt_st * mqtt);
+static int mqtt_loopback_connect(struct mqtt_st * mqtt);
+static int mqtt_loopback_disconnect(struct mqtt_st * mqtt);
+static int mqtt_loopback_publish(
+    struct mqtt_st * mqtt,
+    const char * topic,
+    const void * payload,
+    size_t len,
+    int qos,
+    bool retain);
+static int mqtt_loopback_subscribe(
+    struct mqtt_st * mqtt,
+    const char * topic,
+    int qos);
+static int mqtt_loopback_retain(
+    struct mqtt_loopback_st * broker,
+    const char * topic,
+    const void * payload,
+    size_t len);
+
+const struct mqtt_transport_st mqtt_transport_loopback = {
+    .name = "loopback",
+    .open = mqtt_loopback_open,
+    .close = mqtt_loopback_close,
+    .connect = mqtt_loopback_connect,
+    .disconnect = mqtt_loopback_disconnect,
+    .publish = mqtt_loopback_publish,
+    .subscribe = mqtt_loopback_subscribe
+};
+
+int mqtt_loopback_initialize(struct mqtt_loopback_st * broker)
+{
+    if(!broker) return -EINVAL;
+    broker = memset(broker, 0, sizeof(*broker));
+    pthread_mutex_init(&broker->mutex, NULL);
+    return 0;
+}
+
+int mqtt_loopback_finalize(struct mqtt_loopback_st * broker)
+{
+    if(!broker) return -EINVAL;
+    syslog(LOG_INFO, "MQTT loopback: published %lu, delivered %lu",
+        broker->published, broker->delivered);
+    for(size_t i=0; i<broker->nretained; i++) free(broker->retained[i].payload);
+    pthread_mutex_destroy(&broker->mutex);
+    return 0;
+}
+
+bool mqtt_loopback_match(const char * filter, const char * topic)
+{
+    while(*filter) {
+        if(filter[0] == '#') return true;   // the rest of the levels
+        if(filter[0] == '+') {
+            while(*topic && *topic != '/') topic++;
+            filter++;
+            continue;
+        }
+        if(*filter != *topic) {
+            // "a/#" also matches "a"
+            return *topic == '\0' && strcmp(filter, "/#") == 0;
+        }
+        filter++;
+        topic++;
+    }
+    return *topic == '\0';
+}
+
+static int mqtt_loopback_open(struct mqtt_st * mqtt)
+{
+    return mqtt->loopback? 0 : -EINVAL;
+}
+
+static void mqtt_loopback_close(struct mqtt_st * mqtt)
+{
+    struct mqtt_loopback_st * broker = mqtt->loopback;
+    size_t i = 0;
+
+    pthread_mutex_lock(&broker->mutex);
+    while(i < broker->nsubs) {
+        if(broker->subs[i].client == mqtt)
+            broker->subs[i] = broker->subs[--broker->nsubs];
+        else
+            i++;
+    }
+    pthread_mutex_unlock(&broker->mutex);
+    mqtt->connected = false;
+}
+
+static int mqtt_loopback_connect(struct mqtt_st * mqtt)
+{
+    (void)mqtt;
+    return 0;   // it is always there
+}
+
+static int mqtt_loopback_disconnect(struct mqtt_st * mqtt)
+{
+    (void)mqtt;
+    return 0;
+}
+
+static int mqtt_loopback_publish(
+    struct mqtt_st * mqtt,
+    const char * topic,
+    const void * payload,
+    size_t len,
+    int qos,
+    bool retain)
+{
+    int r = 0;
+    struct mqtt_loopback_st * broker = mqtt->loopback;
+    struct mqtt_st * to[MQTT_LOOPBACK_SUBSCRIPTIONS_MAX];
+    size_t n = 0;
+    (void)qos;
+
+    if(strlen(topic) >= MQTT_TOPIC_SIZE) return -ENAMETOOLONG;
+
+    pthread_mutex_lock(&broker->mutex);
+    if(retain) r = mqtt_loopback_retain(broker, topic, payload, len);
+    // Once per client, even if more than one of its subscriptions match
+    for(size_t i=0; i<broker->nsubs; i++) {
+        struct mqtt_loopback_sub_st * s = &broker->subs[i];
+        size_t j;
+        if(!mqtt_loopback_match(s->filter, topic)) continue;
+        for(j=0; j<n && to[j] != s->client; j++);
+        if(j == n) to[n++] = s->client;
+    }
+    broker->published++;
+    broker->delivered += n;
+    pthread_mutex_unlock(&broker->mutex);
+
+    for(size_t i=0; i<n; i++) mqtt_deliver(to[i], topic, payload, len);
+    return r;
+}
+
+static int mqtt_loopback_subscribe(
+    struct mqtt_st * mqtt,
+    const char * topic,
+    int qos)
+{
+    struct mqtt_loopback_st * broker = mqtt->loopback;
+    struct mqtt_loopback_retained_st matched[MQTT_LOOPBACK_RETAINED_MAX];
+    size_t n = 0;
+    (void)qos;
+
+    if(strlen(topic) >= MQTT_TOPIC_SIZE) return -ENAMETOOLONG;
+
+    pthread_mutex_lock(&broker->mutex);
+    if(broker->nsubs >= MQTT_LOOPBACK_SUBSCRIPTIONS_MAX) {
+        pthread_mutex_unlock(&broker->mutex);
+        return -ENOSPC;
+    }
+    strcpy(broker->subs[broker->nsubs].filter, topic);
+    broker->subs[broker->nsubs++].client = mqtt;
+
+    // The retained messages are copied, since they can be replaced as soon
+    // as the lock is let go.
+    for(size_t i=0; i<broker->nretained; i++) {
+        struct mqtt_loopback_retained_st * m = &broker->retained[i];
+        if(!mqtt_loopback_match(topic, m->topic)) continue;
+        matched[n].payload = malloc(m->len);
+        if(!matched[n].payload) continue;
+        memcpy(matched[n].payload, m->payload, m->len);
+        matched[n].len = m->len;
+        strcpy(matched[n++].topic, m->topic);
+    }
+    broker->delivered += n;
+    pthread_mutex_unlock(&broker->mutex);
+
+    for(size_t i=0; i<n; i++) {
+        mqtt_deliver(mqtt, matched[i].topic, matched[i].payload, matched[i].len);
+        free(matched[i].payload);
+    }
+    return 0;
+}
+
+/* Keep @param payload as the retained message of @param topic, or forget it
+ * if it is empty. Must hold the broker mutex.
+ */
+static int mqtt_loopback_retain(
+    struct mqtt_loopback_st * broker,
+    const char * topic,
+    const void * payload,
+    size_t len)
+{
+    struct mqtt_loopback_retained_st * m = NULL;
+    void * copy = NULL;
+    size_t i;
+
+    for(i=0; i<broker->nretained; i++) {
+        if(strcmp(broker->retained[i].topic, topic) == 0) {
+            m = &broker->retained[i];
+            break;
+        }
+    }
+    if(len == 0) {
+        if(m) {
+            free(m->payload);
+            *m = broker->retained[--broker->nretained];
+        }
+        return 0;
+    }
+
+    if(!m) {
+        if(broker->nretained >= MQTT_LOOPBACK_RETAINED_MAX) return -ENOSPC;
+        m = &broker->retained[broker->nretained++];
+        strcpy(m->topic, topic);
+        m->payload = NULL;
+        m->len = 0;
+    }
+    // The panels are all about the same size, so the buffer is reused.
+    if(len > m->len || !m->payload) {
+        copy = realloc(m->payload, len);
+        if(!copy) return -ENOMEM;
+        m->payload = copy;
+    }
+    memcpy(m->payload, payload, len);
+    m->len = len;
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "trace.h"
+
+static const char * trace_stage_names[TRACE_STAGE_ENUMSIZE] = {
+    [TRACE_STAGE_QUEUE] = "queue",
+    [TRACE_STAGE_PRESS] = "press",
+    [TRACE_STAGE_BURST] = "burst",
+    [TRACE_STAGE_CONFIRM] = "confirm",
+    [TRACE_STAGE_TOTAL] = "total",
+};
+
+static uint64_t trace_elapsed_us(
+    const struct timespec * since,
+    const struct timespec * now);
+static size_t trace_hist_index(uint64_t us);
+static uint64_t trace_hist_value(size_t index);
+
+int trace_initialize(struct trace_st * trace)
+{
+    struct timespec now;
+    if(!trace) return -EINVAL;
+    trace = memset(trace, 0, sizeof(*trace));
+    pthread_mutex_init(&trace->mutex, NULL);
+    clock_gettime(CLOCK_REALTIME, &now);
+    // Unique enough across restarts to find a command in the logs.
+    trace->nextid = ((uint64_t)now.tv_sec << 20) ^ (now.tv_nsec >> 10);
+    clock_gettime(CLOCK_MONOTONIC, &trace->windowstart);
+    return 0;
+}
+
+int trace_finalize(struct trace_st * trace)
+{
+    if(!trace) return -EINVAL;
+    pthread_mutex_destroy(&trace->mutex);
+    return 0;
+}
+
+uint64_t trace_received(struct trace_st * trace)
+{
+    uint64_t id;
+    pthread_mutex_lock(&trace->mutex);
+    if(trace->cmd.active) trace->superseded++;
+    memset(&trace->cmd, 0, sizeof(trace->cmd));
+    id = trace->cmd.id = trace->nextid++;
+    trace->cmd.active = true;
+    clock_gettime(CLOCK_MONOTONIC, &trace->cmd.received);
+    pthread_mutex_unlock(&trace->mutex);
+    return id;
+}
+
+void trace_planned(struct trace_st * trace)
+{
+    pthread_mutex_lock(&trace->mutex);
+    if(trace->cmd.active && !trace->cmd.planned) {
+        trace->cmd.planned = true;
+        clock_gettime(CLOCK_MONOTONIC, &trace->cmd.plannedat);
+        trace_hist_record(&trace->hist[TRACE_STAGE_QUEUE],
+            trace_elapsed_us(&trace->cmd.received, &trace->cmd.plannedat));
+    }
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+void trace_press(
+    struct trace_st * trace,
+    const struct timespec * start,
+    const struct timespec * end)
+{
+    pthread_mutex_lock(&trace->mutex);
+    trace_hist_record(&trace->hist[TRACE_STAGE_PRESS],
+        trace_elapsed_us(start, end));
+    if(trace->cmd.active && trace->cmd.planned) {
+        trace->cmd.sent = true;
+        trace->cmd.lastpress = *end;
+    }
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+bool trace_pending(struct trace_st * trace)
+{
+    bool pending;
+    pthread_mutex_lock(&trace->mutex);
+    pending = trace->cmd.active && trace->cmd.planned;
+    pthread_mutex_unlock(&trace->mutex);
+    return pending;
+}
+
+void trace_confirmed(struct trace_st * trace)
+{
+    struct timespec now;
+    struct trace_cmd_st * c = &trace->cmd;
+    uint64_t burst = 0, confirm, total;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&trace->mutex);
+    if(!c->active || !c->planned) {
+        pthread_mutex_unlock(&trace->mutex);
+        return;
+    }
+    if(c->sent) {
+        burst = trace_elapsed_us(&c->plannedat, &c->lastpress);
+        trace_hist_record(&trace->hist[TRACE_STAGE_BURST], burst);
+    }
+    confirm = trace_elapsed_us(c->sent? &c->lastpress : &c->plannedat, &now);
+    total = trace_elapsed_us(&c->received, &now);
+    trace_hist_record(&trace->hist[TRACE_STAGE_CONFIRM], confirm);
+    trace_hist_record(&trace->hist[TRACE_STAGE_TOTAL], total);
+    trace->confirmed++;
+    c->active = false;
+    syslog(LOG_INFO, "trace %016llx: queue %llu us, burst %llu us, "
+        "confirm %llu us, total %llu us", (unsigned long long)c->id,
+        (unsigned long long)trace_elapsed_us(&c->received, &c->plannedat),
+        (unsigned long long)burst, (unsigned long long)confirm,
+        (unsigned long long)total);
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+size_t trace_window(struct trace_st * trace, char * str, size_t n)
+{
+    int r;
+    size_t o;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&trace->mutex);
+    if(trace_elapsed_us(&trace->windowstart, &now) < TRACE_WINDOW_S * 1000000ULL) {
+        pthread_mutex_unlock(&trace->mutex);
+        return 0;
+    }
+
+    r = snprintf(str, n, "{\"window_s\": %d, \"confirmed\": %lu, "
+        "\"superseded\": %lu, \"stages\": {", TRACE_WINDOW_S,
+        trace->confirmed, trace->superseded);
+    if(r < 0 || (size_t)r >= n) goto full;
+    o = r;
+    for(int s = 0; s < TRACE_STAGE_ENUMSIZE; s++) {
+        const struct trace_hist_st * h = &trace->hist[s];
+        r = snprintf(str + o, n - o, "%s\"%s\": {\"count\": %llu, "
+            "\"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, "
+            "\"max_us\": %llu}", s? ", " : "", trace_stage_names[s],
+            (unsigned long long)h->count,
+            (unsigned long long)trace_hist_percentile(h, 50),
+            (unsigned long long)trace_hist_percentile(h, 90),
+            (unsigned long long)trace_hist_percentile(h, 99),
+            (unsigned long long)h->max);
+        if(r < 0 || (size_t)r >= n - o) goto full;
+        o += r;
+    }
+    r = snprintf(str + o, n - o, "}}");
+    if(r < 0 || (size_t)r >= n - o) goto full;
+    o += r;
+    goto reset;
+
+    full:
+    syslog(LOG_ERR, "Trace window does not fit in %zu bytes", n);
+    o = 0;
+
+    reset:
+    memset(trace->hist, 0, sizeof(trace->hist));
+    trace->confirmed = 0;
+    trace->superseded = 0;
+    trace->windowstart = now;
+    pthread_mutex_unlock(&trace->mutex);
+    return o;
+}
+
+void trace_hist_record(struct trace_hist_st * h, uint64_t us)
+{
+    h->counts[trace_hist_index(us)]++;
+    h->count++;
+    if(us > h->max) h->max = us;
+}
+
+uint64_t trace_hist_percentile(const struct trace_hist_st * h, double p)
+{
+    uint64_t seen = 0, rank;
+    if(h->count == 0) return 0;
+    rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    if(rank < 1) rank = 1;
+    for(size_t i = 0; i < TRACE_BUCKETS; i++) {
+        seen += h->counts[i];
+        if(seen >= rank) {
+            uint64_t v = trace_hist_value(i);
+            return v < h->max? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static uint64_t trace_elapsed_us(
+    const struct timespec * since,
+    const struct timespec * now)
+{
+    int64_t us = (int64_t)(now->tv_sec - since->tv_sec) * 1000000 +
+        (now->tv_nsec - since->tv_nsec) / 1000;
+    return us > 0? us : 0;
+}
+
+/* Values below TRACE_SUB_BUCKETS get a bucket each. Above that, every power
+ * of two is split in TRACE_SUB_BUCKETS.
+ */
+static size_t trace_hist_index(uint64_t us)
+{
+    int msb, shift;
+    size_t index;
+    if(us < TRACE_SUB_BUCKETS) return us;
+    msb = 63 - __builtin_clzll(us);
+    shift = msb - TRACE_SUB_BITS;
+    index = (size_t)(shift + 1) * TRACE_SUB_BUCKETS +
+        ((us >> shift) - TRACE_SUB_BUCKETS);
+    return index < TRACE_BUCKETS? index : TRACE_BUCKETS - 1;
+}
+
+/* The highest value that lands in @param index. */
+static uint64_t trace_hist_value(size_t index)
+{
+    int shift;
+    if(index < TRACE_SUB_BUCKETS) return index;
+    shift = index / TRACE_SUB_BUCKETS - 1;
+    return (((uint64_t)TRACE_SUB_BUCKETS + index % TRACE_SUB_BUCKETS + 1)
+        << shift) - 1;
+}
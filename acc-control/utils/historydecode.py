@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# Expand a batch from the ac-cloudifier-history topic into CSV rows.
+# The encoding is described in include/history.h.
+#
+#   mosquitto_sub -t 'ac-cloudifier-history/#' -C 1 > batch.bin
+#   ./historydecode.py batch.bin
+
+import argparse
+import csv
+import struct
+import sys
+
+VERSION = 1
+TAG_RUN = 0x80
+# enum panel_field, in bit order
+FIELDS = ('fan', 'mode', 'delay', 'temperature', 'filterbad')
+
+def varint(data, offset):
+    value = shift = 0
+    while True:
+        b = data[offset]
+        offset += 1
+        value |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return value, offset
+
+def decode(data):
+    version, _, count, timestamp = struct.unpack_from('<BBHQ', data, 0)
+    if version != VERSION:
+        raise ValueError('unsupported history version %d' % version)
+    offset = struct.calcsize('<BBHQ')
+    row = dict.fromkeys(FIELDS, 0)
+    rows = []
+    while len(rows) < count:
+        tag = data[offset]
+        delta, offset = varint(data, offset + 1)
+        if tag & TAG_RUN:
+            n, offset = varint(data, offset)
+            for _ in range(n):
+                timestamp += delta
+                rows.append(dict(row, timestamp=timestamp))
+            continue
+        timestamp += delta
+        for bit, field in enumerate(FIELDS):
+            if tag & (1 << bit):
+                value = data[offset]
+                if field == 'temperature' and value > 127:
+                    value -= 256
+                row[field] = value
+                offset += 1
+        rows.append(dict(row, timestamp=timestamp))
+    return rows
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a panel history batch')
+    parser.add_argument('batch', nargs='?', help='batch file, stdin by default')
+    args = parser.parse_args()
+    if args.batch:
+        with open(args.batch, 'rb') as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    writer = csv.DictWriter(sys.stdout, fieldnames=('timestamp',) + FIELDS)
+    writer.writeheader()
+    writer.writerows(decode(data))
+
+if __name__ == '__main__':
+    main()
@@ -2,98 +2,267 @@ import cv2
 import numpy as np
 import json
 import socket
+import struct
+import time
+import zlib
 from typing import Optional
 from dataclasses import dataclass
 from enum import Enum
 from collections import namedtuple
 
-class AccImage:
-    def __init__ (self, srcimg: cv2.Mat):
-        self.src = srcimg
-        self._magicmarkers = (100, 101, 102, 103) 
-        # These are the codes stuck to the AC unit, clockwise from top left
+# Finds the markers stuck to the AC unit in the frames of a camera that is
+# bolted in place. The detector is made once. Once all four markers are
+# found, later frames only look for them in small windows around where they
+# were, and the perspective transform is kept while they stay within
+# tolerance pixels of it. One marker can go missing for a while (glare, a
+# hand) as long as the other three have not moved. Every verifyevery frames
+# the whole frame is searched again, downscaled by verifyscale, in case the
+# camera was knocked. The whole frame is only searched at full size when all
+# that fails.
+class AccMarkerTracker:
+    MAGICMARKERS = (100, 101, 102, 103)
+    # These are the codes stuck to the AC unit, clockwise from top left
+    NORMSIZE = (530, 1150)
+    # After the transform, one pixel = 0.1mm
 
-    def _detectMarkers(self):
-        # Aruco detection
-        magicmarkers = (100, 101, 102, 103) # markers in OpenCV clockwise order
-        dict = cv2.aruco.getPredefinedDictionary(cv2.aruco.DICT_4X4_250)
+    def __init__(self, 
+                 window: int = 24, 
+                 tolerance: float = 3.0, 
+                 verifyevery: int = 300,
+                 verifyscale: float = 0.5):
+        dictionary = cv2.aruco.getPredefinedDictionary(cv2.aruco.DICT_4X4_250)
         detectorparams = cv2.aruco.DetectorParameters()
-        detector = cv2.aruco.ArucoDetector(dict, detectorparams)
+        self._detector = cv2.aruco.ArucoDetector(dictionary, detectorparams)
+        self.window = window            # pixels around the last corners
+        self.tolerance = tolerance
+        self.verifyevery = verifyevery
+        self.verifyscale = verifyscale
+        self.fullsearches = 0
+        self.verifications = 0
+        self.reset()
+
+    # Forget where the markers were. The next frame is searched whole.
+    def reset(self):
+        self._corners = {}
+        self._transform = None
+        self._frames = 0
+
+    # @returns the corners of the markers found in image, as 4x2 arrays by
+    # marker code, in the coordinates of the image before it was scaled
+    # down by scale and cropped at offset.
+    def _detect(self, image: cv2.Mat, scale: float = 1.0, offset=(0, 0)):
+        (cornersarray, idarray, rejected) = self._detector.detectMarkers(image)
+        found = {}
+        if idarray is not None:
+            for n, id in enumerate(idarray.ravel()):
+                if id in self.MAGICMARKERS:
+                    found[int(id)] = cornersarray[n][0] / scale + offset
+        return found
+
+    # Search around each of the last corners only.
+    def _detectWindows(self, src: cv2.Mat, corners: dict):
+        found = {}
+        height, width = src.shape[0:2]
+        for id, last in corners.items():
+            sx, sy = np.maximum(last.min(axis=0).astype(int) - self.window, 0)
+            fx, fy = last.max(axis=0).astype(int) + self.window
+            fx, fy = min(fx, width), min(fy, height)
+            marker = self._detect(src[sy:fy, sx:fx], offset=(sx, sy))
+            if id in marker:
+                found[id] = marker[id]
+        return found
+
+    # Search downscaled, then at full size around what was found, which is
+    # as precise as searching the whole frame at full size.
+    def _detectScaled(self, src: cv2.Mat):
+        scale = self.verifyscale
+        small = cv2.resize(src, None, fx=scale, fy=scale, 
+                           interpolation=cv2.INTER_AREA)
+        found = self._detect(small, scale)
+        if len(found) == 4:
+            found = self._detectWindows(src, found)
+        return found
+
+    def _search(self, src: cv2.Mat):
+        self.fullsearches = self.fullsearches + 1
+        found = self._detectScaled(src)
+        if len(found) != 4:
+            found = self._detect(src)
+        if len(found) != 4:
+            print('Could not find all aruco markers! Found:')
+            print(found.keys())
+            return {}
+        print('Found all aruco markers. Found:')
+        print(found.keys())
+        return found
+
+    def _moved(self, corners: dict) -> bool:
+        for id, found in corners.items():
+            last = self._corners.get(id)
+            if last is None or np.abs(found - last).max() > self.tolerance:
+                return True
+        return False
 
-        (cornersarray, idarray, rejectedImgPointsarray) = \
-            detector.detectMarkers(self._src)
-        self._markers = (cornersarray, idarray, rejectedImgPointsarray)
-        
+    def locate(self, src: cv2.Mat):
+        """ Find the markers in src. @returns the perspective transform
+            from src to the normalized panel, or None if any marker is
+            missing.
+        """
+        found = {}
+        if len(self._corners) == 4:
+            self._frames = self._frames + 1
+            found = self._detectWindows(src, self._corners)
+            if len(found) == 3 and not self._moved(found):
+                return self._transform
+            if len(found) == 4 and self._frames >= self.verifyevery:
+                self._frames = 0
+                self.verifications = self.verifications + 1
+                verified = self._detectScaled(src)
+                if len(verified) == 4 and self._moved(verified):
+                    found = verified
+        if len(found) != 4:
+            self.reset()
+            found = self._search(src)
+            if len(found) != 4:
+                return None
+        if self._transform is None or self._moved(found):
+            self._corners = found
+            self._transform = self._getTransform(found)
+        return self._transform
+
+    def _getTransform(self, corners: dict):
+        m = self.MAGICMARKERS
+        points1 = np.float32([
+            corners[m[0]][0],
+            corners[m[1]][1],
+            corners[m[2]][2],
+            corners[m[3]][3],
+            ])
+        width, height = self.NORMSIZE
+        points2 = np.float32([
+            [0,0],
+            [width,0],
+            [width,height],
+            [0,height]])
+        return cv2.getPerspectiveTransform(points1, points2)
+
+    def getCorners(self):
+        return self._corners
+    def getTransform(self):
+        return self._transform
+    corners = property(fget=getCorners)
+    transform = property(fget=getTransform)
+
+# Tells whether anything on the panel changed since the last time it was
+# parsed, by sampling the feature rectangles at a low scale straight out of
+# the camera frame, with the transform that was last found. The panel is
+# taken as unchanged while no feature's average colour moved by more than
+# threshold levels, for at most forceevery seconds. The frames are compared
+# with the last one committed, which is only done once it was parsed: a frame
+# that is dropped before it gets parsed does not hide the change it shows.
+class AccChangeGate:
+    def __init__(self, 
+                 threshold: float = 6, 
+                 forceevery: float = 5.0,
+                 scale: float = 0.25):
+        self._extractor = FeatureExtractor(scale=scale, hsv=False)
+        self.threshold = threshold
+        self.forceevery = forceevery
+        self._parsed = None     # (sample, time) of the last parsed frame
+        self.unchangedframes = 0
+
+    def sample(self, frame: cv2.Mat, transform: np.ndarray) -> np.ndarray:
+        """ frame is the camera frame before AccImage rotates it, and
+            transform is the one of the rotated frame, as the tracker
+            gives it. @returns what unchanged() and commit() take, or None
+            if the gate is off or there is no transform yet.
+        """
+        if transform is None or self.threshold <= 0:
+            return None
+        return self._extractor.extractWarped(
+            frame, transform @ AccImage.rotation(frame.shape)).astype(np.int16)
+
+    def unchanged(self, sample: np.ndarray) -> bool:
+        """ @returns False if the frame of sample has to be parsed. """
+        parsed = self._parsed
+        if sample is None or parsed is None:
+            return False
+        last, lastparse = parsed
+        if (time.monotonic() - lastparse < self.forceevery and
+            np.abs(sample - last).max() <= self.threshold):
+            self.unchangedframes = self.unchangedframes + 1
+            return True
+        return False
 
-    def _detectCorners(self):
-        (cornersarray, idarray, rejectedImgPointsarray) = self._markers        
-        fourcorners = {}
-        if idarray is not None:
-            for n,id in enumerate(idarray):
-                for m in self._magicmarkers:
-                    if(id == m):
-                        fourcorners[m] = cornersarray[n]
-            if len(fourcorners) != 4:
-                print('Could not find all aruco markers! Found:')
-                print(fourcorners.keys())
-                self._corners = {}
-                return
-            print('Found all aruco markers. Found:')
-            print(fourcorners.keys())
-            self._corners = fourcorners
-        else:
-            print('Could not find aruco')
-            self._corners = {}
+    def commit(self, sample: np.ndarray):
+        """ The frame of sample was parsed: compares the next frames with
+            this one. May be called from another thread than unchanged().
+        """
+        if sample is not None:
+            self._parsed = (sample, time.monotonic())
+
+class AccImage:
+    """ Pass the same tracker for every frame of a camera, so the markers
+        are not searched for from scratch each time. The panel is only
+        warped whole when norm is asked for. AccPanelParser only needs the
+        transform.
+    """
+    def __init__ (self, srcimg: cv2.Mat, tracker: AccMarkerTracker = None):
+        self.src = srcimg
+        if tracker is None:
+            tracker = AccMarkerTracker()
+        self._tracker = tracker
+
+    def _locate(self):
+        self._transform = self._tracker.locate(self._src)
+        self._transformIsProcessed = True
 
     def _normalizePerspective(self):
         # Perspective transformation
-        if len(self._corners) == 4:
-            points1 = np.float32([
-                self._corners[self._magicmarkers[0]][0][0],
-                self._corners[self._magicmarkers[1]][0][1],
-                self._corners[self._magicmarkers[2]][0][2],
-                self._corners[self._magicmarkers[3]][0][3],
-                ])
-            points2 = np.float32([
-                [0,0],
-                [530,0],
-                [530,1150],
-                [0,1150]])
-            dimensions = (530,1150)
-            # After the transform, one pixel = 0.1mm
-            ap1 = points1#[0:3]
-            ap2 = points2#[0:3]
-            M = cv2.getPerspectiveTransform(ap1, ap2)
-            rows,cols,ch = self._src.shape
-            normalized = cv2.warpPerspective(self._src, M, (dimensions))
-            self._norm = normalized
+        M = self.transform
+        if M is not None:
+            self._norm = cv2.warpPerspective(self._src, M, 
+                                             AccMarkerTracker.NORMSIZE)
         else:
             self._norm = None
 
     def _processNorm(self):
-        self._detectMarkers()
-        self._detectCorners()
         self._normalizePerspective()
 
     def _setsrc(self, srcimg):
         self._src = cv2.rotate(srcimg, cv2.ROTATE_90_CLOCKWISE)
         self._normIsProcessed = False
+        self._transformIsProcessed = False
     
     def _getsrc(self):
         return self._src
     
+    def _gettransform(self):
+        if not self._transformIsProcessed:
+            self._locate()
+        return self._transform
+
     def _getnorm(self):
         if not self._normIsProcessed:
             self._processNorm()
             self._normIsProcessed = True
         return self._norm
 
+    # @returns the transform from a frame of @param shape to the same frame
+    # rotated by AccImage.
+    @staticmethod
+    def rotation(shape) -> np.ndarray:
+        return np.array([[0, -1, shape[0] - 1],
+                         [1,  0, 0],
+                         [0,  0, 1]], dtype=np.float64)
+
     @classmethod
     def getnorm(srcimg: cv2.Mat):
         ai = AccImage(srcimg)
         return ai.norm
 
     src = property(fget=_getsrc, fset=_setsrc)
+    transform = property(fget=_gettransform)
     norm = property(fget=_getnorm)
 
 @dataclass 
@@ -121,13 +290,31 @@ class FeatureValueTriad:
 class FeatureThreshold(FeatureValueTriad):
     def evaluate(self, triad: FeatureValueTriad) -> bool:
         return triad.val > self.val
+    # How far triad is from evaluating the other way.
+    def margin(self, triad: FeatureValueTriad) -> int:
+        return abs(int(triad.val) - int(self.val))
 
+# A segment is lit if its hue is within huebelow under and hueabove over hue,
+# and its value is over val.
+@dataclass
 class SevenThreshold(FeatureThreshold): 
+    huebelow: int = 30
+    hueabove: int = 20
     def evaluate(self, triad: FeatureValueTriad) -> bool:
-        if (self.hue - 30) <= triad.hue <= (self.hue + 20):
+        if (self.hue - self.huebelow) <= triad.hue <= (self.hue + self.hueabove):
             if triad.val > self.val:
                 return True
         return False
+    # Inside the hue window, the distance to its nearer edge, and outside of
+    # it, minus the distance to it. Lit needs both that and the value over.
+    def margin(self, triad: FeatureValueTriad) -> int:
+        hue = int(triad.hue)
+        inside = min(hue - (self.hue - self.huebelow),
+                     (self.hue + self.hueabove) - hue)
+        over = int(triad.val) - int(self.val)
+        if inside >= 0 and over > 0:
+            return min(inside, over)
+        return max(-inside, -over)
 
 
 @dataclass
@@ -212,6 +399,148 @@ class FeatureParser:
     avgSat = property(fget=getAvgSat)
     avgVal = property(fget=getAvgVal)
 
+# Average HSV of every feature at once. The pixels of all the rectangles are
+# gathered into one strip, so only their union is converted to HSV, and the
+# sums of every rectangle come out of one pass over it (a one dimensional
+# integral image). The results are a dense array, one row per feature in the
+# order of the dictionary, that the parser, the drawing helpers and the tools
+# can share.
+#
+# extractWarped does the same straight from the camera frame: it remaps only
+# the pixels of the rectangles out of it, instead of warping the whole panel.
+# scale is how many samples it takes per normalized pixel in each direction.
+class FeatureExtractor:
+    def __init__(self, 
+                 features: dict = None, 
+                 scale: float = 1.0, 
+                 hsv: bool = True):
+        if features is None:
+            features = AccKeyFeatures.FeatureDict
+        self.hsv = hsv                  # False to average in BGR
+        self._names = list(features.keys())
+        self._features = list(features.values())
+        self._index = {name: i for i, name in enumerate(self._names)}
+        self._shape = None
+        self.scale = scale
+        self._transform = None
+
+    # Flat indexes of the pixels of every rectangle, row by row, and where
+    # each rectangle starts. They depend on the width of the image only.
+    def _prepare(self, shape):
+        height, width = shape[0:2]
+        pixels = []
+        starts = []
+        areas = []
+        n = 0
+        for feature in self._features:
+            sx, sy = feature.start_point
+            fx, fy = feature.end_point
+            sx, fx = max(sx, 0), min(fx, width)
+            sy, fy = max(sy, 0), min(fy, height)
+            ys, xs = np.mgrid[sy:fy, sx:fx]
+            pixels.append((ys * width + xs).ravel())
+            starts.append(n)
+            areas.append(max((fx - sx) * (fy - sy), 1))
+            n = n + pixels[-1].size
+        self._pixels = np.concatenate(pixels)
+        self._starts = np.array(starts, dtype=np.intp)
+        self._areas = np.array(areas, dtype=np.int64)[:, None]
+        self._shape = shape
+
+    # Where the samples of every rectangle are in the camera frame, packed
+    # the same way. They depend on the transform and the scale only.
+    def _prepareWarp(self, transform: np.ndarray):
+        points = []
+        starts = []
+        areas = []
+        n = 0
+        for feature in self._features:
+            sx, sy = feature.start_point
+            fx, fy = feature.end_point
+            # Sample at the centre of every 1/scale pixels. At scale 1 these
+            # are the pixels warpPerspective would give.
+            nx = max(int(round((fx - sx) * self.scale)), 1)
+            ny = max(int(round((fy - sy) * self.scale)), 1)
+            xs = sx + (np.arange(nx) + 0.5) * (fx - sx) / nx - 0.5
+            ys = sy + (np.arange(ny) + 0.5) * (fy - sy) / ny - 0.5
+            gx, gy = np.meshgrid(xs, ys)
+            points.append(np.stack((gx.ravel(), gy.ravel()), axis=-1))
+            starts.append(n)
+            areas.append(nx * ny)
+            n = n + nx * ny
+        points = np.concatenate(points).reshape(-1, 1, 2).astype(np.float32)
+        mapped = cv2.perspectiveTransform(points, np.linalg.inv(transform))
+        self._map1, self._map2 = cv2.convertMaps(
+            mapped[..., 0], mapped[..., 1], cv2.CV_16SC2)
+        self._warpstarts = np.array(starts, dtype=np.intp)
+        self._warpareas = np.array(areas, dtype=np.int64)[:, None]
+        self._warpscale = self.scale
+        self._transform = transform.copy()
+
+    def _reduce(self, strip: np.ndarray, starts, areas) -> np.ndarray:
+        sums = np.add.reduceat(strip.reshape(-1, 3), starts, axis=0, 
+                               dtype=np.int64)
+        return (sums // areas).astype(np.uint8)
+
+    # The steps of extractWarped, apart so they can be timed apart.
+    def warpStrip(self, src: cv2.Mat, transform: np.ndarray) -> np.ndarray:
+        if (self._transform is None or self._warpscale != self.scale or 
+            not np.array_equal(transform, self._transform)):
+            self._prepareWarp(transform)
+        return cv2.remap(src, self._map1, self._map2, cv2.INTER_LINEAR)
+    def convertStrip(self, strip: np.ndarray) -> np.ndarray:
+        if self.hsv:
+            strip = cv2.cvtColor(strip, cv2.COLOR_BGR2HSV)
+        return strip
+    def reduceWarped(self, strip: np.ndarray) -> np.ndarray:
+        return self._reduce(strip, self._warpstarts, self._warpareas)
+
+    def extract(self, image: cv2.Mat) -> np.ndarray:
+        """ Returns the average HSV of every feature, as an (n, 3) uint8
+            array. Averages are truncated, like FeatureParser.avgHSV.
+        """
+        if image.shape != self._shape:
+            self._prepare(image.shape)
+        strip = image.reshape(-1, 3)[self._pixels].reshape(-1, 1, 3)
+        return self._reduce(self.convertStrip(strip), self._starts, self._areas)
+
+    def extractWarped(self, src: cv2.Mat, transform: np.ndarray) -> np.ndarray:
+        """ The same as extract(cv2.warpPerspective(src, transform, ...)),
+            from the rectangles only.
+        """
+        strip = self.warpStrip(src, transform)
+        return self.reduceWarped(self.convertStrip(strip))
+
+    # Truth value of every feature, from the averages that extract returned.
+    # Features without a threshold are False.
+    def evaluate(self, means: np.ndarray) -> np.ndarray:
+        truths = np.zeros(len(self._features), dtype=bool)
+        for i, feature in enumerate(self._features):
+            if feature.threshold is not None:
+                truths[i] = feature.threshold.evaluate(
+                    FeatureValueTriad(*means[i]))
+        return truths
+
+    # How far every feature is from its threshold, from the same averages.
+    # Features without a threshold are 255, as sure as can be.
+    def margins(self, means: np.ndarray) -> np.ndarray:
+        margins = np.full(len(self._features), 255, dtype=np.int32)
+        for i, feature in enumerate(self._features):
+            if feature.threshold is not None:
+                margins[i] = feature.threshold.margin(
+                    FeatureValueTriad(*means[i]))
+        return np.minimum(margins, 255)
+
+    def index(self, name: str) -> int:
+        return self._index[name]
+
+    def getNames(self):
+        return self._names
+    def getFeatures(self):
+        return self._features
+    names = property(fget=getNames)
+    features = property(fget=getFeatures)
+
 # Data structure containing the constants specific to the GE air conditioner
 @dataclass
 class AccKeyFeatures:
@@ -235,6 +564,23 @@ class AccKeyFeatures:
     ledThreshold = FeatureThreshold(val = 130)
     sevenThreshold = SevenThreshold(hue=60, val=80)
 
+    @classmethod
+    def loadThresholds(cls, path: str):
+        """ Replace ledThreshold and sevenThreshold with the ones in the JSON
+            file at path, as utils/hostside/tunethresholds.py writes it:
+            {"led": {"val": ...}, "seven": {"hue": ..., "val": ...,
+            "huebelow": ..., "hueabove": ...}}. Missing values are kept.
+            Every feature shares these two, so it changes them all.
+        """
+        with open(path) as f:
+            thresholds = json.load(f)
+        for name, threshold in (('led', cls.ledThreshold), 
+                                ('seven', cls.sevenThreshold)):
+            for key, value in thresholds.get(name, {}).items():
+                if not hasattr(threshold, key):
+                    raise ValueError(f'{path}: unknown threshold {name}.{key}')
+                setattr(threshold, key, int(value))
+
     FanAuto  = Feature(size=ledSize, location=FeatureCoords(x=43, y=593), threshold=ledThreshold)
     FanHigh  = Feature(size=ledSize, location=FeatureCoords(x=43, y=665), threshold=ledThreshold)
     FanMed   = Feature(size=ledSize, location=FeatureCoords(x=43, y=734), threshold=ledThreshold)
@@ -354,6 +700,15 @@ class AccParsedPanel:
         self.msdigit   = msdigit
         self.lsdigit   = lsdigit
         self.filterbad = filterbad
+        # How sure the parse was of fan, mode, delay, the temperature and
+        # filterbad, as AccPanelParser.fieldMargins works them out.
+        self.margins   = (0, 0, 0, 0, 0)
+
+    def copy(self):
+        panel = AccParsedPanel(self.fan, self.mode, self.delay,
+                               self.msdigit, self.lsdigit, self.filterbad)
+        panel.margins = self.margins
+        return panel
 
     def __repr__(self):
         return f'AccParsedPanel({repr(self.fan.value)},{repr(self.mode.value)},{repr(self.delay.value)},{self.msdigit},{self.lsdigit},{self.filterbad})'
@@ -371,25 +726,109 @@ class AccParsedPanel:
         d = self.__dict__()
         return json.dumps(d)
 
+# Binary panel frame understood by acc-control. See accpanel.h for the layout.
+class AccPanelFrame:
+    MAGIC       = 0x50434341    # "ACCP"
+    CAPSMAGIC   = 0x43434341    # "ACCC"
+    VERSION     = 2
+    FLAG_UNCHANGED = 0x01       # resent without parsing the panel again
+    _body       = struct.Struct('<IBBHIQBBBbbBH')
+    _margins    = struct.Struct('<5B3x')        # from version 2 on
+    _crc        = struct.Struct('<I')
+    _caps       = struct.Struct('<IB3x')
+    SIZES       = {1: _body.size + _crc.size,
+                   2: _body.size + _margins.size + _crc.size}
+
+    @classmethod
+    def encode(cls, panel: AccParsedPanel, seq: int, timestamp: float,
+               flags: int = 0, version: int = VERSION) -> bytes:
+        body = cls._body.pack(
+            cls.MAGIC, version, flags, cls.SIZES[version],
+            seq & 0xFFFFFFFF, int(timestamp * 1e6),
+            panel.fan.value, panel.mode.value, panel.delay.value,
+            panel.msdigit, panel.lsdigit, int(panel.filterbad), 0)
+        if version >= 2:
+            body = body + cls._margins.pack(*panel.margins)
+        return body + cls._crc.pack(zlib.crc32(body))
+
+    # Returns the highest frame version advertised by acc-control, or None.
+    @classmethod
+    def decodeCaps(cls, data: bytes) -> Optional[int]:
+        if len(data) != cls._caps.size:
+            return None
+        magic, version = cls._caps.unpack(data)
+        return version if magic == cls.CAPSMAGIC else None
+
 # Determines the state of the AC panel
 class AccPanelParser:
+    """ The wireformat can be 'json', 'binary' or 'auto'. 'auto' sends JSON
+        until acc-control advertises that it understands binary frames.
+
+        The sourceImage can be an AccImage, in which case only the feature
+        rectangles are warped out of it, with scale samples per normalized
+        pixel, or an image that is already normalized.
+
+        thresholds is a file for AccKeyFeatures.loadThresholds, if the
+        hand-picked ones are not to be used.
+    """
     def __init__(self, 
                  sourceImage: AccImage,
-                 keyfeatures: AccKeyFeatures = AccKeyFeatures()):
+                 keyfeatures: AccKeyFeatures = AccKeyFeatures(),
+                 wireformat: str = 'auto',
+                 scale: float = 1.0,
+                 thresholds: str = None):
         self._panel = AccParsedPanel()
         self._keyfeatures = keyfeatures
-        self._parser = FeatureParser(sourceImage=sourceImage)
+        if thresholds is not None:
+            keyfeatures.loadThresholds(thresholds)
+        self._image = sourceImage
+        self._scale = scale
+        self._extractor = None          # made on the first parse
+        self._means = None
+        self._truths = None
         self._socketfam = socket.AF_INET
         self._socketpath = 'localhost'    # UNIX socket path, or IP address
         self._socketport = 64000
+        self._wireformat = wireformat
+        self._binary = (wireformat == 'binary')
+        self._frameversion = AccPanelFrame.VERSION  # lowered by _negotiate
+        self._seq = 0
+
+    def getSourceImage(self):
+        return self._image
+    def setSourceImage(self, sourceImage: cv2.Mat = None):
+        self._image = sourceImage
+    def getExtractor(self):
+        if self._extractor is None:
+            self._extractor = FeatureExtractor(self._keyfeatures.FeatureDict,
+                                               self._scale)
+        return self._extractor
+    # What the last parse saw, in the order of extractor.names, so the
+    # drawing helpers don't have to work it out again.
+    def getMeans(self):
+        return self._means
+    def getTruths(self):
+        return self._truths
+    sourceImage = property(fget=getSourceImage, fset=setSourceImage)
+    extractor = property(fget=getExtractor)
+    means = property(fget=getMeans)
+    truths = property(fget=getTruths)
 
     def parse(self):
-        featureVals = {}
-        for key, feature in self._keyfeatures.FeatureDict.items():
-            self._parser.feature = feature
-            featureVals[key] = self._parser.evaluateThreshold()
-        
-        fv = featureVals
+        extractor = self.extractor
+        if isinstance(self._image, AccImage):
+            self._means = extractor.extractWarped(self._image.src, 
+                                                  self._image.transform)
+        else:
+            self._means = extractor.extract(self._image)
+        self._truths = extractor.evaluate(self._means)
+        self.decode(self._truths)
+        self._panel.margins = self.fieldMargins(extractor.margins(self._means))
+
+    # Work out the panel from the truth value of every feature, in the order
+    # of extractor.names.
+    def decode(self, truths: np.ndarray):
+        fv = dict(zip(self.extractor.names, truths.tolist()))
         msd = SevenSegment(fv['MSDA'], fv['MSDB'], fv['MSDC'], fv['MSDD'], 
                            fv['MSDE'], fv['MSDF'], fv['MSDG'])
         lsd = SevenSegment(fv['LSDA'], fv['LSDB'], fv['LSDC'], fv['LSDD'], 
@@ -406,15 +845,59 @@ class AccPanelParser:
         self._panel.delay = AccPanelDelay(self._rowdecode(delay))
         self._panel.filterbad = self._filterdecode(filterbad)
 
-    def transmit(self):
+    # The smallest margin of the features of every field, in the order of
+    # AccParsedPanel.margins, from margins in the order of extractor.names.
+    def fieldMargins(self, margins: np.ndarray) -> tuple:
+        fm = dict(zip(self.extractor.names, margins.tolist()))
+        fields = (('FanAuto', 'FanHigh', 'FanMed', 'FanLow'),
+                  ('ModeCool', 'ModeFan', 'ModeEco'),
+                  ('DelayOn', 'DelayOff'),
+                  tuple(d + s for d in ('MSD', 'LSD') for s in 'ABCDEFG'),
+                  ('Filter',))
+        return tuple(min(fm[name] for name in names) for names in fields)
+
+    # Send what the last parse() saw, or @param panel if it is not None.
+    # @param unchanged marks a panel that is sent again without a parse.
+    def transmit(self, 
+                 timestamp: Optional[float] = None, 
+                 panel: Optional[AccParsedPanel] = None,
+                 unchanged: bool = False):
         try:
             self._socket
         except AttributeError:
             self._socket = socket.socket(self._socketfam, socket.SOCK_DGRAM)
-        self.parse()
-        self._socket.sendto(
-            bytes(str(self._panel), 'utf-8') + b'\x00', 
-            (self._socketpath, self._socketport))
+            self._socket.setblocking(False)
+        if panel is None:
+            panel = self._panel
+        if self._wireformat == 'auto' and not self._binary:
+            self._negotiate()
+        if self._binary:
+            if timestamp is None:
+                timestamp = time.time()
+            flags = AccPanelFrame.FLAG_UNCHANGED if unchanged else 0
+            data = AccPanelFrame.encode(panel, self._seq, timestamp, flags,
+                                        self._frameversion)
+        else:
+            d = panel.__dict__()
+            if unchanged:
+                d['unchanged'] = 1
+            data = bytes(json.dumps(d), 'utf-8') + b'\x00'
+        self._seq = self._seq + 1
+        self._socket.sendto(data, (self._socketpath, self._socketport))
+
+    # Switch to binary frames if acc-control said it can read them.
+    def _negotiate(self):
+        while True:
+            try:
+                data = self._socket.recv(64)
+            except (BlockingIOError, ConnectionRefusedError):
+                return
+            version = AccPanelFrame.decodeCaps(data)
+            if version is not None and version >= 1:
+                print('acc-control understands binary frames, switching.')
+                self._binary = True
+                self._frameversion = min(version, AccPanelFrame.VERSION)
+                return
     
     def _sevendecode(self, s: SevenSegment) -> int:
         encdict = {
@@ -39,6 +39,7 @@ class FakePanelParser(AccPanelParser):
 def main() -> int:
     fakeparser = FakePanelParser(None, None)
     while(1):
+        fakeparser.parse()
         print(str(fakeparser._panel))
         fakeparser.transmit()
         time.sleep(1)
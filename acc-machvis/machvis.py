@@ -1,7 +1,11 @@
 #!/usr/bin/env python3
 
 import sys
+import argparse
 import threading
+import queue
+import multiprocessing
+from multiprocessing import shared_memory
 import cv2
 import time
 import numpy as np
@@ -12,13 +16,24 @@ try:
 except ImportError:
     pigpio = None
 
+# The connection to pigpiod is opened once, and the LEDs are only written
+# when the status changes.
+ledpi = None
+ledokay = None
+
 def setledstatus(okay: bool):
+    global ledpi, ledokay
     ledblue = 23
     ledred  = 22
     ledon  = 0
     ledoff = 1
-    if pigpio is not None:
-        pi = pigpio.pi()
+    if pigpio is not None and okay != ledokay:
+        if ledpi is None or not ledpi.connected:
+            ledpi = pigpio.pi()
+            if not ledpi.connected:
+                return
+        ledokay = okay
+        pi = ledpi
         if okay:
             pi.write(ledred, ledoff)
             pi.write(ledblue, ledoff)
@@ -29,6 +44,10 @@ def setledstatus(okay: bool):
 
 # This class was based on content at https://stackoverflow.com/a/69141497
 # with modifications to average the last n frames.
+#
+# The reader thread decodes every frame as it comes, and keeps the last
+# nframes in a ring together with their sum, so read() never waits for the
+# camera: it returns the average of what is there.
 
 class AccCapture:
     def __init__(self, name, backend=None, nframes=15):
@@ -43,17 +62,21 @@ class AccCapture:
         self._name = name
         self._backend = backend
         self.nframes = nframes
-        self.frame = []
-        self.lock = threading.Lock()
+        self._ring = []             # the last nframes frames, oldest first
+        self._sum = None            # float32 sum of the ring
+        self._count = 0             # frames decoded so far
+        self._timestamp = None      # when the last one was
+        self._avg = None            # average of the ring at _avgcount
+        self._avgcount = 0
+        self.lock = threading.Condition()
         self.t = threading.Thread(target=self._reader)
         self.t.daemon = True
         self.t.start()
-    # grab frames as soon as they are available
+    # decode frames as soon as they are available
     def _reader(self):
         fc = 0
         while True:
-            with self.lock:
-                ret = self.cap.grab()
+            ret, frame = self.cap.read()
             if not ret:
                 print("Failed to grab a frame!")
                 time.sleep(1/self.nframes)
@@ -62,6 +85,7 @@ class AccCapture:
                     continue
                 else:
                     print("Automatically restarting video capture")
+                    fc = 0
                     with self.lock:
                         self.cap.release()
                         if self._backend is None:
@@ -69,24 +93,38 @@ class AccCapture:
                         else:
                             self.cap = cv2.VideoCapture(
                                 self._name, self._backend)
-    # retrieve the latest frame and the nframes-1 that come after.
-    def read(self):
-        with self.lock:
-            ret, frame = self.cap.retrieve()
-            if ret == False:
-                return [False, None]
-            acc = np.zeros_like(frame, dtype=np.float32) # empty Mat for average
-            cv2.accumulate(frame, acc)
-            j = 1
-            for i in range (2, self.nframes):
-                ret, frame = self.cap.read()
-                if ret == False:
-                    print("Failed to grab a frame!")
                     continue
-                cv2.accumulate(frame, acc)
-                j = j+1
-            avgframe = cv2.convertScaleAbs(acc / j)
-            return [True, avgframe]
+            fc = 0
+            self._add(frame, time.time())
+    def _add(self, frame, timestamp):
+        with self.lock:
+            if self._sum is None or self._sum.shape != frame.shape:
+                self._ring = []
+                self._sum = np.zeros(frame.shape, dtype=np.float32)
+            # The frames are whole numbers, so the sum stays exact.
+            while len(self._ring) >= self.nframes:
+                cv2.subtract(self._sum, self._ring.pop(0), dst=self._sum, 
+                             dtype=cv2.CV_32F)
+            cv2.accumulate(frame, self._sum)
+            self._ring.append(frame)
+            self._count = self._count + 1
+            self._timestamp = timestamp
+            self.lock.notify_all()
+    # @returns the average of the last nframes frames, when the newest of
+    # them was decoded, and how many frames were decoded until then, which
+    # tells whether the average is a new one. With @param newer, waits up to
+    # @param timeout seconds for more than that many frames.
+    def read(self, newer: int = None, timeout: float = 1.0):
+        with self.lock:
+            if newer is not None:
+                self.lock.wait_for(lambda: self._count > newer, timeout)
+            if not self._ring:
+                return [False, None, None, 0]
+            if self._avgcount != self._count:
+                self._avg = cv2.convertScaleAbs(self._sum, 
+                                                alpha=1/len(self._ring))
+                self._avgcount = self._count
+            return [True, self._avg, self._timestamp, self._count]
     def isOpened(self):
         with self.lock:
             return self.cap.isOpened()
@@ -99,14 +137,18 @@ def drawRectangles(frame: cv2.Mat):
         cv2.rectangle(frame, feature.start_point, feature.end_point, color, 1)
     return frame
 
-def drawHSVText(frame: cv2.Mat):
-    parser = FeatureParser(sourceImage=frame)
-    for key,feature in AccKeyFeatures.FeatureDict.items():
+# The text helpers take what the parser saw, since the drawing alters the
+# frame. Without it, they work it out from the frame.
+extractor = FeatureExtractor()
+
+def drawHSVText(frame: cv2.Mat, means: np.ndarray = None):
+    if means is None:
+        means = extractor.extract(frame)
+    for i, (key,feature) in enumerate(AccKeyFeatures.FeatureDict.items()):
         color = (0,0,255)
         font = cv2.FONT_HERSHEY_SIMPLEX
         scale = 0.2
-        parser.feature = feature
-        text = str(parser.avgHSV)
+        text = str(means[i])
         position = (feature.end_point[0] + 0, feature.end_point[1] + 0)
         if(any( x == key for x in ['MSDE', 'MSDF', 'LSDE', 'LSDF'])):
             position = (feature.end_point[0] + 0, feature.end_point[1] - 7)
@@ -114,14 +156,14 @@ def drawHSVText(frame: cv2.Mat):
                     font, scale, color, 1, cv2.LINE_AA)
     return frame
 
-def drawTruthText(frame: cv2.Mat):
-    parser = FeatureParser(sourceImage=frame)
-    for key,feature in AccKeyFeatures.FeatureDict.items():
+def drawTruthText(frame: cv2.Mat, truths: np.ndarray = None):
+    if truths is None:
+        truths = extractor.evaluate(extractor.extract(frame))
+    for i, (key,feature) in enumerate(AccKeyFeatures.FeatureDict.items()):
         color = (0,0,255)
         font = cv2.FONT_HERSHEY_SIMPLEX
         scale = 0.2
-        parser.feature = feature
-        text = str(parser.evaluateThreshold())
+        text = str(truths[i])
         position = (feature.end_point[0] + 0, feature.end_point[1] + 10)
         if(any( x == key for x in ['MSDE', 'MSDF', 'LSDE', 'LSDF'])):
             position = (feature.end_point[0] + 0, feature.end_point[1] + 3)
@@ -129,39 +171,443 @@ def drawTruthText(frame: cv2.Mat):
                     font, scale, color, 1, cv2.LINE_AA)
     return frame
 
-def parseFrame(frame: cv2.Mat):
-    panelparser = AccPanelParser(sourceImage=frame)
+# Kept across frames so the socket and the negotiated wire format persist.
+panelparser = AccPanelParser(sourceImage=None)
+# Kept across frames so the markers are tracked rather than searched for.
+tracker = AccMarkerTracker()
+
+def parseFrame(frame: AccImage, timestamp: float = None):
+    panelparser.sourceImage = frame
     panelparser.parse()
     print(repr(panelparser._panel))
     print(str(panelparser._panel))
-    panelparser.transmit()
+    panelparser.transmit(timestamp)
+
+# Holds the newest item only. put() replaces an item that was not taken yet,
+# so a slow stage works on the latest frame instead of falling behind.
+class LatestQueue:
+    def __init__(self):
+        self._cond = threading.Condition()
+        self._item = None
+        self._full = False
+        self._weak = False
+        self._closed = False
+        self.dropped = 0
+    # A weak item is only put if the one waiting is weak too, so it never
+    # takes the place of an item that has to get through.
+    def put(self, item, weak: bool = False):
+        with self._cond:
+            if self._full and weak and not self._weak:
+                self.dropped = self.dropped + 1
+                return
+            if self._full:
+                self.dropped = self.dropped + 1
+            self._item = item
+            self._weak = weak
+            self._full = True
+            self._cond.notify()
+    # @returns the next item, or None once the queue is closed and empty.
+    def get(self):
+        with self._cond:
+            self._cond.wait_for(lambda: self._full or self._closed)
+            if not self._full:
+                return None
+            item = self._item
+            self._item = None
+            self._full = False
+            return item
+    def close(self):
+        with self._cond:
+            self._closed = True
+            self._cond.notify_all()
+
+# How long each stage takes, in milliseconds, since the last report.
+class StageTimes:
+    def __init__(self, names):
+        self._lock = threading.Lock()
+        self._names = names
+        self._reset()
+    def _reset(self):
+        self._since = time.monotonic()
+        self._count = dict.fromkeys(self._names, 0)
+        self._total = dict.fromkeys(self._names, 0.0)
+        self._max = dict.fromkeys(self._names, 0.0)
+    def add(self, name: str, seconds: float):
+        ms = seconds * 1000
+        with self._lock:
+            self._count[name] = self._count[name] + 1
+            self._total[name] = self._total[name] + ms
+            self._max[name] = max(self._max[name], ms)
+    def report(self) -> str:
+        with self._lock:
+            elapsed = time.monotonic() - self._since
+            text = []
+            for name in self._names:
+                n = self._count[name]
+                avg = self._total[name] / n if n else 0.0
+                text.append(f'{name} {n / elapsed:.1f} fps '
+                            f'{avg:.1f}/{self._max[name]:.1f} ms')
+            self._reset()
+            return ', '.join(text)
+
+# The headless loop: capture, normalize, parse and transmit each run in their
+# own thread, and hand the newest frame on to the next. Every frame that gets
+# through is parsed once, unless the gate finds nothing changed, in which case
+# the last panel is sent again marked as unchanged. On its way to the parser a
+# changed frame is only replaced by a newer changed one, and the gate compares
+# with it once it is parsed. capture is how old the average is when it is
+# taken, latency how old it is once transmitted.
+stagenames = ('capture', 'gate', 'normalize', 'parse', 'transmit', 'latency')
+
+def captureStage(cap: AccCapture, out: LatestQueue, times: StageTimes):
+    count = 0
+    while cap.isOpened():
+        ret, frame, timestamp, newcount = cap.read(newer=count)
+        if ret == False or newcount == count:
+            continue
+        times.add('capture', time.time() - timestamp)
+        count = newcount
+        out.put((frame, timestamp))
+    out.close()
+
+def normalizeStage(inq: LatestQueue, out: LatestQueue, times: StageTimes,
+                   gate: AccChangeGate):
+    while True:
+        item = inq.get()
+        if item is None:
+            break
+        frame, timestamp = item
+        start = time.perf_counter()
+        sample = gate.sample(frame, tracker.transform)
+        unchanged = gate.unchanged(sample)
+        times.add('gate', time.perf_counter() - start)
+        if unchanged:
+            out.put((None, timestamp, None), weak=True)
+            continue
+        start = time.perf_counter()
+        ai = AccImage(frame, tracker)
+        okay = ai.transform is not None
+        times.add('normalize', time.perf_counter() - start)
+        setledstatus(okay)
+        if okay:
+            out.put((ai, timestamp, sample))
+    out.close()
+
+def parseStage(inq: LatestQueue, out: LatestQueue, times: StageTimes,
+               gate: AccChangeGate):
+    panel = None
+    while True:
+        item = inq.get()
+        if item is None:
+            break
+        ai, timestamp, sample = item
+        if ai is None:
+            if panel is not None:
+                out.put((panel, timestamp, True))
+            continue
+        start = time.perf_counter()
+        panelparser.sourceImage = ai
+        panelparser.parse()
+        panel = panelparser._panel.copy()
+        times.add('parse', time.perf_counter() - start)
+        gate.commit(sample)
+        out.put((panel, timestamp, False))
+    out.close()
+
+def transmitStage(inq: LatestQueue, times: StageTimes):
+    last = None
+    while True:
+        item = inq.get()
+        if item is None:
+            break
+        panel, timestamp, unchanged = item
+        start = time.perf_counter()
+        panelparser.transmit(timestamp, panel, unchanged)
+        times.add('transmit', time.perf_counter() - start)
+        times.add('latency', time.time() - timestamp)
+        if str(panel) != last:
+            last = str(panel)
+            print(last)
+
+def runPipeline(cap: AccCapture, gate: AccChangeGate, 
+                interval: float) -> None:
+    times = StageTimes(stagenames)
+    queues = [LatestQueue() for i in range(3)]
+    stages = [
+        (captureStage, (cap, queues[0], times)),
+        (normalizeStage, (queues[0], queues[1], times, gate)),
+        (parseStage, (queues[1], queues[2], times, gate)),
+        (transmitStage, (queues[2], times)),
+    ]
+    threads = []
+    for stage, stageargs in stages:
+        t = threading.Thread(target=stage, args=stageargs, daemon=True)
+        t.start()
+        threads.append(t)
+    try:
+        while threads[-1].is_alive():
+            threads[-1].join(interval)
+            dropped = [q.dropped for q in queues]
+            print(f'{times.report()}, dropped {dropped}, '
+                  f'unchanged {gate.unchangedframes}')
+    except KeyboardInterrupt:
+        pass
+
+# The worker pool: frames are copied once into a ring of slots in shared
+# memory, and worker processes, each with its own tracker and parser,
+# normalize and parse them in parallel. Results come back tagged with the
+# sequence number of their frame and are transmitted in that order. When
+# every slot is in use the frame is dropped, as in the pipeline. Frames the
+# gate finds unchanged never reach the workers: they go into the results
+# with UNCHANGED for a panel, and the last panel is sent again. A frame whose
+# result has not come back after LOSTAFTER seconds went down with its worker:
+# it is skipped, and its slot is taken back.
+UNCHANGED = 'unchanged'
+LOSTAFTER = 1.0
+
+def poolWorker(shmname: str, slots: int, shape: tuple, scale: float,
+               thresholds: str, jobs: multiprocessing.Queue, 
+               results: multiprocessing.Queue):
+    shm = shared_memory.SharedMemory(name=shmname)
+    ring = np.ndarray((slots,) + shape, dtype=np.uint8, buffer=shm.buf)
+    workertracker = AccMarkerTracker()
+    parser = AccPanelParser(sourceImage=None, scale=scale, 
+                            thresholds=thresholds)
+    while True:
+        job = jobs.get()
+        if job is None:
+            break
+        seq, slot, timestamp = job
+        start = time.perf_counter()
+        ai = AccImage(ring[slot], workertracker)
+        transform = ai.transform
+        normalized = time.perf_counter()
+        panel = None
+        if transform is not None:
+            parser.sourceImage = ai
+            parser.parse()
+            p = parser._panel
+            # AccParsedPanel does not pickle, its values do.
+            panel = (p.fan.value, p.mode.value, p.delay.value, 
+                     p.msdigit, p.lsdigit, p.filterbad, p.margins)
+        results.put((seq, slot, timestamp, panel, transform,
+                     normalized - start, time.perf_counter() - normalized))
+    del ring
+    shm.close()
+
+# outstanding maps the sequence number of each frame handed to the workers to
+# its slot, when it was handed over and its gate sample, until its result is
+# back. The gate is committed to a frame once its panel is transmitted.
+def poolCollect(results: multiprocessing.Queue, free: queue.SimpleQueue,
+                outstanding: dict, gate: AccChangeGate, times: StageTimes,
+                transform: list):
+    pending = {}
+    nextseq = 0
+    filterbad = False
+    last = None
+    lastpanel = None
+    while True:
+        try:
+            result = results.get(timeout=LOSTAFTER)
+        except queue.Empty:
+            result = None
+        if result is not None:
+            (seq, slot, timestamp, panel, 
+             frametransform, normalizetime, parsetime) = result
+            if seq is None:
+                break
+            sample = None
+            if panel != UNCHANGED:
+                job = outstanding.pop(seq, None)
+                if job is None:
+                    # Skipped as lost already, and its slot taken back.
+                    continue
+                sample = job[2]
+                free.put(slot)
+                transform[0] = frametransform
+                times.add('normalize', normalizetime)
+                if panel is not None:
+                    times.add('parse', parsetime)
+            pending[seq] = (timestamp, panel, sample)
+        while True:
+            job = outstanding.get(nextseq)
+            if job is not None and time.monotonic() - job[1] > LOSTAFTER:
+                # A worker died with the next frame. Don't wait for it forever.
+                del outstanding[nextseq]
+                free.put(job[0])
+                nextseq = nextseq + 1
+                continue
+            if nextseq not in pending:
+                break
+            timestamp, panel, sample = pending.pop(nextseq)
+            nextseq = nextseq + 1
+            unchanged = panel == UNCHANGED
+            if unchanged:
+                panel = lastpanel
+            else:
+                setledstatus(panel is not None)
+            if panel is None:
+                continue
+            if not unchanged:
+                fan, mode, delay, msdigit, lsdigit, bad, margins = panel
+                # Once seen, a bad filter stays, as in AccPanelParser.
+                filterbad = filterbad or bad
+                panel = AccParsedPanel(AccPanelFan(fan), AccPanelMode(mode),
+                                       AccPanelDelay(delay), msdigit, lsdigit,
+                                       filterbad)
+                panel.margins = margins
+                lastpanel = panel
+                gate.commit(sample)
+            start = time.perf_counter()
+            panelparser.transmit(timestamp, panel, unchanged)
+            times.add('transmit', time.perf_counter() - start)
+            times.add('latency', time.time() - timestamp)
+            if str(panel) != last:
+                last = str(panel)
+                print(last)
+
+def runPool(cap: AccCapture, gate: AccChangeGate, workers: int, 
+            scale: float, thresholds: str, interval: float) -> None:
+    times = StageTimes(stagenames)
+    context = multiprocessing.get_context('spawn')
+    count = 0
+    while cap.isOpened():
+        ret, frame, timestamp, count = cap.read(newer=count)
+        if ret == True:
+            break
+    if not cap.isOpened():
+        return
+    shape = frame.shape
+    slots = 2 * workers
+    shm = shared_memory.SharedMemory(create=True, size=slots * frame.nbytes)
+    ring = np.ndarray((slots,) + shape, dtype=np.uint8, buffer=shm.buf)
+    jobs = context.Queue()
+    results = context.Queue()
+    free = queue.SimpleQueue()
+    for slot in range(slots):
+        free.put(slot)
+    pool = [context.Process(target=poolWorker, daemon=True,
+                            args=(shm.name, slots, shape, scale, thresholds,
+                                  jobs, results))
+            for i in range(workers)]
+    for p in pool:
+        p.start()
+    outstanding = {}
+    transform = [None]      # the last one a worker found
+    collector = threading.Thread(target=poolCollect, daemon=True,
+                                 args=(results, free, outstanding, gate,
+                                       times, transform))
+    collector.start()
+
+    seq = 0
+    dropped = 0
+    reported = time.monotonic()
+    try:
+        while cap.isOpened():
+            if ret == True and frame.shape == shape:
+                times.add('capture', time.time() - timestamp)
+                start = time.perf_counter()
+                sample = gate.sample(frame, transform[0])
+                unchanged = gate.unchanged(sample)
+                times.add('gate', time.perf_counter() - start)
+            if ret == True and frame.shape == shape and unchanged:
+                results.put((seq, None, timestamp, UNCHANGED, None, 0, 0))
+                seq = seq + 1
+            elif ret == True and frame.shape == shape:
+                try:
+                    slot = free.get_nowait()
+                    np.copyto(ring[slot], frame)
+                    outstanding[seq] = (slot, time.monotonic(), sample)
+                    jobs.put((seq, slot, timestamp))
+                    seq = seq + 1
+                except queue.Empty:
+                    dropped = dropped + 1
+            if time.monotonic() - reported >= interval:
+                reported = time.monotonic()
+                print(f'{times.report()}, dropped {dropped}, '
+                      f'unchanged {gate.unchangedframes}')
+            newer = count
+            ret, frame, timestamp, count = cap.read(newer=newer)
+            if count == newer:
+                ret = False
+    except KeyboardInterrupt:
+        pass
+    for p in pool:
+        jobs.put(None)
+    for p in pool:
+        p.join(1.0)
+    results.put((None, None, 0, None, None, 0, 0))
+    collector.join(1.0)
+    del ring
+    shm.close()
+    shm.unlink()
 
 def main() -> int:
+    argparser = argparse.ArgumentParser(description='AC panel machine vision')
+    argparser.add_argument('--source', default='udp://@:5000',
+                           help='video source to read the panel from')
+    argparser.add_argument('--port', type=int, default=64000,
+                           help='acc-control machvis port of this AC unit')
+    argparser.add_argument('--scale', type=float, default=1.0,
+                           help='samples per normalized pixel of a feature')
+    argparser.add_argument('--debug', action='store_true',
+                           help='show the feed and the normalized panel')
+    argparser.add_argument('--stats', type=float, default=60.0,
+                           help='seconds between timing reports')
+    argparser.add_argument('--thresholds',
+                           help='thresholds file from tunethresholds.py')
+    argparser.add_argument('--gate', type=float, default=6,
+                           help='colour change of a feature that makes the '
+                                'panel parsed again, or 0 to parse every frame')
+    argparser.add_argument('--force', type=float, default=5.0,
+                           help='seconds after which the panel is parsed '
+                                'again, changed or not')
+    argparser.add_argument('--workers', type=int, default=0,
+                           help='worker processes to parse frames in, '
+                                'or 0 for the threaded pipeline')
+    args = argparser.parse_args()
+    panelparser._socketport = args.port
+    panelparser.extractor.scale = args.scale
+    if args.thresholds is not None:
+        AccKeyFeatures.loadThresholds(args.thresholds)
+
     try:
-        cap = AccCapture("udp://@:5000", cv2.CAP_FFMPEG, nframes=5)
+        cap = AccCapture(args.source, cv2.CAP_FFMPEG, nframes=5)
     except:
         print("Could not open VideoCapture!")
         print(cap)
 
+    # Without windows to show, there is nothing to keep on the main thread.
+    if not args.debug:
+        gate = AccChangeGate(args.gate, args.force)
+        if args.workers > 0:
+            runPool(cap, gate, args.workers, args.scale, args.thresholds,
+                    args.stats)
+        else:
+            runPipeline(cap, gate, args.stats)
+        print("Capture was closed.")
+        cap.release()
+        return 0
+
+    lastcount = 0
     while(cap.isOpened()):
-        ret, frame = cap.read()
+        ret, frame, timestamp, count = cap.read(newer=lastcount)
+        if ret == False or count == lastcount:
+            # Nothing new yet. Don't parse the same average twice.
+            continue
+        lastcount = count
         if(ret == True):
-            ai = AccImage(frame)
-            normframe = ai.norm
-            try:
-                cv2.imshow("Live feed", frame)
-                skipdrawing = false
-            except:
-                skipdrawing = True
-                pass
-            if normframe is not None:
-                parseFrame(normframe)
-                # Parse FIRST. The functions below alter normimage!!!
-                if not skipdrawing:
-                    normframe = drawRectangles(normframe)
-                    normframe = drawHSVText(normframe)
-                    normframe = drawTruthText(normframe)
-                    cv2.imshow("Normalized live feed", normframe)
+            ai = AccImage(frame, tracker)
+            cv2.imshow("Live feed", frame)
+            if ai.transform is not None:
+                parseFrame(ai, timestamp)
+                # Only the feature rectangles were warped to parse. The whole
+                # panel is warped for debugging only.
+                normframe = ai.norm
+                normframe = drawRectangles(normframe)
+                normframe = drawHSVText(normframe, panelparser.means)
+                normframe = drawTruthText(normframe, panelparser.truths)
+                cv2.imshow("Normalized live feed", normframe)
                 setledstatus(okay=True)
             else:
                 setledstatus(okay=False)
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+
+# benchvision.py
+# Runs AccImage and AccPanelParser over the labelled image sets, in parallel,
+# and reports how often the markers are found, how often each field comes
+# out right, and how long each stage takes, as one JSON object per set:
+#
+#   utils/hostside/benchvision.py [--transform t.json] [sets...]
+#
+# The stages are detect (rotating and finding the markers), warp (sampling
+# the feature rectangles), hsv, features (averages and thresholds) and
+# decode. Every photo is timed from a cold tracker, like the first frame of
+# a capture. Photos where the markers are not found count as wrong, unless
+# --transform gives one to fall back on.
+
+import os
+import sys
+import json
+import time
+import argparse
+import contextlib
+import io
+import multiprocessing
+import cv2
+import numpy as np
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(here, '..', '..'))
+from accvis import *
+from dataset import *
+
+stages = ('detect', 'warp', 'hsv', 'features', 'decode')
+fields = ('temperature', 'fan', 'mode', 'delay')
+
+# Set up in every worker by setupWorker
+fallback = None
+repeat = 1
+extractor = None
+
+def setupWorker(transformpath: str, repeats: int, scale: float):
+    global fallback, repeat, extractor
+    fallback = loadTransform(transformpath)
+    repeat = repeats
+    extractor = FeatureExtractor(scale=scale)
+
+def measure(label: Label) -> dict:
+    image = cv2.imread(label.path)
+    times = {stage: [] for stage in stages}
+    parser = AccPanelParser(sourceImage=None)
+    parser._extractor = extractor
+    detected = False
+    parsed = False
+    for i in range(repeat):
+        start = time.perf_counter()
+        with contextlib.redirect_stdout(io.StringIO()):
+            src = AccImage(image).src
+            transform = AccMarkerTracker().locate(src)
+        times['detect'].append(time.perf_counter() - start)
+        detected = transform is not None
+        if transform is None:
+            transform = fallback
+        if transform is None:
+            continue
+        parsed = True
+        start = time.perf_counter()
+        strip = extractor.warpStrip(src, transform)
+        warped = time.perf_counter()
+        strip = extractor.convertStrip(strip)
+        converted = time.perf_counter()
+        truths = extractor.evaluate(extractor.reduceWarped(strip))
+        reduced = time.perf_counter()
+        parser.decode(truths)
+        decoded = time.perf_counter()
+        times['warp'].append(warped - start)
+        times['hsv'].append(converted - warped)
+        times['features'].append(reduced - converted)
+        times['decode'].append(decoded - reduced)
+    result = {'path': os.path.basename(label.path),
+              'lighting': label.lighting,
+              'detected': detected, 'parsed': parsed, 'times': times}
+    if parsed:
+        panel = parser._panel
+        msd, lsd = panel.msdigit, panel.lsdigit
+        temperature = -1 if msd < 0 or lsd < 0 else 10 * msd + lsd
+        got = {'temperature': temperature, 'fan': panel.fan.value,
+               'mode': panel.mode.value, 'delay': panel.delay.value}
+        result['got'] = got
+        result['right'] = {f: got[f] == getattr(label, f) for f in fields}
+    else:
+        result['right'] = dict.fromkeys(fields, False)
+    return result
+
+def percentiles(values: list) -> dict:
+    if not values:
+        return None
+    ms = np.array(values) * 1000
+    return {'p50': round(float(np.percentile(ms, 50)), 3),
+            'p90': round(float(np.percentile(ms, 90)), 3),
+            'p99': round(float(np.percentile(ms, 99)), 3)}
+
+def summarize(name: str, results: list, swapped: int) -> dict:
+    n = len(results)
+    right = {f: sum(r['right'][f] for r in results) for f in fields}
+    right['all'] = sum(all(r['right'].values()) for r in results)
+    return {
+        'set': name,
+        'images': n,
+        'detected': sum(r['detected'] for r in results),
+        'detection_rate': round(sum(r['detected'] for r in results) / n, 3),
+        'parsed': sum(r['parsed'] for r in results),
+        'accuracy': {f: round(right[f] / n, 3) for f in right},
+        'latency_ms': {s: percentiles([t for r in results
+                                        for t in r['times'][s]])
+                       for s in stages},
+        'swapped_labels': swapped,
+    }
+
+def main() -> int:
+    argparser = argparse.ArgumentParser(
+        description='Accuracy and latency of the vision over labelled photos')
+    argparser.add_argument('sets', nargs='*', default=defaultsets,
+                           help='directories with an aaa-metadata.csv')
+    argparser.add_argument('--transform',
+                           help='JSON transform for photos without markers')
+    argparser.add_argument('--repeat', type=int, default=5,
+                           help='times every photo is run, for the timings')
+    argparser.add_argument('--scale', type=float, default=1.0,
+                           help='samples per normalized pixel of a feature')
+    argparser.add_argument('--jobs', type=int, default=os.cpu_count(),
+                           help='worker processes')
+    argparser.add_argument('--images', action='store_true',
+                           help='also print every photo')
+    args = argparser.parse_args()
+
+    with multiprocessing.Pool(args.jobs, setupWorker,
+                              (args.transform, args.repeat, args.scale)) as pool:
+        for directory in args.sets:
+            labels, swapped = readSet(directory)
+            results = pool.map(measure, labels)
+            if args.images:
+                for r in results:
+                    r = dict(r)
+                    del r['times']
+                    print(json.dumps(r))
+            name = os.path.basename(os.path.normpath(directory))
+            print(json.dumps(summarize(name, results, swapped)))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+
+# comparewarp.py
+# Compares the features warped sparsely out of the camera frames, at a few
+# scales, with the ones of the fully warped panel, and how long each takes.
+#
+#   utils/hostside/comparewarp.py [images...]
+#
+# Defaults to imgs/with_four_aruco. Images without all four markers are
+# skipped.
+
+import os
+import sys
+import glob
+import time
+import contextlib
+import io
+import cv2
+import numpy as np
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(here, '..', '..'))
+from accvis import *
+
+scales = (1.0, 0.5, 0.25)
+repeats = 50
+
+def timeit(fn):
+    start = time.perf_counter()
+    for i in range(repeats):
+        result = fn()
+    return result, (time.perf_counter() - start) / repeats * 1000
+
+def main() -> int:
+    paths = sys.argv[1:]
+    if not paths:
+        paths = sorted(glob.glob(os.path.join(here, '..', '..',
+                                              'imgs', 'with_four_aruco', '*.jpg')))
+    full = FeatureExtractor()
+    sparse = FeatureExtractor()
+    for path in paths:
+        with contextlib.redirect_stdout(io.StringIO()):
+            ai = AccImage(cv2.imread(path))
+            transform = ai.transform
+        if transform is None:
+            print(f'{os.path.basename(path)}: markers not found, skipped')
+            continue
+        def fullwarp():
+            norm = cv2.warpPerspective(ai.src, transform,
+                                       AccMarkerTracker.NORMSIZE)
+            return full.extract(norm)
+        means, ms = timeit(fullwarp)
+        truths = full.evaluate(means)
+        print(f'{os.path.basename(path)}: full warp {ms:.2f} ms')
+        for scale in scales:
+            sparse.scale = scale
+            smeans, sms = timeit(lambda: sparse.extractWarped(ai.src, transform))
+            diff = np.abs(smeans.astype(int) - means.astype(int))
+            flips = [sparse.names[i] for i in
+                     np.flatnonzero(sparse.evaluate(smeans) != truths)]
+            print(f'  scale {scale:4}: {sms:.2f} ms, HSV off by {diff.mean():.2f}'
+                  f' on average, {diff.max()} at most, truths differ: {flips}')
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,57 @@
+# dataset.py
+# Reads the labelled image sets, the aaa-metadata.csv next to the photos in
+# imgs/, for benchvision.py and tunethresholds.py.
+
+import os
+import csv
+import json
+from dataclasses import dataclass
+import numpy as np
+
+here = os.path.dirname(os.path.abspath(__file__))
+imgs = os.path.join(here, '..', '..', 'imgs')
+defaultsets = [os.path.join(imgs, 'raw'), os.path.join(imgs, 'with_aruco')]
+
+# Label values, as AccPanelFan, AccPanelMode and AccPanelDelay number them.
+fans   = {'none': 0, 'auto': 1, 'high': 2, 'med': 3, 'low': 4}
+modes  = {'none': 0, 'cool': 1, 'fan': 2, 'eco': 3}
+delays = {'none': 0, 'on': 1, 'off': 2}
+
+@dataclass
+class Label:
+    path: str
+    temperature: int        # -1 if the display is off
+    fan: int
+    mode: int
+    delay: int
+    lighting: str
+
+def readSet(directory: str):
+    """ @returns the labels of the photos in directory, and how many rows
+        had the fan and the mode the wrong way round, which are fixed.
+    """
+    labels = []
+    swapped = 0
+    with open(os.path.join(directory, 'aaa-metadata.csv'), newline='') as f:
+        for row in csv.DictReader(f):
+            fan, mode = row['fan'], row['mode']
+            if fan not in fans and mode not in modes and \
+               fan in modes and mode in fans:
+                fan, mode = mode, fan
+                swapped = swapped + 1
+            temperature = row['temperature']
+            labels.append(Label(
+                os.path.join(directory, row['filename']),
+                int(temperature) if temperature.isdigit() else -1,
+                fans[fan], modes[mode], delays[row['delay']],
+                row['lighting']))
+    return labels, swapped
+
+def loadTransform(path: str):
+    """ A camera that does not see the markers can still be measured with
+        a transform found some other way, saved as {"transform": 3x3}.
+    """
+    if path is None:
+        return None
+    with open(path) as f:
+        return np.array(json.load(f)['transform'], dtype=np.float64)
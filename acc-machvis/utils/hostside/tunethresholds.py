@@ -0,0 +1,243 @@
+#!/usr/bin/env python3
+
+# tunethresholds.py
+# Finds the ledThreshold and sevenThreshold of AccKeyFeatures that read the
+# labelled photos best, and writes them to a file for
+# AccKeyFeatures.loadThresholds (machvis.py --thresholds):
+#
+#   utils/hostside/tunethresholds.py [--transform t.json] -o thresholds.json
+#
+# The HSV averages of every feature of every photo are worked out once and
+# kept in a memory-mapped cache, which the search workers share. Fan, mode
+# and delay only depend on the LED threshold, and the temperature only on
+# the segment one, so the two are searched apart. The LED value is tried at
+# every level. The segments are searched over a grid of hue, hue window and
+# value, split by hue across the worker processes. Ties go to the thresholds
+# furthest from any photo's value.
+
+import os
+import sys
+import json
+import time
+import argparse
+import contextlib
+import io
+import multiprocessing
+import cv2
+import numpy as np
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(here, '..', '..'))
+from accvis import *
+from dataset import *
+
+names = list(AccKeyFeatures.FeatureDict.keys())
+column = {name: i for i, name in enumerate(names)}
+fanleds = [column[n] for n in ('FanAuto', 'FanHigh', 'FanMed', 'FanLow')]
+modeleds = [column[n] for n in ('ModeCool', 'ModeFan', 'ModeEco')]
+delayleds = [column[n] for n in ('DelayOn', 'DelayOff')]
+leds = fanleds + modeleds + delayleds
+segments = [column[d + s] for d in ('MSD', 'LSD') for s in 'ABCDEFG']
+
+# Digit of every combination of lit segments, a as the lowest bit, or -1.
+digits = np.full(128, -1, dtype=np.int16)
+for digit, segs in ((0, 'abcdef'), (1, 'bc'), (2, 'abdeg'), (3, 'abcdg'),
+                    (4, 'bcfg'), (5, 'acdfg'), (6, 'acdefg'), (7, 'abc'),
+                    (8, 'abcdefg'), (9, 'abcdfg')):
+    digits[sum(1 << 'abcdefg'.index(s) for s in segs)] = digit
+
+# --- The cache ---
+
+fallback = None
+extractor = None
+
+def setupCacheWorker(transformpath: str):
+    global fallback, extractor
+    fallback = loadTransform(transformpath)
+    extractor = FeatureExtractor()
+
+def averages(path: str):
+    with contextlib.redirect_stdout(io.StringIO()):
+        src = AccImage(cv2.imread(path)).src
+        transform = AccMarkerTracker().locate(src)
+    if transform is None:
+        transform = fallback
+    if transform is None:
+        return None
+    return extractor.extractWarped(src, transform)
+
+def buildCache(cache: str, sets: list, transform: str, jobs: int):
+    labels = []
+    for directory in sets:
+        labels = labels + readSet(directory)[0]
+    with multiprocessing.Pool(jobs, setupCacheWorker, (transform,)) as pool:
+        means = pool.map(averages, [l.path for l in labels])
+    kept = [i for i, m in enumerate(means) if m is not None]
+    if not kept:
+        return None
+    data = np.memmap(cache + '.u8', dtype=np.uint8, mode='w+',
+                     shape=(len(kept), len(names), 3))
+    for row, i in enumerate(kept):
+        data[row] = means[i]
+    data.flush()
+    meta = {'features': names,
+            'sets': sets,
+            'transform': transform,
+            'skipped': len(labels) - len(kept),
+            'labels': [vars(labels[i]) for i in kept]}
+    with open(cache + '.json', 'w') as f:
+        json.dump(meta, f)
+    return meta
+
+def openCache(cache: str):
+    with open(cache + '.json') as f:
+        meta = json.load(f)
+    data = np.memmap(cache + '.u8', dtype=np.uint8, mode='r',
+                     shape=(len(meta['labels']), len(meta['features']), 3))
+    return meta, data
+
+# --- The search ---
+
+cached = None
+truth = None
+
+def setupSearchWorker(cache: str):
+    global cached, truth
+    meta, cached = openCache(cache)
+    truth = {f: np.array([l[f] for l in meta['labels']])
+             for f in ('temperature', 'fan', 'mode', 'delay')}
+
+# Like AccPanelParser._rowdecode, for every photo and threshold at once.
+def rowdecode(lit: np.ndarray) -> np.ndarray:
+    return np.where(lit.any(axis=-1), lit.argmax(axis=-1) + 1, 0)
+
+def ledScores(levels: np.ndarray):
+    lit = cached[None, :, leds, 2] > levels[:, None, None]
+    n = len(fanleds)
+    m = n + len(modeleds)
+    right = {
+        'fan':   rowdecode(lit[..., :n]) == truth['fan'],
+        'mode':  rowdecode(lit[..., n:m]) == truth['mode'],
+        'delay': rowdecode(lit[..., m:]) == truth['delay'],
+    }
+    return right
+
+def searchLeds(unused=None):
+    levels = np.arange(256)
+    right = ledScores(levels)
+    score = sum(r.sum(axis=1) for r in right.values())
+    margin = np.abs(cached[None, :, leds, 2].astype(int) -
+                    levels[:, None, None]).min(axis=(1, 2))
+    best = np.lexsort((margin, score))[-1]
+    return int(levels[best]), {f: float(r[best].mean())
+                               for f, r in right.items()}
+
+# The segments over every level, as bits of the digit they are in. They
+# don't depend on the hue, so searchSegments works them out once.
+def brightSegments(levels: np.ndarray) -> np.ndarray:
+    weights = (1 << (np.arange(14) % 7)).astype(np.uint8)
+    bright = cached[None, :, segments, 2] > levels[:, None, None]
+    return bright * weights
+
+def temperatures(hue: int, below: int, above: int, bright: np.ndarray):
+    h = cached[:, segments, 0].astype(int)
+    inwindow = (h >= hue - below) & (h <= hue + above)
+    lit = bright * inwindow[None]
+    codes = lit.reshape(lit.shape[:2] + (2, 7)).sum(axis=-1)
+    msd, lsd = digits[codes[..., 0]], digits[codes[..., 1]]
+    return np.where((msd < 0) | (lsd < 0), -1, 10 * msd + lsd)
+
+def searchSegments(task):
+    hue, windows = task
+    levels = np.arange(256)
+    margin = np.abs(cached[None, :, segments, 2].astype(int) -
+                    levels[:, None, None]).min(axis=(1, 2))
+    bright = brightSegments(levels)
+    best = None
+    for below in windows:
+        for above in windows:
+            right = (temperatures(hue, below, above, bright) ==
+                     truth['temperature']).sum(axis=1)
+            i = np.lexsort((margin, right))[-1]
+            candidate = (int(right[i]), int(margin[i]),
+                         {'hue': hue, 'val': int(levels[i]),
+                          'huebelow': int(below), 'hueabove': int(above)})
+            if best is None or candidate[0:2] > best[0:2]:
+                best = candidate
+    return best
+
+def currentScores() -> dict:
+    led = AccKeyFeatures.ledThreshold
+    seven = AccKeyFeatures.sevenThreshold
+    right = ledScores(np.array([led.val]))
+    scores = {f: float(r[0].mean()) for f, r in right.items()}
+    t = temperatures(seven.hue, seven.huebelow, seven.hueabove,
+                     brightSegments(np.array([seven.val])))
+    scores['temperature'] = float((t[0] == truth['temperature']).mean())
+    return scores
+
+def main() -> int:
+    argparser = argparse.ArgumentParser(
+        description='Tune the feature thresholds on the labelled photos')
+    argparser.add_argument('sets', nargs='*', default=defaultsets,
+                           help='directories with an aaa-metadata.csv')
+    argparser.add_argument('-o', '--output', default='thresholds.json',
+                           help='thresholds file to write')
+    argparser.add_argument('--cache', default='/tmp/acc-machvis-features',
+                           help='feature cache, without the extension')
+    argparser.add_argument('--rebuild', action='store_true',
+                           help='work out the cached features again')
+    argparser.add_argument('--transform',
+                           help='JSON transform for photos without markers')
+    argparser.add_argument('--hue-step', type=int, default=2,
+                           help='segment hues tried, in steps of')
+    argparser.add_argument('--window-step', type=int, default=5,
+                           help='segment hue windows tried, in steps of')
+    argparser.add_argument('--jobs', type=int, default=os.cpu_count(),
+                           help='worker processes')
+    args = argparser.parse_args()
+
+    start = time.perf_counter()
+    if not args.rebuild and os.path.exists(args.cache + '.json'):
+        meta = openCache(args.cache)[0]
+        # Photos, features and transform all have to be the ones asked for.
+        args.rebuild = (meta.get('features') != names or
+                        meta.get('sets') != args.sets or
+                        meta.get('transform') != args.transform)
+    if args.rebuild or not os.path.exists(args.cache + '.json'):
+        meta = buildCache(args.cache, args.sets, args.transform, args.jobs)
+        if meta is None:
+            print('No photo could be normalized. Without the four markers, '
+                  'give a --transform.', file=sys.stderr)
+            return 1
+    cachetime = time.perf_counter() - start
+
+    start = time.perf_counter()
+    setupSearchWorker(args.cache)
+    windows = range(0, 61, args.window_step)
+    tasks = [(hue, windows) for hue in range(0, 180, args.hue_step)]
+    with multiprocessing.Pool(args.jobs, setupSearchWorker,
+                              (args.cache,)) as pool:
+        led = pool.apply_async(searchLeds)
+        segmentresults = pool.map(searchSegments, tasks)
+        ledval, ledscores = led.get()
+    right, margin, seven = max(segmentresults, key=lambda r: r[0:2])
+    searchtime = time.perf_counter() - start
+
+    n = len(cached)
+    result = {
+        'led': {'val': ledval},
+        'seven': seven,
+        'images': n,
+        'accuracy': dict(ledscores, temperature=right / n),
+        'before': currentScores(),
+    }
+    with open(args.output, 'w') as f:
+        json.dump(result, f, indent=4)
+    print(json.dumps(result))
+    print(f'cache {cachetime:.2f} s, search {searchtime:.2f} s',
+          file=sys.stderr)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())